@@ -0,0 +1,47 @@
+#include <arena.hpp>
+#include <new>
+
+namespace tws {
+
+Arena::Arena(size_t initial_size)
+    : first_size_(initial_size),
+      extra_(NULL)
+{
+    first_ = (char *)::operator new(first_size_);
+    ptr_ = first_;
+    end_ = first_ + first_size_;
+}
+
+Arena::~Arena()
+{
+    reset();
+    ::operator delete(first_);
+}
+
+void *Arena::grow(size_t n, size_t align)
+{
+    // at least double the first block, big ones get their own block
+    size_t size = first_size_ * 2;
+    if (size < n + align)
+        size = n + align;
+    Block *b = (Block *)::operator new(sizeof(Block) + size);
+    b->next = extra_;
+    b->size = size;
+    extra_ = b;
+    ptr_ = (char *)(b + 1);
+    end_ = ptr_ + size;
+    return allocate(n, align);
+}
+
+void Arena::reset()
+{
+    while (extra_) {
+        Block *next = extra_->next;
+        ::operator delete(extra_);
+        extra_ = next;
+    }
+    ptr_ = first_;
+    end_ = first_ + first_size_;
+}
+
+}
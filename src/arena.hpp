@@ -0,0 +1,86 @@
+#ifndef _ARENA_HPP_
+#define _ARENA_HPP_
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace tws{
+
+/* Monotonic allocator for objects living no longer than one request.
+ * allocation is a pointer bump, deallocation does nothing, and reset()
+ * drops everything at once, keeping the first block for next request.
+ * objects in it must not need their destructors to run */
+class Arena
+{
+    struct Block {
+        Block *next;
+        size_t size;
+    };
+
+    char *first_;
+    size_t first_size_;
+    char *ptr_;
+    char *end_;
+    Block *extra_;  // blocks added when first one is used up
+
+    void *grow(size_t n, size_t align);
+
+    Arena(const Arena&);
+    Arena &operator=(const Arena&);
+
+public:
+    explicit Arena(size_t initial_size = 8192);
+    ~Arena();
+
+    void *allocate(size_t n, size_t align = sizeof(void *))
+    {
+        uintptr_t p = ((uintptr_t)ptr_ + align - 1) & ~(uintptr_t)(align - 1);
+        if (p + n <= (uintptr_t)end_) {
+            ptr_ = (char *)(p + n);
+            return (void *)p;
+        }
+        return grow(n, align);
+    }
+
+    // copy of data, not terminated by '\0'
+    const char *copy(const char *data, size_t len)
+    {
+        char *p = (char *)allocate(len, 1);
+        if (len > 0)
+            ::memcpy(p, data, len);
+        return p;
+    }
+
+    void reset();
+};
+
+/* STL allocator on an Arena, for containers that are thrown away
+ * together with the arena */
+template <typename T>
+class ArenaAllocator
+{
+    template <typename U> friend class ArenaAllocator;
+    Arena *arena_;
+
+public:
+    typedef T value_type;
+
+    explicit ArenaAllocator(Arena *arena) : arena_(arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena_(other.arena_) {}
+
+    T *allocate(size_t n) 
+    { return (T *)arena_->allocate(n * sizeof(T), alignof(T)); }
+    void deallocate(T *, size_t) {}
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> &other) const 
+    { return arena_ == other.arena_; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U> &other) const 
+    { return arena_ != other.arena_; }
+};
+
+}
+
+#endif
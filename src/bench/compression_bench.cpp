@@ -0,0 +1,101 @@
+// Microbenchmark of response compression, single thread.
+// Compares the old zlib_compress (deflateInit/deflateEnd per call, 
+// copied out through a stack buffer) with compress_to, which reuses
+// the thread's z_stream and deflates into a reused output string.
+//
+// Usage: compression_bench [total_mb=64]
+
+#include <zlib_compression.hpp>
+#include <zlib.h>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+namespace {
+
+// the compression path used before compress_to, kept for comparison
+std::string legacy_compress(const std::string& str, int level)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit(&zs, level) != Z_OK)
+        return "";
+    zs.next_in = (Bytef*)str.data();
+    zs.avail_in = str.size();
+
+    int ret;
+    char outbuffer[32768];
+    std::string outstring;
+    do {
+        zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
+        zs.avail_out = sizeof(outbuffer);
+        ret = deflate(&zs, Z_FINISH);
+        if (outstring.size() < zs.total_out) 
+            outstring.append(outbuffer, zs.total_out - outstring.size());
+    } while (ret == Z_OK);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END ? outstring : "";
+}
+
+// monitoring-page like text
+std::string make_body(size_t size)
+{
+    std::string body = "<html><body><table>\n";
+    unsigned seed = 12345;
+    while (body.size() < size) {
+        seed = seed * 1103515245 + 12345;
+        char line[128];
+        snprintf(line, sizeof(line), 
+                "<tr><td>worker-%u</td><td>qps %u</td><td>latency %u.%02u ms</td></tr>\n",
+                (seed >> 8) % 64, (seed >> 4) % 100000, (seed >> 12) % 50, seed % 100);
+        body += line;
+    }
+    body.resize(size);
+    return body;
+}
+
+double cpu_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    size_t total_mb = 64;
+    if (argc > 1)
+        total_mb = atoi(argv[1]);
+
+    size_t sizes[] = {1024, 16 * 1024, 256 * 1024};
+    int level = 5;
+    printf("%-10s %16s %16s %8s\n", "body", "legacy ms/MB", "reuse ms/MB", "speedup");
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        std::string body = make_body(sizes[i]);
+        size_t rounds = total_mb * 1024 * 1024 / body.size();
+        size_t sink = 0;
+
+        double t = cpu_seconds();
+        for(size_t r = 0; r < rounds; r++)
+            sink += legacy_compress(body, level).size();
+        double legacy = (cpu_seconds() - t) * 1000 / total_mb;
+
+        std::string out;
+        t = cpu_seconds();
+        for(size_t r = 0; r < rounds; r++) {
+            tws::compress_to(body.data(), body.size(), level, 
+                    tws::COMPRESS_DEFLATE, out);
+            sink += out.size();
+        }
+        double reuse = (cpu_seconds() - t) * 1000 / total_mb;
+
+        if (sink == 0)
+            fprintf(stderr, "compression failed\n");
+        printf("%-10zu %16.2f %16.2f %7.2fx\n", sizes[i], legacy, reuse, legacy / reuse);
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+// Builds coroutine.hpp, which needs C++20 while the server is C++11,
+// and checks a co_handler route over loopback: a /wait route that
+// suspends on a timer, and one whose coroutine throws.
+//
+// Usage: coroutine_check [port=18081]
+
+#include <coroutine.hpp>
+#include <thread>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#if !defined(BOOST_ASIO_HAS_CO_AWAIT)
+#error "coroutine_check needs C++20 coroutines"
+#endif
+
+namespace {
+
+// one request on its own connection, returns the whole response
+std::string fetch(int port, const char *path)
+{
+    using boost::asio::ip::tcp;
+    boost::asio::io_context io;
+    tcp::socket socket(io);
+    socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+    std::string request = std::string("GET ") + path +
+        " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    boost::asio::write(socket, boost::asio::buffer(request));
+    std::string response;
+    boost::system::error_code ec;
+    boost::asio::read(socket, boost::asio::dynamic_buffer(response), ec);
+    return response;
+}
+
+bool check(int port, const char *path, const char *status, const char *body)
+{
+    std::string response = fetch(port, path);
+    bool ok = response.compare(0, strlen(status), status) == 0 &&
+        response.size() >= strlen(body) &&
+        response.compare(response.size() - strlen(body), std::string::npos, body) == 0;
+    fprintf(stderr, "%-8s %s\n", path, ok ? "ok" : "FAILED");
+    if (!ok)
+        fprintf(stderr, "%s\n", response.c_str());
+    return ok;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    int port = argc > 1 ? atoi(argv[1]) : 18081;
+
+    tws::HttpServer server(port);
+    server.route_async(tws::HTTP_GET, "/wait",
+        tws::co_handler([](tws::Responder r) -> boost::asio::awaitable<int> {
+            boost::asio::steady_timer t(co_await boost::asio::this_coro::executor,
+                    std::chrono::milliseconds(100));
+            co_await t.async_wait(boost::asio::use_awaitable);
+            r.response().set_body("waited\n");
+            co_return tws::HTTP_200;
+        }));
+    server.route_async(tws::HTTP_GET, "/throw",
+        tws::co_handler([](tws::Responder) -> boost::asio::awaitable<int> {
+            co_await boost::asio::post(co_await boost::asio::this_coro::executor,
+                    boost::asio::use_awaitable);
+            throw std::runtime_error("failed");
+        }));
+    std::thread server_thread(&tws::HttpServer::run, &server);
+    // let the acceptor start
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    bool ok = check(port, "/wait", "HTTP/1.1 200", "waited\n");
+    ok = check(port, "/throw", "HTTP/1.1 500", "") && ok;
+
+    server.stop();
+    server_thread.join();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,424 @@
+#include "load_gen.hpp"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <deque>
+#include <thread>
+
+namespace {
+
+using tws::LoadConfig;
+using tws::LoadResult;
+using tws::Histogram;
+
+struct Conn
+{
+    int fd;
+    std::string out;
+    size_t out_off;
+    std::string in;
+    std::deque<uint64_t> sent;  // queue times of requests in flight
+    bool closing;               // no more requests, waiting for close
+    bool want_write;
+};
+
+class Worker
+{
+public:
+    Worker(const LoadConfig &config, const std::string &request,
+            const sockaddr_in &addr, int connections,
+            uint64_t count_from, uint64_t deadline)
+        : config_(config),
+          request_(request),
+          addr_(addr),
+          count_from_(count_from),
+          deadline_(deadline),
+          epfd_(-1),
+          conns_(connections)
+    {
+    }
+
+    void run();
+    const LoadResult &result() const { return result_; }
+
+private:
+    void open(Conn &c, uint32_t id);
+    void reopen(Conn &c, uint32_t id);
+    void fill(Conn &c);
+    bool flush(Conn &c);
+    bool on_read(Conn &c);
+    bool parse(Conn &c);
+    void watch(Conn &c, bool write);
+
+    const LoadConfig &config_;
+    const std::string &request_;
+    sockaddr_in addr_;
+    uint64_t count_from_;
+    uint64_t deadline_;
+    int epfd_;
+    std::vector<Conn> conns_;
+    LoadResult result_;
+};
+
+// value of header name (lower case) in head, which ends before "\r\n\r\n"
+bool find_header(const char *head, size_t len, const char *name,
+        const char *&value, size_t &value_len)
+{
+    size_t name_len = ::strlen(name);
+    const char *p = (const char *)::memchr(head, '\n', len);
+    const char *end = head + len;
+    while (p && p + 1 < end) {
+        const char *line = p + 1;
+        const char *eol = (const char *)::memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
+        if ((size_t)(eol - line) > name_len && line[name_len] == ':'
+                && ::strncasecmp(line, name, name_len) == 0) {
+            value = line + name_len + 1;
+            while (value < eol && *value == ' ')
+                value++;
+            value_len = eol - value;
+            if (value_len > 0 && value[value_len - 1] == '\r')
+                value_len--;
+            return true;
+        }
+        p = eol < end ? eol : NULL;
+    }
+    return false;
+}
+
+void Worker::watch(Conn &c, bool write)
+{
+    if (c.want_write == write)
+        return;
+    epoll_event ev;
+    ev.events = EPOLLIN | (write ? (uint32_t)EPOLLOUT : 0);
+    ev.data.u32 = &c - &conns_[0];
+    ::epoll_ctl(epfd_, EPOLL_CTL_MOD, c.fd, &ev);
+    c.want_write = write;
+}
+
+void Worker::open(Conn &c, uint32_t id)
+{
+    c.out.clear();
+    c.out_off = 0;
+    c.in.clear();
+    c.sent.clear();
+    c.closing = false;
+    c.want_write = true;
+
+    c.fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c.fd < 0) {
+        perror("socket");
+        ::exit(1);
+    }
+    int one = 1;
+    ::setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (::connect(c.fd, (const sockaddr *)&addr_, sizeof(addr_)) < 0
+            && errno != EINPROGRESS) {
+        result_.errors++;
+        ::close(c.fd);
+        c.fd = -1;
+        return;
+    }
+    result_.connects++;
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.u32 = id;
+    ::epoll_ctl(epfd_, EPOLL_CTL_ADD, c.fd, &ev);
+    fill(c);
+}
+
+void Worker::reopen(Conn &c, uint32_t id)
+{
+    if (c.fd >= 0)
+        ::close(c.fd);
+    c.fd = -1;
+    open(c, id);
+}
+
+void Worker::fill(Conn &c)
+{
+    size_t limit = config_.keepalive ? config_.pipeline : 1;
+    uint64_t now = tws::now_ns();
+    while (!c.closing && c.sent.size() < limit) {
+        c.out += request_;
+        c.sent.push_back(now);
+        if (!config_.keepalive)
+            c.closing = true;
+    }
+}
+
+// false if the connection failed
+bool Worker::flush(Conn &c)
+{
+    while (c.out_off < c.out.size()) {
+        ssize_t n = ::send(c.fd, c.out.data() + c.out_off,
+                c.out.size() - c.out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                watch(c, true);
+                return true;
+            }
+            return false;
+        }
+        c.out_off += n;
+    }
+    c.out.clear();
+    c.out_off = 0;
+    watch(c, false);
+    return true;
+}
+
+// false if the connection is over, by server or error
+bool Worker::on_read(Conn &c)
+{
+    char buf[65536];
+    for(;;) {
+        ssize_t n = ::recv(c.fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            if (tws::now_ns() >= count_from_)
+                result_.bytes_in += n;
+            c.in.append(buf, n);
+            if ((size_t)n < sizeof(buf))
+                break;
+        } else if (n == 0) {
+            parse(c);
+            // after Connection: close, server closes first and requests
+            // pipelined behind the last one are dropped, not errors
+            if (!c.sent.empty() && !c.closing)
+                result_.errors++;
+            return false;
+        } else if (errno == EAGAIN || errno == EINTR) {
+            break;
+        } else {
+            result_.errors++;
+            return false;
+        }
+    }
+    return parse(c);
+}
+
+// takes complete responses out of c.in, false on a bad one
+bool Worker::parse(Conn &c)
+{
+    size_t pos = 0;
+    while (!c.sent.empty()) {
+        size_t head_end = c.in.find("\r\n\r\n", pos);
+        if (head_end == std::string::npos)
+            break;
+        const char *head = c.in.data() + pos;
+        size_t head_len = head_end - pos;
+        if (head_len < 12 || ::strncmp(head, "HTTP/1.", 7) != 0) {
+            result_.errors++;
+            return false;
+        }
+        int code = ::atoi(head + 9);
+
+        const char *v;
+        size_t vlen;
+        if (!find_header(head, head_len, "content-length", v, vlen)) {
+            // chunked or read-till-close bodies are not supported
+            result_.errors++;
+            return false;
+        }
+        size_t body = ::strtoull(std::string(v, vlen).c_str(), NULL, 10);
+        if (c.in.size() < head_end + 4 + body)
+            break;
+        if (find_header(head, head_len, "connection", v, vlen)
+                && vlen == 5 && ::strncasecmp(v, "close", 5) == 0)
+            c.closing = true;
+
+        uint64_t now = tws::now_ns();
+        uint64_t queued = c.sent.front();
+        c.sent.pop_front();
+        if (queued >= count_from_ && now < deadline_) {
+            uint64_t ns = now - queued;
+            result_.requests++;
+            if (code < 200 || code >= 300)
+                result_.non_2xx++;
+            result_.latency.counts[Histogram::bucket_of(ns)]++;
+            result_.latency.count++;
+            result_.latency.sum += ns;
+        }
+        pos = head_end + 4 + body;
+    }
+    c.in.erase(0, pos);
+    return true;
+}
+
+void Worker::run()
+{
+    epfd_ = ::epoll_create1(0);
+    for(size_t i = 0; i < conns_.size(); i++)
+        open(conns_[i], i);
+
+    std::vector<epoll_event> events(conns_.size() + 1);
+    while (tws::now_ns() < deadline_) {
+        int n = ::epoll_wait(epfd_, &events[0], events.size(), 10);
+        for(int i = 0; i < n; i++) {
+            uint32_t id = events[i].data.u32;
+            Conn &c = conns_[id];
+            bool ok = true;
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                ok = on_read(c);
+            if (ok && (events[i].events & EPOLLOUT))
+                ok = flush(c);
+            if (ok) {
+                fill(c);
+                ok = flush(c);
+            }
+            if (!ok)
+                reopen(c, id);
+        }
+        // connections that failed to open are retried here
+        for(size_t i = 0; i < conns_.size(); i++) {
+            if (conns_[i].fd < 0)
+                open(conns_[i], i);
+        }
+    }
+    for(size_t i = 0; i < conns_.size(); i++) {
+        if (conns_[i].fd >= 0)
+            ::close(conns_[i].fd);
+    }
+    ::close(epfd_);
+}
+
+void json_string(FILE *out, const std::string &s)
+{
+    fputc('"', out);
+    for(size_t i = 0; i < s.size(); i++) {
+        unsigned char ch = s[i];
+        if (ch == '"' || ch == '\\')
+            fprintf(out, "\\%c", ch);
+        else if (ch < 0x20)
+            fprintf(out, "\\u%04x", ch);
+        else
+            fputc(ch, out);
+    }
+    fputc('"', out);
+}
+
+}
+
+namespace tws {
+
+LoadConfig::LoadConfig()
+    : host("127.0.0.1"),
+      port(8000),
+      method("GET"),
+      path("/"),
+      body_size(0),
+      connections(64),
+      threads(2),
+      pipeline(1),
+      keepalive(true),
+      seconds(3),
+      warmup(0.5)
+{
+}
+
+LoadResult::LoadResult()
+    : requests(0),
+      errors(0),
+      non_2xx(0),
+      connects(0),
+      bytes_in(0),
+      seconds(0)
+{
+}
+
+LoadResult run_load(const LoadConfig &config)
+{
+    sockaddr_in addr;
+    ::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    if (::inet_pton(AF_INET, config.host.c_str(), &addr.sin_addr) != 1) {
+        fprintf(stderr, "bad IPv4 address: %s\n", config.host.c_str());
+        ::exit(1);
+    }
+
+    std::string request = config.method + " " + config.path + " HTTP/1.1\r\n"
+        "Host: " + config.host + "\r\n";
+    for(size_t i = 0; i < config.headers.size(); i++)
+        request += config.headers[i] + "\r\n";
+    if (!config.keepalive)
+        request += "Connection: close\r\n";
+    if (config.body_size > 0)
+        request += "Content-Length: " + std::to_string(config.body_size) + "\r\n";
+    request += "\r\n";
+    request.append(config.body_size, 'x');
+
+    int threads = config.threads > 0 ? config.threads : 1;
+    if (threads > config.connections)
+        threads = config.connections;
+    uint64_t count_from = now_ns() + (uint64_t)(config.warmup * 1e9);
+    uint64_t deadline = count_from + (uint64_t)(config.seconds * 1e9);
+
+    std::vector<Worker *> workers;
+    std::vector<std::thread> running;
+    for(int i = 0; i < threads; i++) {
+        int conns = config.connections / threads
+            + (i < config.connections % threads ? 1 : 0);
+        workers.push_back(new Worker(config, request, addr, conns,
+                    count_from, deadline));
+    }
+    for(int i = 0; i < threads; i++)
+        running.push_back(std::thread(&Worker::run, workers[i]));
+
+    LoadResult total;
+    total.seconds = config.seconds;
+    for(int i = 0; i < threads; i++) {
+        running[i].join();
+        const LoadResult &r = workers[i]->result();
+        total.requests += r.requests;
+        total.errors += r.errors;
+        total.non_2xx += r.non_2xx;
+        total.connects += r.connects;
+        total.bytes_in += r.bytes_in;
+        for(int b = 0; b < Histogram::kBuckets; b++)
+            total.latency.counts[b] += r.latency.counts[b];
+        total.latency.count += r.latency.count;
+        total.latency.sum += r.latency.sum;
+        delete workers[i];
+    }
+    return total;
+}
+
+void write_json(FILE *out, const char *name, const LoadConfig &config,
+        const LoadResult &result)
+{
+    const Histogram &h = result.latency;
+    fprintf(out, "{\"name\": ");
+    json_string(out, name);
+    fprintf(out, ", \"method\": ");
+    json_string(out, config.method);
+    fprintf(out, ", \"path\": ");
+    json_string(out, config.path);
+    fprintf(out, ", \"connections\": %d, \"threads\": %d, \"pipeline\": %d, "
+            "\"keepalive\": %s, \"body_size\": %zu, \"seconds\": %.2f, ",
+            config.connections, config.threads, config.pipeline,
+            config.keepalive ? "true" : "false", config.body_size, result.seconds);
+    fprintf(out, "\"requests\": %llu, \"rps\": %.1f, \"errors\": %llu, "
+            "\"non_2xx\": %llu, \"connects\": %llu, \"mb_per_s\": %.2f, ",
+            (unsigned long long)result.requests, result.rps(),
+            (unsigned long long)result.errors, (unsigned long long)result.non_2xx,
+            (unsigned long long)result.connects,
+            result.seconds > 0 ? result.bytes_in / result.seconds / 1e6 : 0.0);
+    fprintf(out, "\"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, "
+            "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}",
+            h.count ? h.sum / 1e3 / h.count : 0.0,
+            h.percentile(0.5) / 1e3, h.percentile(0.9) / 1e3,
+            h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3,
+            h.percentile(1.0) / 1e3);
+}
+
+}
@@ -0,0 +1,53 @@
+#ifndef _LOAD_GEN_HPP_
+#define _LOAD_GEN_HPP_
+#include <metrics.hpp>
+#include <string>
+#include <vector>
+#include <cstdio>
+
+namespace tws{
+
+/* HTTP/1.1 load generator for loopback benchmarks. each thread drives
+ * its share of connections with its own epoll, keeping up to pipeline
+ * requests in flight on each. responses need Content-Length */
+struct LoadConfig
+{
+    std::string host;
+    unsigned short port;
+    std::string method;
+    std::string path;
+    std::vector<std::string> headers;   // "Name: value" lines
+    size_t body_size;                   // bytes of body, 0 for none
+    int connections;
+    int threads;
+    int pipeline;                       // requests in flight per connection
+    bool keepalive;                     // false sends one request per connection
+    double seconds;
+    double warmup;                      // seconds run before counting
+
+    LoadConfig();
+};
+
+struct LoadResult
+{
+    uint64_t requests;
+    uint64_t errors;        // bad responses and failed connections
+    uint64_t non_2xx;
+    uint64_t connects;
+    uint64_t bytes_in;
+    double seconds;
+    Histogram latency;      // from request queued till response read
+
+    LoadResult();
+    double rps() const { return seconds > 0 ? requests / seconds : 0; }
+};
+
+LoadResult run_load(const LoadConfig &config);
+
+// one JSON object of config and result, no trailing newline
+void write_json(FILE *out, const char *name, const LoadConfig &config,
+        const LoadResult &result);
+
+}
+
+#endif
@@ -0,0 +1,53 @@
+// HTTP load generator, prints one JSON object with throughput and
+// latency percentiles of the run.
+//
+// Usage: bench_load [-c connections=64] [-t threads=2] [-p pipeline=1]
+//            [-d seconds=3] [-w warmup=0.5] [-m method=GET] [-b body_bytes=0]
+//            [-H "Name: value"]... [-k (no keep-alive)] [host=127.0.0.1] port [path=/]
+
+#include "load_gen.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+int main(int argc, char *argv[])
+{
+    tws::LoadConfig config;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:p:d:w:m:b:H:k")) != -1) {
+        switch (opt) {
+            case 'c': config.connections = atoi(optarg); break;
+            case 't': config.threads = atoi(optarg); break;
+            case 'p': config.pipeline = atoi(optarg); break;
+            case 'd': config.seconds = atof(optarg); break;
+            case 'w': config.warmup = atof(optarg); break;
+            case 'm': config.method = optarg; break;
+            case 'b': config.body_size = strtoull(optarg, NULL, 10); break;
+            case 'H': config.headers.push_back(optarg); break;
+            case 'k': config.keepalive = false; break;
+            default:
+                fprintf(stderr, "Usage: %s [-c conns] [-t threads] [-p pipeline] "
+                        "[-d seconds] [-w warmup] [-m method] [-b body_bytes] "
+                        "[-H header]... [-k] [host] port [path]\n", argv[0]);
+                return 1;
+        }
+    }
+    int left = argc - optind;
+    if (left < 1 || left > 3 || config.connections < 1 || config.pipeline < 1) {
+        fprintf(stderr, "Usage: %s [options] [host] port [path]\n", argv[0]);
+        return 1;
+    }
+    char **args = argv + optind;
+    if (left == 3 || (left == 2 && args[1][0] != '/')) {
+        config.host = *args++;
+        left--;
+    }
+    config.port = atoi(args[0]);
+    if (left > 1)
+        config.path = args[1];
+
+    tws::LoadResult result = tws::run_load(config);
+    tws::write_json(stdout, "load", config, result);
+    printf("\n");
+    return result.requests > 0 ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+// Microbenchmarks of the per-request hot paths, single thread:
+// request header parsing, response head serialization as done by
+// begin_response, and body compression. Prints a JSON object.
+//
+// Usage: bench_micro [seconds_per_case=0.5]
+
+#include <request_parser.hpp>
+#include <header_map.hpp>
+#include <header_writer.hpp>
+#include <arena.hpp>
+#include <zlib_compression.hpp>
+#include <chrono>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+const char *SAMPLE_REQUEST =
+    "GET /monitor/status?format=json&verbose=1 HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since(Clock::time_point t)
+{
+    return std::chrono::duration<double>(Clock::now() - t).count();
+}
+
+// runs fn in rounds of batch calls until seconds passed, returns ns per call
+template <typename Fn>
+double measure(double seconds, int batch, Fn fn)
+{
+    // untimed round to warm caches and per-thread state
+    for(int i = 0; i < batch; i++)
+        fn();
+    long calls = 0;
+    Clock::time_point t = Clock::now();
+    double elapsed;
+    do {
+        for(int i = 0; i < batch; i++)
+            fn();
+        calls += batch;
+    } while ((elapsed = seconds_since(t)) < seconds);
+    return elapsed * 1e9 / calls;
+}
+
+bool first_case = true;
+
+void report(const char *name, double ns, size_t bytes)
+{
+    printf("%s\n    {\"name\": \"%s\", \"ns_per_op\": %.1f, \"ops_per_s\": %.0f",
+            first_case ? "" : ",", name, ns, 1e9 / ns);
+    if (bytes)
+        printf(", \"bytes\": %zu, \"mb_per_s\": %.1f", bytes, bytes * 1e3 / ns);
+    printf("}");
+    first_case = false;
+    fprintf(stderr, "%-24s %12.1f ns/op\n", name, ns);
+}
+
+// monitoring-page like text
+std::string make_text(size_t size)
+{
+    std::string text = "<html><body><table>\n";
+    unsigned seed = 12345;
+    while (text.size() < size) {
+        seed = seed * 1103515245 + 12345;
+        char line[128];
+        snprintf(line, sizeof(line),
+                "<tr><td>worker-%u</td><td>qps %u</td><td>latency %u.%02u ms</td></tr>\n",
+                (seed >> 8) % 64, (seed >> 4) % 100000, (seed >> 12) % 50, seed % 100);
+        text += line;
+    }
+    text.resize(size);
+    return text;
+}
+
+size_t sink = 0;
+
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+    printf("{\"benchmark\": \"micro\", \"cases\": [");
+
+    {
+        tws::RequestParser p;
+        size_t len = ::strlen(SAMPLE_REQUEST);
+        report("parse_request", measure(seconds, 1000, [&]() {
+            p.reset();
+            p.parse(SAMPLE_REQUEST, len);
+            sink += p.headers().size();
+        }), len);
+        report("parse_request_16b_frags", measure(seconds, 1000, [&]() {
+            p.reset();
+            for(size_t off = 16; ; off += 16) {
+                if (p.parse(SAMPLE_REQUEST, std::min(off, len))
+                        != tws::RequestParser::kNeedMore)
+                    break;
+            }
+            sink += p.headers().size();
+        }), len);
+    }
+
+    {
+        // head of begin_response for a handler setting two headers,
+        // with the ETag and Content-Encoding the server may add
+        tws::Arena arena;
+        tws::HeaderMap headers(&arena);
+        std::string head;
+        std::string body(1000, 'x');
+        report("serialize_response_head", measure(seconds, 1000, [&]() {
+            arena.reset();
+            headers.clear();
+            headers.set(tws::StrRef("Content-Type", 12), tws::StrRef("text/html", 9));
+            headers.set(tws::StrRef("Cache-Control", 13), tws::StrRef("no-cache", 8));
+            headers.set(tws::StrRef("ETag", 4), tws::StrRef("\"5d41402abc4b2a76\"", 18));
+            headers.set(tws::StrRef("Content-Encoding", 16), tws::StrRef("gzip", 4));
+            sink += tws::write_response_head(head, tws::StrRef("HTTP/1.1 200 OK\r\n", 17),
+                    headers, false, (int64_t)body.size(), true);
+            sink += head.size();
+        }), 0);
+    }
+
+#ifdef HTTP_COMPRESSION
+    size_t sizes[] = {1024, 16 * 1024, 256 * 1024};
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        std::string text = make_text(sizes[i]);
+        int batch = sizes[i] > 64 * 1024 ? 1 : 16;
+        char name[64];
+        snprintf(name, sizeof(name), "zlib_compress_%zuk", sizes[i] / 1024);
+        report(name, measure(seconds, batch, [&]() {
+            sink += tws::zlib_compress(text, 5).size();
+        }), text.size());
+        std::string out;
+        snprintf(name, sizeof(name), "compress_to_%zuk", sizes[i] / 1024);
+        report(name, measure(seconds, batch, [&]() {
+            tws::compress_to(text.data(), text.size(), 5, tws::COMPRESS_DEFLATE, out);
+            sink += out.size();
+        }), text.size());
+    }
+#endif
+
+    printf("\n]}\n");
+    return sink == 0;
+}
@@ -0,0 +1,202 @@
+// Microbenchmark of request header parsing, single thread.
+// Compares the old find("\r\n\r\n") + per-char copy parser with 
+// RequestParser, feeding requests whole and in small fragments.
+// Checks first that malformed header lines are refused.
+//
+// Usage: parser_bench [iterations=200000]
+
+#include <request_parser.hpp>
+#include <unordered_map>
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+const char *SAMPLE_REQUEST =
+    "GET /monitor/status?format=json&verbose=1 HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+// the parser used before RequestParser, kept here for comparison
+struct LegacyParser {
+    std::string request_;
+    std::string path_;
+    std::unordered_map<std::string, std::string> headers_;
+
+    void clear() 
+    {
+        request_.clear();
+        path_.clear();
+        headers_.clear();
+    }
+
+    int parse()
+    {
+        size_t spos;
+        const char *h;
+        if ((spos = request_.find("\r\n\r\n")) == std::string::npos) 
+            return -1;
+        h = request_.c_str();
+#define PREFIX_EQ(haystack, needle) (::strncmp(haystack, needle, ::strlen(needle)) == 0)
+        if (PREFIX_EQ(h, "GET "))
+            h += ::strlen("GET ");
+        else
+            return -1;
+        while(!PREFIX_EQ(h, " HTTP/1.")) {
+            path_.append(1, *h);
+            h++;
+        }
+        h += ::strlen(" HTTP/1.1\r\n");
+        auto split_kv = [this](const char *s) {
+            const char *p = s;
+            std::string key, value;
+            bool inkey = true;
+            for( ; *p != '\0'; ) {
+                if (PREFIX_EQ(p, "\r\n")) {
+                    if (!key.empty())
+                        this->headers_[key] = value;
+                    return p + 2;
+                }
+                if (inkey) {
+                    if (PREFIX_EQ(p, ": ")) {
+                        p += 2;
+                        inkey = false;
+                        continue;
+                    } else {
+                        key.append(1, *p);
+                    }
+                } else {
+                    value.append(1, *p);
+                }
+                p++;
+            }
+            return p;
+        };
+        while(*h && !PREFIX_EQ(h, "\r\n")) 
+            h = split_kv(h);
+#undef PREFIX_EQ
+        return 0;
+    }
+};
+
+// header lines RequestParser must take or refuse, a request is built
+// around each. the bench is not run if one goes wrong
+struct HeaderCase {
+    const char *line;
+    int expect;
+};
+
+const HeaderCase HEADER_CASES[] = {
+    {"X-Ok_1.a~: y", tws::RequestParser::kDone},
+    {"Content-Length:3", tws::RequestParser::kDone},
+    // whitespace before colon, request smuggling through proxies
+    {"Transfer-Encoding : chunked", tws::RequestParser::kError},
+    {"Transfer-Encoding\t: chunked", tws::RequestParser::kError},
+    {"Bad Name: x", tws::RequestParser::kError},
+    {"Na(me): x", tws::RequestParser::kError},
+    {"Na\"me: x", tws::RequestParser::kError},
+    {": x", tws::RequestParser::kError},
+    {"NoColon", tws::RequestParser::kError},
+    {" folded: x", tws::RequestParser::kError},
+};
+
+bool check_cases()
+{
+    bool ok = true;
+    tws::RequestParser p;
+    for(size_t i = 0; i < sizeof(HEADER_CASES) / sizeof(HEADER_CASES[0]); i++) {
+        std::string req = std::string("GET / HTTP/1.1\r\nHost: a\r\n")
+            + HEADER_CASES[i].line + "\r\n\r\n";
+        p.reset();
+        int r = p.parse(req.data(), req.size());
+        if (r != HEADER_CASES[i].expect) {
+            fprintf(stderr, "header \"%s\": got %d, want %d\n",
+                    HEADER_CASES[i].line, r, HEADER_CASES[i].expect);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since(Clock::time_point t)
+{
+    return std::chrono::duration<double>(Clock::now() - t).count();
+}
+
+double bench_legacy(int iterations, size_t frag)
+{
+    LegacyParser p;
+    size_t len = ::strlen(SAMPLE_REQUEST);
+    size_t sink = 0;
+    Clock::time_point t = Clock::now();
+    for(int i = 0; i < iterations; i++) {
+        p.clear();
+        for(size_t off = 0; off < len; off += frag) {
+            p.request_.append(SAMPLE_REQUEST + off, std::min(frag, len - off));
+            if (p.parse() == 0)
+                break;
+        }
+        sink += p.headers_.size();
+    }
+    double sec = seconds_since(t);
+    if (sink == 0)
+        fprintf(stderr, "legacy parser failed\n");
+    return iterations / sec;
+}
+
+double bench_parser(int iterations, size_t frag)
+{
+    tws::RequestParser p;
+    size_t len = ::strlen(SAMPLE_REQUEST);
+    size_t sink = 0;
+    Clock::time_point t = Clock::now();
+    for(int i = 0; i < iterations; i++) {
+        p.reset();
+        for(size_t off = frag; ; off += frag) {
+            if (p.parse(SAMPLE_REQUEST, std::min(off, len)) != tws::RequestParser::kNeedMore)
+                break;
+        }
+        sink += p.headers().size();
+    }
+    double sec = seconds_since(t);
+    if (sink == 0)
+        fprintf(stderr, "RequestParser failed\n");
+    return iterations / sec;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 200000;
+    if (argc > 1)
+        iterations = atoi(argv[1]);
+    if (!check_cases())
+        return 1;
+
+    size_t frags[] = {::strlen(SAMPLE_REQUEST), 64, 16, 1};
+    printf("%-12s %14s %14s %8s\n", "fragment", "legacy req/s", "parser req/s", "speedup");
+    for(size_t i = 0; i < sizeof(frags) / sizeof(frags[0]); i++) {
+        double legacy = bench_legacy(iterations, frags[i]);
+        double parser = bench_parser(iterations, frags[i]);
+        char name[32];
+        if (i == 0)
+            snprintf(name, sizeof(name), "whole");
+        else
+            snprintf(name, sizeof(name), "%zu bytes", frags[i]);
+        printf("%-12s %14.0f %14.0f %7.1fx\n", name, legacy, parser, parser / legacy);
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+// Throughput and latency of the server over loopback, for fixed
+// scenarios run one after another against an in-process HttpServer.
+// Prints a JSON object, so runs can be saved and compared.
+//
+// Usage: bench_server [seconds=3] [port=18080] [iothreads=2] [poolthreads=4]
+
+#include "load_gen.hpp"
+#include <http_server.hpp>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+
+namespace {
+
+struct Scenario {
+    const char *name;
+    const char *method;
+    const char *path;
+    const char *header;     // NULL for none
+    size_t body_size;
+    int connections;
+    int pipeline;
+    bool keepalive;
+};
+
+const Scenario SCENARIOS[] = {
+    {"inline",          "GET",  "/bench",        NULL, 0, 64, 1, true},
+    {"inline_pipeline", "GET",  "/bench",        NULL, 0, 64, 16, true},
+    {"inline_close",    "GET",  "/bench",        NULL, 0, 16, 1, false},
+    {"thread_pool",     "GET",  "/thread/bench", NULL, 0, 64, 1, true},
+    {"pool_pipeline",   "GET",  "/thread/bench", NULL, 0, 64, 16, true},
+    {"deflate_16k",     "GET",  "/text",         "Accept-Encoding: deflate", 0, 64, 1, true},
+    {"cached_16k",      "GET",  "/cached/text",  "Accept-Encoding: deflate", 0, 64, 1, true},
+    {"post_1m",         "POST", "/upload",       NULL, 1 << 20, 16, 1, true},
+};
+
+// monitoring-page like text, compresses about as well as real pages
+std::string make_text(size_t size)
+{
+    std::string text = "<html><body><table>\n";
+    unsigned seed = 12345;
+    while (text.size() < size) {
+        seed = seed * 1103515245 + 12345;
+        char line[128];
+        snprintf(line, sizeof(line),
+                "<tr><td>worker-%u</td><td>qps %u</td><td>latency %u.%02u ms</td></tr>\n",
+                (seed >> 8) % 64, (seed >> 4) % 100000, (seed >> 12) % 50, seed % 100);
+        text += line;
+    }
+    text.resize(size);
+    return text;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 3;
+    int port = argc > 2 ? atoi(argv[2]) : 18080;
+    int iothreads = argc > 3 ? atoi(argv[3]) : 2;
+    int poolthreads = argc > 4 ? atoi(argv[4]) : 4;
+
+    static const std::string text = make_text(16 * 1024);
+    tws::HttpServer server(port, &tws::HttpServer::default_handler,
+            poolthreads, iothreads);
+    server.set_keepalive(1000000);
+    server.route(tws::HTTP_GET, "/text",
+        [](tws::Response &resp, const tws::Request &) {
+            resp.set_body(text);
+            resp.set_header("Content-Type", "text/html");
+            return tws::HTTP_200;
+        });
+    // same page kept in response cache, made in pool once a second
+    server.enable_response_cache(64 << 20);
+    server.route_cached(tws::HTTP_GET, "/cached/text",
+        [](tws::Response &resp, const tws::Request &) {
+            resp.set_body(text);
+            resp.set_header("Content-Type", "text/html");
+            resp.set_cache_ttl(1000);
+            return tws::HTTP_200;
+        }, tws::RUN_IN_POOL);
+    server.route(tws::HTTP_POST, "/upload",
+        [](tws::Response &resp, const tws::Request &req) {
+            resp.set_body("got " + std::to_string(req.postdata().size()) + "\n");
+            return tws::HTTP_200;
+        });
+    std::thread server_thread(&tws::HttpServer::run, &server);
+    // let the acceptors start
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+#ifdef HTTP_IO_URING
+    const char *backend = "io_uring";
+#else
+    const char *backend = "asio";
+#endif
+    printf("{\"benchmark\": \"server\", \"backend\": \"%s\", \"iothreads\": %d, "
+            "\"poolthreads\": %d, \"scenarios\": [\n", backend, iothreads, poolthreads);
+    size_t n = sizeof(SCENARIOS) / sizeof(SCENARIOS[0]);
+    for(size_t i = 0; i < n; i++) {
+        const Scenario &s = SCENARIOS[i];
+        tws::LoadConfig config;
+        config.port = port;
+        config.method = s.method;
+        config.path = s.path;
+        if (s.header)
+            config.headers.push_back(s.header);
+        config.body_size = s.body_size;
+        config.connections = s.connections;
+        config.pipeline = s.pipeline;
+        config.keepalive = s.keepalive;
+        config.seconds = seconds;
+
+        tws::LoadResult result = tws::run_load(config);
+        printf("  ");
+        tws::write_json(stdout, s.name, config, result);
+        printf(i + 1 < n ? ",\n" : "\n");
+        fflush(stdout);
+        fprintf(stderr, "%-16s %10.0f req/s  p50 %8.1f us  p99 %8.1f us  p999 %8.1f us  errors %llu\n",
+                s.name, result.rps(), result.latency.percentile(0.5) / 1e3,
+                result.latency.percentile(0.99) / 1e3,
+                result.latency.percentile(0.999) / 1e3,
+                (unsigned long long)result.errors);
+    }
+    printf("]}\n");
+
+    server.stop();
+    server_thread.join();
+    return 0;
+}
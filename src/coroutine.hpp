@@ -0,0 +1,44 @@
+#ifndef _COROUTINE_HPP_
+#define _COROUTINE_HPP_
+#include <boost/asio.hpp>
+#include <http_server.hpp>
+
+/* C++20 coroutine handlers. only this header needs C++20, the server
+ * itself builds as before:
+ *
+ *   http_server.route_async(tws::HTTP_GET, "/wait",
+ *       tws::co_handler([](tws::Responder r) -> boost::asio::awaitable<int> {
+ *           boost::asio::steady_timer t(co_await boost::asio::this_coro::executor,
+ *                   std::chrono::milliseconds(100));
+ *           co_await t.async_wait(boost::asio::use_awaitable);
+ *           r.response().set_body("waited\n");
+ *           co_return tws::HTTP_200;
+ *       }));
+ *
+ * the coroutine runs on the connection's event loop, its return value
+ * finishes the response, an exception finishes it with HTTP_500 */
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <exception>
+
+namespace tws{
+
+typedef std::function<boost::asio::awaitable<int> (Responder)> CoroutineHandler;
+
+inline AsyncHandler co_handler(CoroutineHandler handler)
+{
+    return [handler](Responder r) {
+        boost::asio::co_spawn(r.io_context(), handler(r),
+            [r](std::exception_ptr e, int code) {
+                r.finish(e ? HTTP_500 : code);
+            });
+    };
+}
+
+}
+
+#endif
+
+#endif
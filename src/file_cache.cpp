@@ -0,0 +1,103 @@
+#include <file_cache.hpp>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace tws {
+
+OpenFile::~OpenFile()
+{
+    if (fd >= 0)
+        ::close(fd);
+}
+
+FileCache::FileCache(size_t capacity, int revalidate_ms)
+    : capacity_(capacity),
+      revalidate_(revalidate_ms)
+{
+}
+
+void FileCache::set_capacity(size_t capacity)
+{
+    std::lock_guard<std::mutex> lk(m_);
+    capacity_ = capacity;
+    while (map_.size() > capacity_) {
+        map_.erase(lru_.back());
+        lru_.pop_back();
+    }
+}
+
+OpenFilePtr FileCache::open(const std::string &path)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::shared_ptr<OpenFile> cached;
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        auto it = map_.find(path);
+        if (it != map_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second.lru);
+            if (now - it->second.checked < revalidate_)
+                return it->second.file;
+            cached = it->second.file;
+        }
+    }
+
+    // file system calls are done without holding the lock
+    struct stat st;
+    if (cached) {
+        if (::stat(path.c_str(), &st) == 0 && st.st_ino == cached->ino
+                && st.st_dev == cached->dev && st.st_mtime == cached->mtime
+                && (size_t)st.st_size == cached->size) {
+            std::lock_guard<std::mutex> lk(m_);
+            auto it = map_.find(path);
+            if (it != map_.end() && it->second.file == cached)
+                it->second.checked = now;
+            return cached;
+        }
+    }
+
+    std::shared_ptr<OpenFile> file(new OpenFile());
+    file->fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0 || ::fstat(file->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        std::lock_guard<std::mutex> lk(m_);
+        auto it = map_.find(path);
+        if (it != map_.end()) {
+            lru_.erase(it->second.lru);
+            map_.erase(it);
+        }
+        return OpenFilePtr();
+    }
+    file->size = st.st_size;
+    file->mtime = st.st_mtime;
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+    insert(path, file);
+    return file;
+}
+
+void FileCache::insert(const std::string &path, const std::shared_ptr<OpenFile> &file)
+{
+    std::lock_guard<std::mutex> lk(m_);
+    auto it = map_.find(path);
+    if (it != map_.end()) {
+        it->second.file = file;
+        it->second.checked = std::chrono::steady_clock::now();
+        lru_.splice(lru_.begin(), lru_, it->second.lru);
+        return;
+    }
+    if (capacity_ == 0)
+        return;
+
+    lru_.push_front(path);
+    Entry &e = map_[path];
+    e.file = file;
+    e.checked = std::chrono::steady_clock::now();
+    e.lru = lru_.begin();
+    // evicted files stay open until responses using them finish
+    while (map_.size() > capacity_) {
+        map_.erase(lru_.back());
+        lru_.pop_back();
+    }
+}
+
+}
@@ -0,0 +1,57 @@
+#ifndef _FILE_CACHE_HPP_
+#define _FILE_CACHE_HPP_
+#include <unordered_map>
+#include <list>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <sys/types.h>
+
+namespace tws{
+
+// an opened regular file, closed when last user releases it
+struct OpenFile {
+    int fd;
+    size_t size;
+    time_t mtime;
+    dev_t dev;
+    ino_t ino;
+
+    OpenFile() : fd(-1), size(0), mtime(0), dev(0), ino(0) {}
+    ~OpenFile();
+};
+
+typedef std::shared_ptr<const OpenFile> OpenFilePtr;
+
+/* LRU cache of opened file descriptors with their stat info, so hot
+ * files don't pay open() and fstat() for every request.
+ * entries older than revalidate_ms are checked with stat() again and 
+ * reopened if the file was replaced or modified */
+class FileCache
+{
+    struct Entry {
+        std::shared_ptr<OpenFile> file;
+        std::chrono::steady_clock::time_point checked;
+        std::list<std::string>::iterator lru;
+    };
+
+    std::mutex m_;
+    std::unordered_map<std::string, Entry> map_;
+    std::list<std::string> lru_;
+    size_t capacity_;
+    std::chrono::milliseconds revalidate_;
+
+    void insert(const std::string &path, const std::shared_ptr<OpenFile> &file);
+
+public:
+    FileCache(size_t capacity = 256, int revalidate_ms = 1000);
+
+    // NULL if not exists or not a regular file
+    OpenFilePtr open(const std::string &path);
+    void set_capacity(size_t capacity);
+};
+
+}
+
+#endif
@@ -0,0 +1,179 @@
+#include <header_map.hpp>
+
+namespace {
+
+using namespace tws;
+
+struct KnownName {
+    const char *name;
+    size_t len;
+};
+
+// indexed by KnownHeader
+constexpr KnownName KNOWN_NAMES[] = {
+    {"Content-Length", 14},
+    {"Connection", 10},
+    {"Accept-Encoding", 15},
+    {"Host", 4},
+    {"Content-Type", 12},
+    {"Transfer-Encoding", 17},
+    {"Server", 6},
+    {"Content-Encoding", 16},
+    {"Expect", 6},
+    {"Date", 4},
+    {"Range", 5},
+    {"If-None-Match", 13},
+    {"If-Range", 8},
+    {"ETag", 4},
+    {"Last-Modified", 13},
+};
+
+// hash value to KnownHeader, HDR_UNKNOWN for unused slots
+constexpr signed char HASH_SLOTS[32] = {
+    HDR_HOST, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, HDR_SERVER, HDR_TRANSFER_ENCODING, HDR_DATE, -1, -1,
+    HDR_ETAG, -1, -1, -1, HDR_CONTENT_TYPE, -1, HDR_IF_RANGE, HDR_ACCEPT_ENCODING,
+    -1, HDR_CONTENT_LENGTH, HDR_CONTENT_ENCODING, HDR_CONNECTION, 
+    HDR_RANGE, HDR_LAST_MODIFIED, HDR_IF_NONE_MATCH, HDR_EXPECT,
+};
+
+constexpr unsigned hash_of(int h)
+{
+    return known_header_hash(KNOWN_NAMES[h].name, KNOWN_NAMES[h].len);
+}
+
+// every well-known header sits in the slot of its hash, so no two collide
+constexpr bool slots_match(int h)
+{
+    return h == HDR_KNOWN_END
+        || (HASH_SLOTS[hash_of(h)] == h && slots_match(h + 1));
+}
+
+static_assert(sizeof(KNOWN_NAMES) / sizeof(KNOWN_NAMES[0]) == HDR_KNOWN_END,
+        "a name for each KnownHeader");
+static_assert(slots_match(0), "HASH_SLOTS out of date with known_header_hash");
+
+}
+
+namespace tws {
+
+KnownHeader known_header(const char *name, size_t len)
+{
+    int h = HASH_SLOTS[known_header_hash(name, len)];
+    if (h >= 0 && KNOWN_NAMES[h].len == len
+            && ::strncasecmp(KNOWN_NAMES[h].name, name, len) == 0)
+        return (KnownHeader)h;
+    return HDR_UNKNOWN;
+}
+
+StrRef known_header_name(KnownHeader h)
+{
+    return StrRef(KNOWN_NAMES[h].name, KNOWN_NAMES[h].len);
+}
+
+HeaderMap::HeaderMap(Arena *arena)
+    : arena_(arena),
+      entries_(ArenaAllocator<Entry>(arena))
+{
+    ::memset(slots_, 0, sizeof(slots_));
+}
+
+void HeaderMap::clear()
+{
+    EntryList(ArenaAllocator<Entry>(arena_)).swap(entries_);
+    ::memset(slots_, 0, sizeof(slots_));
+}
+
+void HeaderMap::add(StrRef name, StrRef value)
+{
+    entries_.push_back(Entry(name, value));
+    KnownHeader h = known_header(name.data(), name.size());
+    if (h != HDR_UNKNOWN && slots_[h] == 0)
+        slots_[h] = entries_.size();
+}
+
+void HeaderMap::set(StrRef name, StrRef value)
+{
+    KnownHeader h = known_header(name.data(), name.size());
+    if (h != HDR_UNKNOWN) {
+        set(h, value);
+        return;
+    }
+    int i = find(name.data(), name.size());
+    if (i >= 0)
+        entries_[i].second = value;
+    else
+        entries_.push_back(Entry(name, value));
+}
+
+void HeaderMap::set(KnownHeader h, StrRef value)
+{
+    if (slots_[h]) {
+        entries_[slots_[h] - 1].second = value;
+    } else {
+        entries_.push_back(Entry(known_header_name(h), value));
+        slots_[h] = entries_.size();
+    }
+}
+
+void HeaderMap::erase(const char *name)
+{
+    size_t len = ::strlen(name);
+    auto it = std::remove_if(entries_.begin(), entries_.end(),
+            [name, len](const Entry &e) {
+                return e.first.size() == len
+                    && ::strncasecmp(e.first.data(), name, len) == 0;
+            });
+    if (it != entries_.end()) {
+        entries_.erase(it, entries_.end());
+        reindex();
+    }
+}
+
+void HeaderMap::erase(KnownHeader h)
+{
+    if (slots_[h])
+        erase(KNOWN_NAMES[h].name);
+}
+
+StrRef HeaderMap::get(const char *name) const
+{
+    size_t len = ::strlen(name);
+    KnownHeader h = known_header(name, len);
+    if (h != HDR_UNKNOWN)
+        return get(h);
+    int i = find(name, len);
+    return i >= 0 ? entries_[i].second : StrRef();
+}
+
+bool HeaderMap::has(const char *name) const
+{
+    size_t len = ::strlen(name);
+    KnownHeader h = known_header(name, len);
+    if (h != HDR_UNKNOWN)
+        return has(h);
+    return find(name, len) >= 0;
+}
+
+int HeaderMap::find(const char *name, size_t len) const
+{
+    for(size_t i = 0; i < entries_.size(); i++) {
+        const StrRef &n = entries_[i].first;
+        if (n.size() == len && ::strncasecmp(n.data(), name, len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+void HeaderMap::reindex()
+{
+    ::memset(slots_, 0, sizeof(slots_));
+    for(size_t i = entries_.size(); i > 0; i--) {
+        KnownHeader h = known_header(entries_[i - 1].first.data(),
+                entries_[i - 1].first.size());
+        if (h != HDR_UNKNOWN)
+            slots_[h] = i;
+    }
+}
+
+}
@@ -0,0 +1,127 @@
+#ifndef _HEADER_MAP_HPP_
+#define _HEADER_MAP_HPP_
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <strings.h>
+#include <arena.hpp>
+
+namespace tws{
+
+// non-owning reference to a piece of request, no copy is made
+// only valid until the response is sent
+class StrRef
+{
+    const char *data_;
+    size_t size_;
+
+public:
+    StrRef() : data_(""), size_(0) {}
+    StrRef(const char *data, size_t size) : data_(data), size_(size) {}
+
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const char *begin() const { return data_; }
+    const char *end() const { return data_ + size_; }
+    std::string str() const { return std::string(data_, size_); }
+
+    bool equals(const char *s) const
+    { return ::strlen(s) == size_ && ::memcmp(data_, s, size_) == 0; }
+    bool equals_nocase(const char *s) const
+    { return ::strlen(s) == size_ && ::strncasecmp(data_, s, size_) == 0; }
+    bool starts_with(const char *s) const
+    { size_t n = ::strlen(s); return n <= size_ && ::memcmp(data_, s, n) == 0; }
+    bool contains(const char *s) const
+    { const char *e = s + ::strlen(s); return std::search(begin(), end(), s, e) != end() || s == e; }
+};
+
+// headers the server looks at itself, they have fixed slots in HeaderMap
+enum KnownHeader {
+    HDR_UNKNOWN = -1,
+    HDR_CONTENT_LENGTH = 0,
+    HDR_CONNECTION,
+    HDR_ACCEPT_ENCODING,
+    HDR_HOST,
+    HDR_CONTENT_TYPE,
+    HDR_TRANSFER_ENCODING,
+    HDR_SERVER,
+    HDR_CONTENT_ENCODING,
+    HDR_EXPECT,
+    HDR_DATE,
+    HDR_RANGE,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_RANGE,
+    HDR_ETAG,
+    HDR_LAST_MODIFIED,
+    HDR_KNOWN_END,
+};
+
+// hash of a header name, perfect for the well-known ones.
+// letters are folded to lower case by setting bit 0x20
+constexpr unsigned known_header_hash(const char *name, size_t len)
+{
+    return len == 0 ? 0
+        : (len + (name[0] | 0x20) + (name[len - 1] | 0x20)) & 31;
+}
+
+// HDR_UNKNOWN if name is not a well-known header, case-insensitive
+KnownHeader known_header(const char *name, size_t len);
+// canonical name of a well-known header
+StrRef known_header_name(KnownHeader h);
+
+/* Headers of a request or response, in the order they were added.
+ * entries live in a small vector on an Arena and are compared
+ * case-insensitively, first one of each well-known header is also
+ * indexed by its slot so looking it up costs no string compare.
+ * names and values are not copied, they must outlive the map */
+class HeaderMap
+{
+public:
+    typedef std::pair<StrRef, StrRef> Entry;
+    typedef std::vector<Entry, ArenaAllocator<Entry> > EntryList;
+    typedef EntryList::const_iterator const_iterator;
+
+    explicit HeaderMap(Arena *arena);
+
+    // memory goes back with the arena, call before resetting it
+    void clear();
+    void reserve(size_t n) { entries_.reserve(n); }
+
+    // appends even if there is one with same name, as request headers may
+    void add(StrRef name, StrRef value);
+    // replaces value of first one with same name, or appends
+    void set(StrRef name, StrRef value);
+    void set(KnownHeader h, StrRef value);
+    // removes all with the name
+    void erase(const char *name);
+    void erase(KnownHeader h);
+
+    // empty if not found
+    StrRef get(KnownHeader h) const
+    { return slots_[h] ? entries_[slots_[h] - 1].second : StrRef(); }
+    StrRef get(const char *name) const;
+    bool has(KnownHeader h) const { return slots_[h] != 0; }
+    bool has(const char *name) const;
+
+    size_t size() const { return entries_.size(); }
+    const Entry &operator[](size_t i) const { return entries_[i]; }
+    const_iterator begin() const { return entries_.begin(); }
+    const_iterator end() const { return entries_.end(); }
+
+private:
+    int find(const char *name, size_t len) const;
+    void reindex();
+
+    Arena *arena_;
+    EntryList entries_;
+    // index + 1 of first entry of each well-known header, 0 if absent
+    uint16_t slots_[HDR_KNOWN_END];
+};
+
+}
+
+#endif
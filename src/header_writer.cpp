@@ -0,0 +1,108 @@
+#include <header_writer.hpp>
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+const char *DAYS[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+const char *MONTHS[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+struct DateCache {
+    time_t sec;
+    int len;
+    char line[48];
+};
+
+}
+
+namespace tws {
+
+const std::string SERVER_LINE = "Server: SimpleWebSvr/1.0\r\n";
+const std::string KEEP_ALIVE_LINE = "Connection: keep-alive\r\n";
+const std::string CLOSE_LINE = "Connection: close\r\n";
+const std::string CHUNKED_LINE = "Transfer-Encoding: chunked\r\n";
+
+size_t write_response_head(std::string &head, StrRef status_line,
+        const HeaderMap &headers, bool chunked, int64_t content_length,
+        bool keep_alive)
+{
+    HeaderWriter w(head);
+    w.line(status_line);
+    for(auto it = headers.begin(); it != headers.end(); it++)
+        w.header(it->first, it->second);
+    if (!headers.has(HDR_SERVER))
+        w.line(SERVER_LINE);
+    if (chunked)
+        w.line(CHUNKED_LINE);
+    else if (content_length >= 0 && !headers.has(HDR_CONTENT_LENGTH))
+        w.header(known_header_name(HDR_CONTENT_LENGTH), (uint64_t)content_length);
+    // the same for every request up to here, the rest is per request
+    size_t shared_head = head.size();
+    if (!headers.has(HDR_DATE))
+        w.line(date_header_line());
+    if (!headers.has(HDR_CONNECTION))
+        w.line(keep_alive ? KEEP_ALIVE_LINE : CLOSE_LINE);
+    w.end();
+    return shared_head;
+}
+
+StrRef date_header_line()
+{
+    thread_local DateCache cache = {-1, 0, {0}};
+
+    // coarse clock is read without a syscall, a tick is fine for a date
+    struct timespec ts;
+    ::clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if (ts.tv_sec != cache.sec) {
+        ::memcpy(cache.line, "Date: ", 6);
+        cache.len = 6 + format_http_date(ts.tv_sec, cache.line + 6);
+        ::memcpy(cache.line + cache.len, "\r\n", 2);
+        cache.len += 2;
+        cache.sec = ts.tv_sec;
+    }
+    return StrRef(cache.line, cache.len);
+}
+
+size_t format_http_date(time_t t, char *buf)
+{
+    struct tm tm;
+    ::gmtime_r(&t, &tm);
+    // names are written by hand, strftime() would follow the locale
+    return snprintf(buf, 30, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+            DAYS[tm.tm_wday], tm.tm_mday, MONTHS[tm.tm_mon],
+            tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+time_t parse_http_date(StrRef s)
+{
+    // "Sun, 06 Nov 1994 08:49:37 GMT"
+    const char *p = s.data();
+    if (s.size() != 29 || p[3] != ',' || p[4] != ' ' || p[7] != ' '
+            || p[11] != ' ' || p[16] != ' ' || p[19] != ':' || p[22] != ':'
+            || ::memcmp(p + 25, " GMT", 4) != 0)
+        return -1;
+    const int digits[] = {5, 6, 12, 13, 14, 15, 17, 18, 20, 21, 23, 24};
+    for(size_t i = 0; i < sizeof(digits) / sizeof(int); i++) {
+        if (p[digits[i]] < '0' || p[digits[i]] > '9')
+            return -1;
+    }
+    int mon = 0;
+    while (mon < 12 && ::memcmp(p + 8, MONTHS[mon], 3) != 0)
+        mon++;
+    if (mon == 12)
+        return -1;
+    struct tm tm;
+    ::memset(&tm, 0, sizeof(tm));
+    tm.tm_mday = (p[5] - '0') * 10 + p[6] - '0';
+    tm.tm_mon = mon;
+    tm.tm_year = (p[12] - '0') * 1000 + (p[13] - '0') * 100 
+        + (p[14] - '0') * 10 + p[15] - '0' - 1900;
+    tm.tm_hour = (p[17] - '0') * 10 + p[18] - '0';
+    tm.tm_min = (p[20] - '0') * 10 + p[21] - '0';
+    tm.tm_sec = (p[23] - '0') * 10 + p[24] - '0';
+    return ::timegm(&tm);
+}
+
+}
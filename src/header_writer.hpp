@@ -0,0 +1,76 @@
+#ifndef _HEADER_WRITER_HPP_
+#define _HEADER_WRITER_HPP_
+#include <string>
+#include <cstdint>
+#include <ctime>
+#include <header_map.hpp>
+
+namespace tws{
+
+// "Date: <IMF-fixdate>\r\n" of current second. formatted once a second
+// per thread and shared by all responses made in that thread
+StrRef date_header_line();
+
+// IMF-fixdate of t, e.g. "Sun, 06 Nov 1994 08:49:37 GMT", into buf
+// of at least 30 bytes, returns its length
+size_t format_http_date(time_t t, char *buf);
+// IMF-fixdate back to time, -1 if s is not one. the obsolete RFC 850
+// and asctime formats are not understood, such dates just don't match
+time_t parse_http_date(StrRef s);
+
+/* serializes status line and headers of a response into one buffer,
+ * so they go out as a single piece. buffer keeps its capacity between
+ * responses, nothing is allocated once it has grown enough */
+class HeaderWriter
+{
+    std::string &buf_;
+
+public:
+    // buf is cleared
+    explicit HeaderWriter(std::string &buf) : buf_(buf) { buf_.clear(); }
+
+    // a preformatted line, CRLF included
+    void line(const std::string &l) { buf_.append(l); }
+    void line(StrRef l) { buf_.append(l.data(), l.size()); }
+
+    void header(StrRef name, StrRef value)
+    {
+        buf_.append(name.data(), name.size());
+        buf_.append(": ", 2);
+        buf_.append(value.data(), value.size());
+        buf_.append("\r\n", 2);
+    }
+
+    void header(StrRef name, uint64_t value)
+    {
+        char digits[20];
+        char *p = digits + sizeof(digits);
+        do {
+            *--p = '0' + value % 10;
+            value /= 10;
+        } while (value);
+        header(name, StrRef(p, digits + sizeof(digits) - p));
+    }
+
+    // empty line after headers
+    void end() { buf_.append("\r\n", 2); }
+};
+
+// headers added by server unless handler has set them
+extern const std::string SERVER_LINE;
+extern const std::string KEEP_ALIVE_LINE;
+extern const std::string CLOSE_LINE;
+extern const std::string CHUNKED_LINE;
+
+/* head of a response as HttpServer sends it, into head: status line,
+ * headers of handler, then Server, Transfer-Encoding: chunked or
+ * Content-Length, Date and Connection unless handler set them.
+ * content_length < 0 means none. returns length of what is the same
+ * for every request, up to Date */
+size_t write_response_head(std::string &head, StrRef status_line,
+        const HeaderMap &headers, bool chunked, int64_t content_length,
+        bool keep_alive);
+
+}
+
+#endif
@@ -0,0 +1,485 @@
+#include <hpack.hpp>
+#include <algorithm>
+#include <vector>
+
+namespace tws {
+
+namespace {
+
+// RFC 7541 appendix A
+const char *STATIC_TABLE[][2] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// RFC 7541 appendix B, code and its length in bits by symbol
+const struct {
+    uint32_t code;
+    uint8_t bits;
+} HUFFMAN_CODES[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},  // EOS
+};
+
+const int HUFFMAN_EOS = 256;
+
+// encoder never uses a bigger table, whatever the peer allows
+const size_t MAX_ENCODER_TABLE = 4096;
+
+/* binary tree of the code for decoding bit by bit. nodes are made once,
+ * a leaf has the symbol, inner nodes have -1 */
+class HuffmanTree
+{
+    struct Node {
+        int16_t next[2];
+        int16_t symbol;
+    };
+    std::vector<Node> nodes_;
+
+public:
+    HuffmanTree()
+    {
+        nodes_.reserve(2 * 257);
+        Node root = {{-1, -1}, -1};
+        nodes_.push_back(root);
+        for(int sym = 0; sym <= HUFFMAN_EOS; sym++) {
+            int n = 0;
+            for(int i = HUFFMAN_CODES[sym].bits - 1; i >= 0; i--) {
+                int bit = (HUFFMAN_CODES[sym].code >> i) & 1;
+                if (nodes_[n].next[bit] < 0) {
+                    Node node = {{-1, -1}, -1};
+                    nodes_[n].next[bit] = (int16_t)nodes_.size();
+                    nodes_.push_back(node);
+                }
+                n = nodes_[n].next[bit];
+            }
+            nodes_[n].symbol = (int16_t)sym;
+        }
+    }
+
+    int next(int node, int bit) const { return nodes_[node].next[bit]; }
+    int symbol(int node) const { return nodes_[node].symbol; }
+};
+
+const HuffmanTree &huffman_tree()
+{
+    static const HuffmanTree tree;
+    return tree;
+}
+
+// integer with an n-bit prefix, the rest of first byte is flags
+void encode_int(std::string &out, uint32_t value, int prefix, uint8_t flags)
+{
+    uint32_t max = (1u << prefix) - 1;
+    if (value < max) {
+        out.push_back((char)(flags | value));
+        return;
+    }
+    out.push_back((char)(flags | max));
+    value -= max;
+    while (value >= 128) {
+        out.push_back((char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+bool decode_int(const uint8_t *&p, const uint8_t *end, int prefix, uint32_t &value)
+{
+    if (p == end)
+        return false;
+    uint32_t max = (1u << prefix) - 1;
+    value = *p++ & max;
+    if (value < max)
+        return true;
+    // no header needs more than 28 bits
+    for(int shift = 0; shift <= 21; shift += 7) {
+        if (p == end)
+            return false;
+        uint8_t b = *p++;
+        value += (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+void encode_string(std::string &out, StrRef s)
+{
+    size_t hlen = huffman_length(s);
+    if (hlen < s.size()) {
+        encode_int(out, (uint32_t)hlen, 7, 0x80);
+        huffman_encode(out, s);
+    } else {
+        encode_int(out, (uint32_t)s.size(), 7, 0);
+        out.append(s.data(), s.size());
+    }
+}
+
+}
+
+size_t huffman_length(StrRef s)
+{
+    size_t bits = 0;
+    for(const char *p = s.begin(); p != s.end(); p++)
+        bits += HUFFMAN_CODES[(uint8_t)*p].bits;
+    return (bits + 7) / 8;
+}
+
+void huffman_encode(std::string &out, StrRef s)
+{
+    uint64_t acc = 0;
+    int bits = 0;
+    for(const char *p = s.begin(); p != s.end(); p++) {
+        acc = (acc << HUFFMAN_CODES[(uint8_t)*p].bits) | HUFFMAN_CODES[(uint8_t)*p].code;
+        bits += HUFFMAN_CODES[(uint8_t)*p].bits;
+        while (bits >= 8) {
+            bits -= 8;
+            out.push_back((char)(acc >> bits));
+        }
+    }
+    // padded with the high bits of EOS, all ones
+    if (bits > 0)
+        out.push_back((char)((acc << (8 - bits)) | (0xff >> bits)));
+}
+
+bool huffman_decode(std::string &out, const uint8_t *data, size_t len)
+{
+    const HuffmanTree &tree = huffman_tree();
+    int node = 0;
+    // bits since last symbol, they must be fewer than 8 ones at the end
+    int depth = 0;
+    bool ones = true;
+    for(size_t i = 0; i < len; i++) {
+        for(int b = 7; b >= 0; b--) {
+            int bit = (data[i] >> b) & 1;
+            node = tree.next(node, bit);
+            if (node < 0)
+                return false;
+            depth++;
+            ones = ones && bit;
+            int sym = tree.symbol(node);
+            if (sym >= 0) {
+                if (sym == HUFFMAN_EOS)
+                    return false;
+                out.push_back((char)sym);
+                node = 0;
+                depth = 0;
+                ones = true;
+            }
+        }
+    }
+    return depth < 8 && ones;
+}
+
+HpackTable::HpackTable()
+    : size_(0),
+      max_size_(4096)
+{
+}
+
+void HpackTable::evict(size_t room)
+{
+    while (!entries_.empty() && size_ + room > max_size_) {
+        const Entry &e = entries_.back();
+        size_ -= e.name.size() + e.value.size() + 32;
+        entries_.pop_back();
+    }
+}
+
+void HpackTable::set_max_size(size_t max_size)
+{
+    max_size_ = max_size;
+    evict(0);
+}
+
+void HpackTable::add(StrRef name, StrRef value)
+{
+    size_t n = name.size() + value.size() + 32;
+    evict(n);
+    if (n > max_size_)
+        return;
+    entries_.push_front(Entry());
+    entries_.front().name.assign(name.data(), name.size());
+    entries_.front().value.assign(value.data(), value.size());
+    size_ += n;
+}
+
+bool HpackTable::get(size_t index, StrRef &name, StrRef &value) const
+{
+    if (index == 0)
+        return false;
+    if (index <= kStaticEntries) {
+        name = StrRef(STATIC_TABLE[index - 1][0], ::strlen(STATIC_TABLE[index - 1][0]));
+        value = StrRef(STATIC_TABLE[index - 1][1], ::strlen(STATIC_TABLE[index - 1][1]));
+        return true;
+    }
+    index -= kStaticEntries + 1;
+    if (index >= entries_.size())
+        return false;
+    name = StrRef(entries_[index].name.data(), entries_[index].name.size());
+    value = StrRef(entries_[index].value.data(), entries_[index].value.size());
+    return true;
+}
+
+size_t HpackTable::find(StrRef name, StrRef value, bool &exact) const
+{
+    size_t by_name = 0;
+    exact = false;
+    for(size_t i = 0; i < kStaticEntries; i++) {
+        if (!name.equals(STATIC_TABLE[i][0]))
+            continue;
+        if (value.equals(STATIC_TABLE[i][1])) {
+            exact = true;
+            return i + 1;
+        }
+        if (by_name == 0)
+            by_name = i + 1;
+    }
+    for(size_t i = 0; i < entries_.size(); i++) {
+        const Entry &e = entries_[i];
+        if (e.name.size() != name.size() 
+                || ::memcmp(e.name.data(), name.data(), name.size()) != 0)
+            continue;
+        if (e.value.size() == value.size() 
+                && ::memcmp(e.value.data(), value.data(), value.size()) == 0) {
+            exact = true;
+            return i + kStaticEntries + 1;
+        }
+        if (by_name == 0)
+            by_name = i + kStaticEntries + 1;
+    }
+    return by_name;
+}
+
+HpackDecoder::HpackDecoder()
+    : max_table_size_(4096)
+{
+}
+
+bool HpackDecoder::read_string(const uint8_t *&p, const uint8_t *end, 
+        std::string &out)
+{
+    if (p == end)
+        return false;
+    bool huffman = *p & 0x80;
+    uint32_t len;
+    if (!decode_int(p, end, 7, len) || len > (size_t)(end - p))
+        return false;
+    out.clear();
+    if (huffman) {
+        if (!huffman_decode(out, p, len))
+            return false;
+    } else {
+        out.assign((const char *)p, len);
+    }
+    p += len;
+    return true;
+}
+
+bool HpackDecoder::decode(const char *data, size_t len, const HeaderSink &sink)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + len;
+    bool fields = false;
+    while (p < end) {
+        uint8_t c = *p;
+        uint32_t index;
+        StrRef name, value;
+        if (c & 0x80) {
+            // indexed field
+            if (!decode_int(p, end, 7, index) || !table_.get(index, name, value))
+                return false;
+        } else if ((c & 0xe0) == 0x20) {
+            // table size update, only before the fields
+            if (!decode_int(p, end, 5, index) || index > max_table_size_ || fields)
+                return false;
+            table_.set_max_size(index);
+            continue;
+        } else {
+            // literal, with incremental indexing or not
+            bool indexing = c & 0x40;
+            if (!decode_int(p, end, indexing ? 6 : 4, index))
+                return false;
+            if (index > 0) {
+                // copied, adding to the table may evict it
+                if (!table_.get(index, name, value))
+                    return false;
+                name_.assign(name.data(), name.size());
+            } else if (!read_string(p, end, name_)) {
+                return false;
+            }
+            if (!read_string(p, end, value_))
+                return false;
+            name = StrRef(name_.data(), name_.size());
+            value = StrRef(value_.data(), value_.size());
+            if (indexing)
+                table_.add(name, value);
+        }
+        fields = true;
+        if (!sink(name, value))
+            return false;
+    }
+    return true;
+}
+
+HpackEncoder::HpackEncoder()
+    : size_changed_(false)
+{
+}
+
+void HpackEncoder::set_max_table_size(size_t max_size)
+{
+    max_size = std::min(max_size, MAX_ENCODER_TABLE);
+    if (max_size != table_.max_size()) {
+        table_.set_max_size(max_size);
+        size_changed_ = true;
+    }
+}
+
+void HpackEncoder::encode(std::string &out, StrRef name, StrRef value, bool index)
+{
+    if (size_changed_) {
+        encode_int(out, (uint32_t)table_.max_size(), 5, 0x20);
+        size_changed_ = false;
+    }
+    bool exact;
+    size_t i = table_.find(name, value, exact);
+    if (exact) {
+        encode_int(out, (uint32_t)i, 7, 0x80);
+        return;
+    }
+    if (index)
+        encode_int(out, (uint32_t)i, 6, 0x40);
+    else
+        encode_int(out, (uint32_t)i, 4, 0);
+    if (i == 0)
+        encode_string(out, name);
+    encode_string(out, value);
+    if (index)
+        table_.add(name, value);
+}
+
+}
@@ -0,0 +1,93 @@
+#ifndef _HPACK_HPP_
+#define _HPACK_HPP_
+#include <functional>
+#include <string>
+#include <deque>
+#include <cstddef>
+#include <cstdint>
+#include <header_map.hpp>
+
+namespace tws{
+
+/* HPACK header compression of HTTP/2 (RFC 7541). each direction of a
+ * connection has its own dynamic table, which the encoder and decoder
+ * on both ends keep the same by seeing the same header blocks in order */
+
+// static table and dynamic table behind it, indexes start at 1
+class HpackTable
+{
+    struct Entry {
+        std::string name;
+        std::string value;
+    };
+    // newest first, it has index 62
+    std::deque<Entry> entries_;
+    size_t size_;       // as RFC counts it, 32 more per entry
+    size_t max_size_;
+
+    void evict(size_t room);
+
+public:
+    enum { kStaticEntries = 61 };
+
+    HpackTable();
+
+    void set_max_size(size_t max_size);
+    size_t max_size() const { return max_size_; }
+    // may evict all entries, an entry larger than the table is not kept
+    void add(StrRef name, StrRef value);
+    // false if there is no such index
+    bool get(size_t index, StrRef &name, StrRef &value) const;
+    // index of an entry with both equal, or else of one with the same
+    // name, with exact telling which. 0 if none
+    size_t find(StrRef name, StrRef value, bool &exact) const;
+};
+
+class HpackDecoder
+{
+    HpackTable table_;
+    // largest table size the encoder may ask for, our
+    // SETTINGS_HEADER_TABLE_SIZE
+    size_t max_table_size_;
+    std::string name_;
+    std::string value_;
+
+    bool read_string(const uint8_t *&p, const uint8_t *end, std::string &out);
+
+public:
+    // name and value are valid during the call only, return false to
+    // stop decoding
+    typedef std::function<bool (StrRef name, StrRef value)> HeaderSink;
+
+    HpackDecoder();
+
+    // a whole header block. false on compression error, after which
+    // the connection can't go on since tables may differ
+    bool decode(const char *data, size_t len, const HeaderSink &sink);
+};
+
+class HpackEncoder
+{
+    HpackTable table_;
+    // peer's SETTINGS_HEADER_TABLE_SIZE changed, told in next block
+    bool size_changed_;
+
+public:
+    HpackEncoder();
+
+    void set_max_table_size(size_t max_size);
+    // appends one header to the block. name must be lower case.
+    // index adds it to the dynamic table so later blocks refer to it,
+    // for values that repeat. Huffman code is used when shorter
+    void encode(std::string &out, StrRef name, StrRef value, bool index = true);
+};
+
+// Huffman code of RFC 7541 appendix B
+size_t huffman_length(StrRef s);
+void huffman_encode(std::string &out, StrRef s);
+// false if the code is invalid or not padded right
+bool huffman_decode(std::string &out, const uint8_t *data, size_t len);
+
+}
+
+#endif
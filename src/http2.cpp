@@ -0,0 +1,104 @@
+#include <http2.hpp>
+
+namespace tws {
+
+const char H2_PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+bool frame_payload(const Http2FrameHeader &h, const char *&p, size_t &len)
+{
+    if (h.flags & H2_PADDED) {
+        if (len < 1)
+            return false;
+        size_t pad = (uint8_t)p[0];
+        p++;
+        len--;
+        if (pad > len)
+            return false;
+        len -= pad;
+    }
+    if (h.type == H2_HEADERS && (h.flags & H2_PRIORITY_FLAG)) {
+        if (len < 5)
+            return false;
+        p += 5;
+        len -= 5;
+    }
+    return true;
+}
+
+void append_u32(std::string &out, uint32_t v)
+{
+    char b[4] = {(char)(v >> 24), (char)(v >> 16), (char)(v >> 8), (char)v};
+    out.append(b, 4);
+}
+
+void append_frame_header(std::string &out, size_t length, int type, int flags,
+        uint32_t stream_id)
+{
+    char b[5] = {(char)(length >> 16), (char)(length >> 8), (char)length,
+        (char)type, (char)flags};
+    out.append(b, 5);
+    append_u32(out, stream_id);
+}
+
+void append_settings(std::string &out, const uint32_t (*settings)[2], size_t n)
+{
+    append_frame_header(out, n * 6, H2_SETTINGS, 0, 0);
+    for(size_t i = 0; i < n; i++) {
+        char id[2] = {(char)(settings[i][0] >> 8), (char)settings[i][0]};
+        out.append(id, 2);
+        append_u32(out, settings[i][1]);
+    }
+}
+
+void append_window_update(std::string &out, uint32_t stream_id, uint32_t increment)
+{
+    append_frame_header(out, 4, H2_WINDOW_UPDATE, 0, stream_id);
+    append_u32(out, increment);
+}
+
+void append_rst_stream(std::string &out, uint32_t stream_id, Http2Error error)
+{
+    append_frame_header(out, 4, H2_RST_STREAM, 0, stream_id);
+    append_u32(out, error);
+}
+
+void append_goaway(std::string &out, uint32_t last_stream_id, Http2Error error)
+{
+    append_frame_header(out, 8, H2_GOAWAY, 0, 0);
+    append_u32(out, last_stream_id);
+    append_u32(out, error);
+}
+
+bool decode_base64url(StrRef in, std::string &out)
+{
+    out.clear();
+    uint32_t acc = 0;
+    int bits = 0;
+    for(const char *p = in.begin(); p != in.end(); p++) {
+        char c = *p;
+        int v;
+        if (c >= 'A' && c <= 'Z')
+            v = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            v = c - '0' + 52;
+        else if (c == '-')
+            v = 62;
+        else if (c == '_')
+            v = 63;
+        else if (c == '=')
+            break;
+        else
+            return false;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back((char)(acc >> bits));
+        }
+    }
+    return true;
+}
+
+}
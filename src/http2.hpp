@@ -0,0 +1,111 @@
+#ifndef _HTTP2_HPP_
+#define _HTTP2_HPP_
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <header_map.hpp>
+
+namespace tws{
+
+// frame layer of HTTP/2 (RFC 7540), the connection is in http_server.cpp
+
+enum Http2FrameType {
+    H2_DATA = 0,
+    H2_HEADERS,
+    H2_PRIORITY,
+    H2_RST_STREAM,
+    H2_SETTINGS,
+    H2_PUSH_PROMISE,
+    H2_PING,
+    H2_GOAWAY,
+    H2_WINDOW_UPDATE,
+    H2_CONTINUATION,
+};
+
+enum Http2Flag {
+    H2_END_STREAM = 0x1,
+    H2_ACK = 0x1,           // of SETTINGS and PING
+    H2_END_HEADERS = 0x4,
+    H2_PADDED = 0x8,
+    H2_PRIORITY_FLAG = 0x20,
+};
+
+enum Http2Setting {
+    H2_HEADER_TABLE_SIZE = 1,
+    H2_ENABLE_PUSH,
+    H2_MAX_CONCURRENT_STREAMS,
+    H2_INITIAL_WINDOW_SIZE,
+    H2_MAX_FRAME_SIZE,
+    H2_MAX_HEADER_LIST_SIZE,
+};
+
+enum Http2Error {
+    H2_NO_ERROR = 0,
+    H2_PROTOCOL_ERROR,
+    H2_INTERNAL_ERROR,
+    H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED,
+    H2_FRAME_SIZE_ERROR,
+    H2_REFUSED_STREAM,
+    H2_CANCEL,
+    H2_COMPRESSION_ERROR,
+    H2_CONNECT_ERROR,
+    H2_ENHANCE_YOUR_CALM,
+};
+
+// what a client sends first, before its SETTINGS
+extern const char H2_PREFACE[];
+const size_t H2_PREFACE_LEN = 24;
+
+const size_t H2_FRAME_HEADER_LEN = 9;
+// SETTINGS_MAX_FRAME_SIZE and SETTINGS_INITIAL_WINDOW_SIZE until changed
+const size_t H2_DEFAULT_FRAME_SIZE = 16384;
+const int32_t H2_DEFAULT_WINDOW = 65535;
+const int32_t H2_MAX_WINDOW = 0x7fffffff;
+
+struct Http2FrameHeader
+{
+    uint32_t length;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t stream_id;
+};
+
+inline uint32_t read_u32(const char *p)
+{
+    const uint8_t *u = (const uint8_t *)p;
+    return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16)
+        | ((uint32_t)u[2] << 8) | u[3];
+}
+
+// p has H2_FRAME_HEADER_LEN bytes
+inline void parse_frame_header(const char *p, Http2FrameHeader &h)
+{
+    const uint8_t *u = (const uint8_t *)p;
+    h.length = ((uint32_t)u[0] << 16) | ((uint32_t)u[1] << 8) | u[2];
+    h.type = u[3];
+    h.flags = u[4];
+    h.stream_id = read_u32(p + 5) & 0x7fffffff;
+}
+
+// payload of DATA or HEADERS without padding and priority fields,
+// false if they don't fit in the frame
+bool frame_payload(const Http2FrameHeader &h, const char *&p, size_t &len);
+
+void append_u32(std::string &out, uint32_t v);
+void append_frame_header(std::string &out, size_t length, int type, int flags,
+        uint32_t stream_id);
+// frames with fixed payloads
+void append_settings(std::string &out, const uint32_t (*settings)[2], size_t n);
+void append_window_update(std::string &out, uint32_t stream_id, uint32_t increment);
+void append_rst_stream(std::string &out, uint32_t stream_id, Http2Error error);
+void append_goaway(std::string &out, uint32_t last_stream_id, Http2Error error);
+
+// HTTP2-Settings header of an upgrade request is a SETTINGS payload in
+// base64url without padding. false if it is not valid base64url
+bool decode_base64url(StrRef in, std::string &out);
+
+}
+
+#endif
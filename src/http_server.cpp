@@ -1,12 +1,30 @@
 #include <http_server.hpp>
+#include <request_parser.hpp>
+#include <thread_pool.hpp>
+#include <file_cache.hpp>
 #include <zlib_compression.hpp>
+#include <header_writer.hpp>
+#include <metrics.hpp>
+#include <timer_wheel.hpp>
+#include <router.hpp>
+#include <mpsc_queue.hpp>
+#include <response_cache.hpp>
+#include <uring.hpp>
+#include <hpack.hpp>
+#include <http2.hpp>
+#include <websocket.hpp>
 #include <exception>
+#include <stdexcept>
 #include <cstring>
+#include <cerrno>
+#include <cctype>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 
-#include <list>
 #include <thread>
-#include <mutex>
-#include <condition_variable>
+#include <memory>
+#include <map>
+#include <deque>
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
@@ -16,20 +34,309 @@
 
 namespace {
 const std::string CRLF = "\r\n";
-const std::string KV_SEPARATOR = ": ";
+const std::string LAST_CHUNK = "0\r\n\r\n";
+const std::string CONTINUE_100 = "HTTP/1.1 100 Continue\r\n\r\n";
+const std::string SWITCHING_PROTOCOLS = "HTTP/1.1 101 Switching Protocols\r\n"
+    "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
 const std::string STATUS_CODE_STR[] = {
     "HTTP/1.1 200 OK\r\n",
     "HTTP/1.1 404 Not Found\r\n",
     "HTTP/1.1 503 Service Unavailable\r\n",
     "HTTP/1.1 508 Bad Handler ( Recurive threaded switch)\r\n",
     "HTTP/1.1 501 Not Implemented\r\n",
+    "HTTP/1.1 400 Bad Request\r\n",
+    "HTTP/1.1 413 Payload Too Large\r\n",
+    "HTTP/1.1 405 Method Not Allowed\r\n",
+    "HTTP/1.1 500 Internal Server Error\r\n",
+    "HTTP/1.1 304 Not Modified\r\n",
+    "HTTP/1.1 206 Partial Content\r\n",
+    "HTTP/1.1 416 Range Not Satisfiable\r\n",
 };
+const char *METHOD_STR[] = {"GET", "POST", "HEAD", "PUT", "other"};
 
+// upper bounds of histogram buckets in /metrics, in seconds
+const double METRICS_BUCKETS[] = {0.00001, 0.00005, 0.0001, 0.0005, 0.001,
+    0.005, 0.01, 0.05, 0.1, 0.5, 1, 5};
+
+// bodies bigger than this don't keep their buffer for next request
+const size_t MAX_KEPT_CAPACITY = 64 << 10;
+
+// least bytes of body read into postdata_ at a time, it grows with
+// what arrived so far, never by Content-Length alone
+const size_t POST_SLICE = 64 << 10;
+
+// max bytes of one write of a response, the write timeout counts
+// from the last one, so a big body going out slowly is not cut off
+const size_t WRITE_SLICE = 1 << 20;
+
+// max bytes to sendfile() before giving other connections a chance
+const size_t SENDFILE_SLICE = 1 << 20;
+// bytes of a file read at a time for an HTTP/2 stream
+const size_t H2_FILE_SLICE = 1 << 16;
+
+const char *mime_type(const std::string &path)
+{
+    static const char *types[][2] = {
+        {".html", "text/html"},
+        {".htm", "text/html"},
+        {".txt", "text/plain"},
+        {".log", "text/plain"},
+        {".css", "text/css"},
+        {".js", "application/javascript"},
+        {".json", "application/json"},
+        {".xml", "application/xml"},
+        {".png", "image/png"},
+        {".jpg", "image/jpeg"},
+        {".jpeg", "image/jpeg"},
+        {".gif", "image/gif"},
+        {".svg", "image/svg+xml"},
+        {".ico", "image/x-icon"},
+        {".pdf", "application/pdf"},
+        {".zip", "application/zip"},
+        {".gz", "application/gzip"},
+    };
+    size_t dot = path.rfind('.');
+    if (dot != std::string::npos && path.find('/', dot) == std::string::npos) {
+        for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+            if (::strcasecmp(path.c_str() + dot, types[i][0]) == 0)
+                return types[i][1];
+        }
+    }
+    return "application/octet-stream";
+}
+
+// append url path to dir, with %XX decoded, false if it tries to
+// go out of dir
+bool append_url_path(std::string &out, const char *p, const char *end)
+{
+    size_t base = out.size();
+    if (out.empty() || out[out.size() - 1] != '/')
+        out.append(1, '/');
+    while (p < end && *p == '/')
+        p++;
+    for(; p < end; p++) {
+        char c = *p;
+        if (c == '%' && end - p > 2 && isxdigit(p[1]) && isxdigit(p[2])) {
+            char hex[3] = {p[1], p[2], 0};
+            c = (char)::strtol(hex, NULL, 16);
+            p += 2;
+        }
+        if (c == '\0')
+            return false;
+        out.append(1, c);
+    }
+
+    // reject any ".." segment
+    for(size_t pos = base; (pos = out.find("..", pos)) != std::string::npos; pos += 2) {
+        bool seg_begin = pos == 0 || out[pos - 1] == '/';
+        bool seg_end = pos + 2 == out.size() || out[pos + 2] == '/';
+        if (seg_begin && seg_end)
+            return false;
+    }
+    if (out[out.size() - 1] == '/')
+        out.append("index.html");
+    return true;
+}
+
+using tws::StrRef;
+
+// an entity tag as compared by If-None-Match: without W/ and without
+// the suffix compress_body() adds, and without the closing quote
+StrRef etag_core(StrRef tag)
+{
+    static const char *SUFFIXES[] = {"-gzip", "-deflate"};
+    if (tag.starts_with("W/"))
+        tag = StrRef(tag.data() + 2, tag.size() - 2);
+    if (tag.size() < 2 || tag.data()[0] != '"' || tag.data()[tag.size() - 1] != '"')
+        return tag;
+    tag = StrRef(tag.data(), tag.size() - 1);
+    for(size_t i = 0; i < sizeof(SUFFIXES) / sizeof(SUFFIXES[0]); i++) {
+        size_t n = ::strlen(SUFFIXES[i]);
+        if (tag.size() > n && ::memcmp(tag.end() - n, SUFFIXES[i], n) == 0)
+            return StrRef(tag.data(), tag.size() - n);
+    }
+    return tag;
+}
+
+// weak comparison of tag with each one of a comma separated list
+bool etag_listed(StrRef list, StrRef tag)
+{
+    if (tag.empty())
+        return false;
+    StrRef core = etag_core(tag);
+    const char *p = list.data();
+    const char *end = list.end();
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char *q = p;
+        while (q < end && *q != ',')
+            q++;
+        const char *e = q;
+        while (e > p && (e[-1] == ' ' || e[-1] == '\t'))
+            e--;
+        StrRef item = etag_core(StrRef(p, e - p));
+        if ((e - p == 1 && *p == '*') || (item.size() == core.size()
+                    && ::memcmp(item.data(), core.data(), core.size()) == 0))
+            return true;
+        p = q;
+    }
+    return false;
+}
+
+tws::RequestType request_type(StrRef method)
+{
+    if (method.equals("GET"))
+        return tws::HTTP_GET;
+    if (method.equals("POST"))
+        return tws::HTTP_POST;
+    if (method.equals("HEAD"))
+        return tws::HTTP_HEAD;
+    if (method.equals("PUT"))
+        return tws::HTTP_PUT;
+    return tws::HTTP_INVALID;
+}
+
+// headers of HTTP/1 connection management, HTTP/2 has none of them
+bool connection_header(StrRef name)
+{
+    static const char *NAMES[] = {"connection", "keep-alive", "proxy-connection",
+        "transfer-encoding", "upgrade", "http2-settings"};
+    for(size_t i = 0; i < sizeof(NAMES) / sizeof(NAMES[0]); i++) {
+        if (name.equals_nocase(NAMES[i]))
+            return true;
+    }
+    return false;
+}
+
+// token is one of a comma separated list, case-insensitive
+bool header_token(StrRef list, const char *token)
+{
+    size_t n = ::strlen(token);
+    const char *p = list.data();
+    const char *end = list.end();
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char *e = p;
+        while (e < end && *e != ',')
+            e++;
+        const char *q = e;
+        while (q > p && (q[-1] == ' ' || q[-1] == '\t'))
+            q--;
+        if ((size_t)(q - p) == n && ::strncasecmp(p, token, n) == 0)
+            return true;
+        p = e;
+    }
+    return false;
+}
+
+// decimal digits at p, false if none or too many
+bool parse_uint(const char *&p, const char *end, uint64_t &v)
+{
+    const char *start = p;
+    v = 0;
+    for(; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (v > (UINT64_MAX - 9) / 10)
+            return false;
+        v = v * 10 + (*p - '0');
+    }
+    return p > start;
+}
+
+/* memory for completion handlers of one connection. a connection has
+ * at most a read or write and a wait in flight, so a couple of slots
+ * cover it and asio never goes to the heap for them */
+class HandlerMemory
+{
+    enum { kSlots = 2, kSlotSize = 256 };
+    typename std::aligned_storage<kSlotSize>::type storage_[kSlots];
+    bool in_use_[kSlots];
+
+public:
+    HandlerMemory() { in_use_[0] = in_use_[1] = false; }
+    HandlerMemory(const HandlerMemory&) = delete;
+    HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+    void *allocate(size_t size)
+    {
+        for(int i = 0; size <= kSlotSize && i < kSlots; i++) {
+            if (!in_use_[i]) {
+                in_use_[i] = true;
+                return &storage_[i];
+            }
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void *p)
+    {
+        for(int i = 0; i < kSlots; i++) {
+            if (p == &storage_[i]) {
+                in_use_[i] = false;
+                return;
+            }
+        }
+        ::operator delete(p);
+    }
+};
+
+template <typename T>
+class HandlerAllocator
+{
+    template <typename> friend class HandlerAllocator;
+    HandlerMemory *memory_;
+
+public:
+    typedef T value_type;
+
+    explicit HandlerAllocator(HandlerMemory &mem) : memory_(&mem) {}
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U> &other) : memory_(other.memory_) {}
+
+    T *allocate(size_t n)
+    {
+        return static_cast<T *>(memory_->allocate(sizeof(T) * n));
+    }
+    void deallocate(T *p, size_t) { memory_->deallocate(p); }
+
+    bool operator==(const HandlerAllocator &other) const 
+    { return memory_ == other.memory_; }
+    bool operator!=(const HandlerAllocator &other) const 
+    { return memory_ != other.memory_; }
+};
+
+// wraps a handler so asio allocates its operation from HandlerMemory
+template <typename Handler>
+class AllocHandler
+{
+    HandlerMemory &memory_;
+    Handler handler_;
+
+public:
+    typedef HandlerAllocator<Handler> allocator_type;
+
+    AllocHandler(HandlerMemory &mem, Handler h) : memory_(mem), handler_(h) {}
+
+    allocator_type get_allocator() const { return allocator_type(memory_); }
+
+    template <typename... Args>
+    void operator()(Args&&... args) { handler_(std::forward<Args>(args)...); }
+};
+
+template <typename Handler>
+inline AllocHandler<Handler> make_alloc_handler(HandlerMemory &mem, Handler h)
+{
+    return AllocHandler<Handler>(mem, h);
+}
 
 }
 
 namespace tws {
 
+static_assert(HTTP_INVALID < STAT_METHODS && HTTP_END <= STAT_CODES,
+        "ServerStats counters too small");
+
 class ServerException: public std::exception {
     char msg_[64];
 public:
@@ -37,9 +344,23 @@ public:
     const char *what() const noexcept { return msg_; }
 };
 
+class HttpReactor;
+class Http2Session;
+class WsSession;
 class HttpConnection
-    : public boost::enable_shared_from_this<HttpConnection>
+    : public boost::enable_shared_from_this<HttpConnection>,
+      public PoolTask,
+      public TimerEntry,
+      public MpscNode
 {
+    friend class HttpServerInter;
+    friend class HttpReactor;
+    friend class Http2Session;
+    friend class WsSession;
+    friend struct ResponderState;
+    friend class Responder;
+    friend struct WebSocketState;
+
     enum State {
         kReadingHeader,
         kReadingPost,
@@ -48,90 +369,767 @@ class HttpConnection
         kWriteBody,
     };
 
-    boost::asio::ip::tcp::socket socket_;
+    // TCP or Unix domain, by the listener it came from
+    boost::asio::generic::stream_protocol::socket socket_;
+    HttpReactor *reactor_;
     HttpServerInter *http_server_;
+    HandlerMemory handler_memory_;
+    bool started_;
+
+    // what is being waited for, timeouts are set by HttpServer::set_timeouts
+    enum TimerKind {
+        kTimerNone = -1,
+        kTimerIdle = 0,     // next request on a kept connection
+        kTimerHeader,       // rest of request header, from its first byte
+        kTimerBody,         // more of request body
+        kTimerWrite,        // response write making progress
+        kTimerKinds,
+    };
+    int timer_kind_;
 
     int state_;
     int http_ret_;
 
-    unsigned int postsize_;
-    std::string request_;
+    // received bytes are buffer_[rpos_, wpos_), request being parsed
+    // starts at rpos_, next pipelined request starts at next_.
+    // header is limited to 8K by parser_, rest is for body
+    std::array<char, 16384> buffer_;
+    size_t rpos_;
+    size_t wpos_;
+    size_t next_;
+    RequestParser parser_;
 
+    // request body, by Content-Length or chunked, goes to postdata_
+    // or to the sink set by body handler
+    enum BodyMode {
+        kBodyNone,
+        kBodyLength,
+        kBodyChunked,
+    };
+    int body_mode_;
+    uint64_t postsize_;
+    uint64_t body_remain_;
+    size_t body_start_;
+    ChunkedDecoder body_decoder_;
+    BodySink sink_;
+    bool send_continue_;
 
-    std::array<char, 8192> buffer_;
+    // requests served on this connection, and whether to keep it open
+    // after current response
+    int served_;
+    bool keep_alive_;
 
+    // per-request allocations, dropped all at once in next_request().
+    // must be declared before req_ and resp_, which use it
+    Arena arena_;
     Request req_;
     Response resp_;
 
+    // status line and headers of current response
+    std::string head_;
+
+    // keeps connection alive while queued in thread pool, or in
+    // completion queue of the reactor
+    boost::shared_ptr<HttpConnection> pooled_self_;
+    // set while the request may be worked on in a pool thread, writes
+    // are then handed over to the I/O thread, see start_write()
+    bool in_pool_;
+
+    // next write, empty buffers are skipped
+    typedef void (HttpConnection::*WriteHandler)(const boost::system::error_code&);
+    std::array<boost::asio::const_buffer, 4> out_;
+    WriteHandler after_write_;
+    // matched route of current request, NULL for RequestHandler
+    const Router::Route *route_;
+    uint64_t handler_start_;
+
+    // key of current request in response cache. cache_fill_ is set
+    // when this request makes the response others may wait for, 
+    // cache_bypass_ when it waited but got none and makes its own.
+    // cached_ is the cached response being sent
+    std::string cache_key_;
+    bool cache_fill_;
+    bool cache_bypass_;
+    CachedResponsePtr cached_;
+
+#ifdef HTTP_COMPRESSION
+    // compressed body is made here then swapped with body_,
+    // both keep their capacity for next requests
+    std::string zbuf_;
+#endif
+
+    // streamed body, pieces are made by resp_.stream_ one at a time
+    bool streaming_;
+    bool chunked_;
+    std::string chunk_;
+    char chunk_size_[24];
+    // part of the stream asked for by Range: bytes to drop, then to send
+    uint64_t stream_skip_;
+    uint64_t stream_remain_;
+#ifdef HTTP_COMPRESSION
+    std::unique_ptr<StreamCompressor> zstream_;
+    bool stream_compress_;
+#endif
+
+    // file body being sent by sendfile()
+    OpenFilePtr file_;
+    off_t file_offset_;
+    size_t file_remain_;
+
+    // HTTP/2. a connection which switched to it has h2_, which turns
+    // what it reads into streams. a stream is an HttpConnection without
+    // socket, made by the session of h2_conn_, its response goes there
+    // to be sent as frames
+    std::unique_ptr<Http2Session> h2_;
+    boost::shared_ptr<HttpConnection> h2_conn_;
+    uint32_t stream_id_;
+
+    // WebSocket, set once the handshake of a websocket route is
+    // answered. reads and writes of the connection are its frames
+    std::unique_ptr<WsSession> ws_;
+
+#ifdef HTTP_IO_URING
+    // read and write in flight on the ring of the reactor, each keeps
+    // the connection alive till its completion is reaped
+    struct RingRead : public UringOp {
+        boost::shared_ptr<HttpConnection> conn;
+        void complete(int res, unsigned flags);
+    };
+    struct RingWrite : public UringOp {
+        boost::shared_ptr<HttpConnection> conn;
+        void complete(int res, unsigned flags);
+    };
+    RingRead ring_read_;
+    RingWrite ring_write_;
+    // what is left of out_ to send
+    struct msghdr write_msg_;
+    struct iovec write_iov_[4];
+    void queue_ring_write();
+    void handle_ring_write(int res);
+#endif
 
 public:
-    HttpConnection(HttpServerInter* http_server);
+    HttpConnection(HttpReactor* reactor);
+    ~HttpConnection();
 
 
     void start();
     void handle_read(const boost::system::error_code& e,
                 std::size_t bytes_transferred);
+    void handle_read_post(const boost::system::error_code& e,
+                std::size_t bytes_transferred);
+    void handle_write_continue(const boost::system::error_code& e);
+    void continue_request();
+    void read_post_slice();
+    void next_request();
+    void close();
+    void start_read();
+    void arm_timer(int kind);
+    void disarm_timer();
+    void handle_timeout();
 
     void process_request();
-    int parse_request_header();
-    int try_parse_request(std::size_t bytes_transferred);
+    bool serve_static();
+    bool serve_metrics();
+    bool serve_cached();
+    void resume_cached(const CachedResponsePtr &resp);
+    void send_cached(const CachedResponsePtr &resp);
+    void fill_cache(size_t shared_head);
+    bool find_route();
+    void call_async_handler();
+    void finish_async(int code);
+    void run_in_pool();
+    void start_write();
+    void shed();
+    void reject_overloaded();
+    int setup_request();
+    int try_parse_request();
+    int begin_body();
+    int read_body();
+    int deliver_body(const char *data, size_t len);
+#ifdef HTTP_COMPRESSION
+    CompressionFormat body_compression();
+    void compress_body();
+    void begin_stream_compression();
+    void mark_encoded_etag(CompressionFormat format);
+#endif
+    void check_conditions();
+    bool not_modified();
+    bool if_range_matches();
+    void apply_range(uint64_t length);
     void begin_response();
+    void handle_write_stream(const boost::system::error_code& e);
+    void write_chunk();
     void handle_write(const boost::system::error_code& e);
-    boost::asio::ip::tcp::socket& socket()  { return socket_;}
+    void handle_write_file(const boost::system::error_code& e);
+    void start_h2();
+    bool upgrade_h2c();
+    void continue_h2();
+    void handle_write_h2(const boost::system::error_code& e);
+    bool add_h2_header(StrRef name, StrRef value);
+    void copy_request(const Request &from);
+    void start_h2_stream(bool end_stream);
+    bool h2_data(const char *data, size_t len, bool end_stream);
+    void accept_websocket();
+    void continue_ws();
+    void handle_write_ws(const boost::system::error_code& e);
+    boost::asio::generic::stream_protocol::socket& socket()  { return socket_;}
 };
 
 
 typedef boost::shared_ptr<HttpConnection> HttpConnPtr;
+
+/* one event loop with its own listening socket, connections accepted 
+ * by a reactor are served by it for their whole lifetime */
+class HttpReactor
+{
+    friend class HttpServerInter;
+    friend class HttpConnection;
+    friend class Http2Session;
+    friend class WsSession;
+    friend struct ResponderState;
+    friend class Responder;
+    friend struct WebSocketState;
+    friend class WebSocket;
+
+private:
+    HttpServerInter *http_server_;
+    // connections touch these when destroyed, so they go after io_
+    TimerWheel wheel_;
+    std::atomic<int> conns_;
+    // WebSocket connections subscribed to each topic, see broadcast()
+    std::unordered_map<std::string, std::vector<HttpConnection *> > topics_;
+    // own event loop, or none in embedded mode, io_ is the one used
+    std::unique_ptr<boost::asio::io_service> own_io_;
+    boost::asio::io_service &io_;
+    // drives wheel_ once a second
+    boost::asio::steady_timer tick_;
+    std::vector<HttpConnPtr> expired_;
+
+#ifdef HTTP_IO_URING
+    // accepts and connection reads and writes go through ring_. SQEs
+    // queued while handlers run are submitted together at the end of
+    // the loop turn, completions wake the loop through the eventfd
+    Uring ring_;
+    boost::asio::posix::stream_descriptor ring_wakeup_;
+    uint64_t ring_events_;
+    bool flush_posted_;
+    struct Listener;
+    struct RingAccept : public UringOp {
+        HttpReactor *reactor;
+        Listener *listener;
+        void complete(int res, unsigned flags);
+    };
+
+    io_uring_sqe *ring_sqe();
+    void flush_ring();
+    void start_ring_wait();
+    void handle_ring_wait(const boost::system::error_code& error);
+#endif
+
+    // a listening socket. on a TCP port each reactor binds its own with
+    // SO_REUSEPORT, a Unix socket is bound once and each reactor accepts
+    // on a dup of it
+    struct Listener {
+        boost::asio::basic_socket_acceptor<boost::asio::generic::stream_protocol> acceptor;
+        boost::asio::generic::stream_protocol protocol;
+        bool tcp;       // connections get TCP_NODELAY
+#ifdef HTTP_IO_URING
+        RingAccept ring_accept;
+#endif
+        Listener(boost::asio::io_service &io,
+                const boost::asio::generic::stream_protocol &proto)
+            : acceptor(io), protocol(proto), tcp(proto.family() != AF_UNIX) {}
+    };
+    std::vector<std::unique_ptr<Listener> > listeners_;
+
+    void listen_tcp(const boost::asio::ip::tcp::endpoint &endpoint,
+            bool reuse_port);
+    void listen_unix(int fd);
+    void add_listener(Listener *l);
+#ifdef HTTP_IO_URING
+    void start_ring_accept(Listener *l);
+    void handle_ring_accept(Listener *l, int res, unsigned flags);
+#endif
+    void start_accept(Listener *l);
+    void handle_accept(Listener *l, HttpConnPtr new_conn,
+        const boost::system::error_code& error);
+    void start_tick();
+    void handle_tick(const boost::system::error_code& error);
+    void start();
+    void begin_stop();
+    void check_drained();
+    bool drained_;
+
+    // connections whose response was made in thread pool, waiting for
+    // their write to be started here
+    MpscQueue completed_;
+    std::atomic<bool> drain_posted_;
+    void complete(HttpConnection *conn);
+    void drain_completed();
+
+    void publish(const std::string &topic,
+            const std::shared_ptr<const std::string> &frame);
+public:
+    // io is host's event loop, NULL to have its own
+    HttpReactor(HttpServerInter *http_server, boost::asio::io_service *io);
+};
+
+/* HTTP/2 on a connection (RFC 7540), frames read by it are turned
+ * into streams, each an HttpConnection of its own which makes its
+ * response as for HTTP/1. the response comes back here by submit()
+ * as the buffers of a write, the head as HTTP/1 text, and goes out as
+ * HEADERS and DATA frames of the stream. all of it runs in the thread
+ * of the connection */
+class Http2Session
+{
+    struct Stream {
+        HttpConnPtr conn;
+        int64_t send_window;
+        int32_t recv_window;
+        bool remote_closed;     // END_STREAM received
+        bool headers_sent;
+        // a submitted write being framed, from out_[out_index] at
+        // out_offset. last is the end of the response
+        bool pending;
+        bool queued;            // in sending_
+        bool last;
+        size_t out_index;
+        size_t out_offset;
+    };
+
+    enum {
+        kMaxStreams = 128,
+        kStreamWindow = 1 << 20,
+        kConnWindow = 16 << 20,
+        kMaxFrame = 1 << 16,
+        // frames queued before waiting for the socket
+        kMaxBuffered = 1 << 16,
+        kMaxHeaderBlock = 1 << 16,
+    };
+
+    HttpConnection *conn_;
+    HpackDecoder decoder_;
+    HpackEncoder encoder_;
+    std::map<uint32_t, Stream> streams_;
+    // streams with DATA to frame and window for it, taking turns
+    std::deque<uint32_t> sending_;
+
+    bool preface_;
+    // a frame larger than the read buffer is gathered here
+    Http2FrameHeader pending_header_;
+    std::string pending_;
+    // header block continued by CONTINUATION frames
+    std::string header_block_;
+    uint32_t header_stream_;
+    uint8_t header_flags_;
+    uint32_t last_stream_id_;
+    int streams_served_;
+
+    int64_t send_window_;
+    int32_t recv_window_;
+    int64_t initial_send_window_;
+    size_t max_send_frame_;
+
+    // GOAWAY sent or received, no new streams. closing_ closes the
+    // connection once frames are sent, closed_ is after that
+    bool goaway_;
+    bool closing_;
+    bool closed_;
+
+    // frames are queued in obuf_ while wbuf_ is written
+    std::string obuf_;
+    std::string wbuf_;
+    bool writing_;
+    std::string head_;
+    std::string block_;
+    std::string name_;
+
+    void on_frame(const Http2FrameHeader &h, const char *p);
+    void on_headers(uint32_t id, bool end_stream, const char *block, size_t len);
+    void on_data(const Http2FrameHeader &h, const char *p);
+    Http2Error apply_settings(const char *p, size_t len);
+    void on_window_update(uint32_t id, uint32_t increment);
+    void fail(Http2Error error);
+    void reset(uint32_t id, Http2Error error);
+    HttpConnPtr new_stream(uint32_t id, bool remote_closed);
+    int write_headers(uint32_t id, Stream &st);
+    size_t remaining(const Stream &st) const;
+    void write_data();
+    void finish_write(std::map<uint32_t, Stream>::iterator it);
+    void update_timer();
+
+public:
+    explicit Http2Session(HttpConnection *conn);
+
+    // queues the server preface. settings are those of HTTP2-Settings
+    // of an upgrade, which is answered with 101 first. false if they
+    // are not valid
+    bool start(const std::string *upgrade_settings);
+    // request of an upgrade becomes stream 1
+    HttpConnPtr upgrade_stream() { return new_stream(1, true); }
+    // takes whole frames of data, and frames larger than capacity in
+    // pieces. returns bytes used, the rest is left for next time
+    size_t receive(const char *data, size_t len, size_t capacity);
+    void submit(HttpConnection *stream);
+    // stream ended on its side before its response
+    void cancel(HttpConnection *stream);
+    void flush();
+    void write_done();
+    void shutdown();
+    bool closing() const { return closing_; }
+};
+
+/* WebSocket on a connection (RFC 6455), after the handshake of a
+ * websocket route. frames are unmasked in place in the read buffer and
+ * whole messages go to the handler. frames to send are queued as
+ * shared strings, so a broadcast is framed once for all subscribers,
+ * and a few of them go out in one gathered write. a quiet peer is
+ * pinged by the timer of the connection, which then waits for any
+ * frame from it. all of it runs in the thread of the connection */
+class WsSession
+{
+    HttpConnection *conn_;
+    std::shared_ptr<const WebSocketHandler> handler_;
+    WebSocket socket_;
+
+    // frame being read, its payload may come in several reads
+    WsFrameHeader frame_;
+    bool in_frame_;
+    uint64_t frame_left_;
+    uint64_t frame_offset_;
+    // message continued by CONTINUATION frames, opcode 0 if none
+    std::string message_;
+    int message_opcode_;
+    std::string control_;
+
+    std::deque<std::shared_ptr<const std::string> > queue_;
+    size_t queued_bytes_;
+    // frames being written, each in a buffer of out_
+    std::array<std::shared_ptr<const std::string>, 4> writing_;
+    bool write_pending_;
+
+    bool open_;         // handshake response queued, writes may start
+    bool reading_;      // no CLOSE received and no protocol error
+    bool close_sent_;
+    bool closed_;       // connection is closed
+    bool finished_;     // on_close called
+    bool pong_wait_;    // PING sent, nothing heard since
+    std::vector<std::string> topics_;
+
+    void on_control();
+    void on_message();
+    void fail(int code);
+    void finish(int code);
+    void queue(const std::shared_ptr<const std::string> &frame);
+    void update_timer();
+    void unsubscribe_all();
+
+public:
+    WsSession(HttpConnection *conn,
+            const std::shared_ptr<const WebSocketHandler> &handler,
+            const std::shared_ptr<WebSocketState> &state);
+    ~WsSession();
+
+    WebSocket &socket() { return socket_; }
+    // handshake response goes before whatever on_open has sent
+    void start(const std::string &response);
+    // unmasks data in place. returns bytes used, all but a partial
+    // frame header
+    size_t receive(char *data, size_t len);
+    bool reading() const { return reading_; }
+    void send(const std::shared_ptr<const std::string> &frame);
+    void close(int code, StrRef reason);
+    void subscribe(const std::string &topic, bool on);
+    // PING after ping_interval of silence, false if it is time to
+    // give up on the connection instead
+    bool ping();
+    void flush();
+    void write_done();
+    void shutdown();
+};
+
+struct ResponderState
+{
+    HttpConnPtr conn;
+    std::atomic<bool> done;
+
+    // response goes out in connection's own thread, whoever finishes it
+    void finish(int code)
+    {
+        if (!done.exchange(true))
+            conn->reactor_->io_.post(
+                    boost::bind(&HttpConnection::finish_async, conn, code));
+    }
+    ~ResponderState() { finish(HTTP_500); }
+};
+
+const Request &Responder::request() const
+{
+    return state_->conn->req_;
+}
+
+Response &Responder::response() const
+{
+    return state_->conn->resp_;
+}
+
+void Responder::finish(int code) const
+{
+    state_->finish(code);
+}
+
+boost::asio::io_context &Responder::io_context() const
+{
+    return state_->conn->reactor_->io_;
+}
+
+struct WebSocketState
+{
+    boost::weak_ptr<HttpConnection> conn;
+    HttpReactor *reactor;
+
+    // f runs on the session in connection's own thread, if it is
+    // still there by then
+    void run(const std::function<void (WsSession &)> &f)
+    {
+        HttpConnPtr c = conn.lock();
+        if (c)
+            reactor->io_.dispatch([c, f]() {
+                if (c->ws_)
+                    f(*c->ws_);
+            });
+    }
+};
+
+void WebSocket::send(const std::string &data, bool binary) const
+{
+    std::shared_ptr<std::string> frame = std::make_shared<std::string>();
+    append_ws_frame(*frame, binary ? WS_BINARY : WS_TEXT, data.data(), data.size());
+    std::shared_ptr<const std::string> shared(frame);
+    state_->run([shared](WsSession &ws) { ws.send(shared); });
+}
+
+void WebSocket::close(int code, const std::string &reason) const
+{
+    state_->run([code, reason](WsSession &ws) {
+        ws.close(code, StrRef(reason.data(), reason.size()));
+    });
+}
+
+void WebSocket::subscribe(const std::string &topic) const
+{
+    state_->run([topic](WsSession &ws) { ws.subscribe(topic, true); });
+}
+
+void WebSocket::unsubscribe(const std::string &topic) const
+{
+    state_->run([topic](WsSession &ws) { ws.subscribe(topic, false); });
+}
+
+boost::asio::io_context &WebSocket::io_context() const
+{
+    return state_->reactor->io_;
+}
+
 class HttpServerInter
 {
     //friend class HttpServer;
     friend class HttpConnection;
+    friend class HttpReactor;
+    friend class Http2Session;
+    friend class WsSession;
 
 private:
-    boost::asio::io_service io_;
-    boost::asio::ip::tcp::acceptor acceptor_;
+    HttpReactor **reactors_;
+    int iothreadnum_;
+    // reactors run on event loops of the host application
+    bool embedded_;
+    // socket files of listen_unix(), removed with the server
+    std::vector<std::string> unix_paths_;
 
-    std::thread **threads_;
-    int threadnum_;
+    ThreadPool threadpool_;
+    // takes pool work instead of threadpool_ if set
+    OffloadExecutor executor_;
     RequestHandler req_handler_;
-    
-    std::list<HttpConnPtr> threadpool_q_;
-    std::condition_variable threadpool_cv_;
-    std::mutex threadpool_m_;
+    BodyHandler body_handler_;
+    uint64_t max_body_size_;
+    int max_keepalive_requests_;
 
-    void start_accept();
-    void handle_accept(HttpConnPtr new_conn,
-        const boost::system::error_code& error);
+    struct StaticDir {
+        std::string prefix;
+        std::string dir;
+    };
+    std::vector<StaticDir> static_dirs_;
+    FileCache file_cache_;
+    bool auto_etag_;
+    bool http2_;
+    ResponseCache response_cache_;
+    Router router_;
+    Metrics metrics_;
+    std::string metrics_path_;
+    // seconds, by HttpConnection::TimerKind, 0 means no limit
+    int timeouts_[4];
+    std::atomic<bool> stopping_;
+    std::atomic<bool> started_;
+    // reactors not drained yet, on_stopped_ is called by the last one
+    std::atomic<int> running_;
+    std::function<void ()> on_stopped_;
+    // seconds, of 503 for a full pool queue
+    int retry_after_;
+#ifdef HTTP_COMPRESSION
+    size_t compression_min_size_;
+#endif
 
-    void push_to_threadpool(HttpConnPtr conn);
+    bool has_pool() const { return threadpool_.threadnum() > 0 || executor_; }
+    bool push_to_threadpool(HttpConnPtr conn, ThreadPool::Priority priority);
+    void reactor_stopped();
 
-    void thread_proc(int id);
 public:
+    // ios are event loops of the host application, a reactor on each,
+    // empty for iothreadnum reactors of own
     HttpServerInter(unsigned short port,
-            RequestHandler main_handler, int threadnum);
+            RequestHandler main_handler, int threadnum, int iothreadnum,
+            const std::vector<boost::asio::io_service *> &ios);
+    ~HttpServerInter();
+    void listen(const boost::asio::ip::tcp::endpoint &endpoint);
+    void listen_unix(const std::string &path);
     void set_handler(RequestHandler handler);
+    void route(RequestType method, const std::string &pattern,
+            const Router::Route &route);
+    void broadcast(const std::string &topic, const std::string &data, bool binary);
+    void set_body_handler(BodyHandler handler);
+    void set_max_body_size(uint64_t max_bytes);
+    void set_keepalive(int max_requests);
+    void set_pool_queue(size_t max_queued, OverloadPolicy policy,
+            int retry_after);
+    void set_pool_delay_control(int target_ms, int interval_ms);
+    void set_executor(OffloadExecutor executor);
+    void add_static_dir(const std::string &url_prefix, const std::string &dir);
+    void set_file_cache(size_t max_files);
+    void enable_etags(bool on);
+    void enable_http2(bool on);
+    void enable_response_cache(size_t max_bytes);
+#ifdef HTTP_COMPRESSION
+    void set_compression_min_size(size_t min_size);
+#endif
+    void enable_metrics(const std::string &path);
+    void set_timeouts(int idle, int header, int body, int write);
     void run();
-    void stop();
+    void start();
+    void stop(std::function<void ()> on_stopped);
+    ServerStats stat() const;
+    void render_metrics(std::string &out) const;
 };
 
+Request::Request(Arena *arena)
+    : header_map_(arena),
+      path_copied_(false),
+      headers_copied_(false)
+{
+    clear();
+}
+
 void Request::clear()
 {
     type_ = HTTP_INVALID;
-    path_.clear();
-    postdata_.clear();
+    version_ = 1;
+    method_ = uri_ = url_path_ = query_ = StrRef();
+    header_map_.clear();
+    params_.count = 0;
+    if (postdata_.capacity() > MAX_KEPT_CAPACITY)
+        std::string().swap(postdata_);
+    else
+        postdata_.clear();
+    body_streamed_ = false;
     threaded_ = false;
+    if (path_copied_)
+        path_.clear();
+    if (headers_copied_)
+        headers_.clear();
+    path_copied_ = headers_copied_ = false;
+}
+
+void Request::set_uri(StrRef uri)
+{
+    uri_ = uri;
+    const char *q = (const char *)::memchr(uri_.data(), '?', uri_.size());
+    if (q) {
+        url_path_ = StrRef(uri_.data(), q - uri_.data());
+        query_ = StrRef(q + 1, uri_.end() - q - 1);
+    } else {
+        url_path_ = uri_;
+        query_ = StrRef();
+    }
+}
+
+StrRef Request::param(const char *name) const
+{
+    for(int i = 0; i < params_.count; i++) {
+        if (params_.names[i].equals(name))
+            return params_.values[i];
+    }
+    return StrRef();
+}
+
+const std::string &Request::path() const
+{
+    if (!path_copied_) {
+        path_.assign(uri_.data(), uri_.size());
+        path_copied_ = true;
+    }
+    return path_;
+}
+
+const std::unordered_map<std::string, std::string> &Request::headers() const
+{
+    if (!headers_copied_) {
+        for(auto it = header_map_.begin(); it != header_map_.end(); it++)
+            headers_[it->first.str()] = it->second.str();
+        headers_copied_ = true;
+    }
+    return headers_;
+}
+
+Response::Response(Arena *arena)
+    : arena_(arena),
+      headers_(arena)
+{
+    clear();
 }
 
 void Response::clear()
 {
     headers_.clear();
-    body_.clear();
+    if (body_.capacity() > MAX_KEPT_CAPACITY)
+        std::string().swap(body_);
+    else
+        body_.clear();
+    file_.clear();
+    stream_ = nullptr;
+    stream_length_ = kUnknownLength;
+    cache_ttl_ = 0;
 #ifdef HTTP_COMPRESSION
     compression_ = 5;
 #endif
 
 }
 
+void Response::set_etag(const std::string &tag)
+{
+    if (!tag.empty() && tag[tag.size() - 1] == '"')
+        set_header("ETag", tag);
+    else
+        set_header("ETag", "\"" + tag + "\"");
+}
+
+void Response::set_last_modified(time_t mtime)
+{
+    char date[32];
+    size_t n = format_http_date(mtime, date);
+    set_header("Last-Modified", 13, date, n);
+}
+
 #ifdef HTTP_COMPRESSION
 void Response::set_compression(int level)
 {
@@ -143,299 +1141,2835 @@ void Response::set_compression(int level)
 }
 #endif
 
-HttpConnection::HttpConnection(HttpServerInter* http_server)
-        : socket_(http_server->io_),
-        http_server_(http_server)
+HttpConnection::HttpConnection(HttpReactor* reactor)
+        : socket_(reactor->io_),
+        reactor_(reactor),
+        http_server_(reactor->http_server_),
+        started_(false),
+        timer_kind_(kTimerNone),
+        rpos_(0),
+        wpos_(0),
+        next_(0),
+        body_mode_(kBodyNone),
+        postsize_(0),
+        body_remain_(0),
+        body_start_(0),
+        send_continue_(false),
+        served_(0),
+        keep_alive_(false),
+        req_(&arena_),
+        resp_(&arena_),
+        in_pool_(false),
+        after_write_(NULL),
+        route_(NULL),
+        cache_fill_(false),
+        cache_bypass_(false),
+        streaming_(false),
+        chunked_(false),
+        stream_skip_(0),
+        stream_remain_(0),
+#ifdef HTTP_COMPRESSION
+        stream_compress_(false),
+#endif
+        file_offset_(0),
+        file_remain_(0),
+        stream_id_(0)
 {
-    req_.clear();
-    resp_.clear();
+}
+
+HttpConnection::~HttpConnection()
+{
+    // the last reference may go in a pool thread, but then no I/O is
+    // pending and the timer was disarmed in I/O thread, so the wheel
+    // is only touched when it's safe
+    disarm_timer();
+    // requests waiting for our response make their own
+    if (cache_fill_)
+        http_server_->response_cache_.fill(cache_key_, CachedResponsePtr());
+    if (started_) {
+        StatSlot &stat = http_server_->metrics_.local();
+        stat.add(stat.closed);
+        if (reactor_->conns_.fetch_sub(1) == 1 && http_server_->stopping_)
+            reactor_->io_.post(boost::bind(&HttpReactor::check_drained, reactor_));
+    }
 }
 
 void HttpConnection::start() 
 {
+    started_ = true;
+    reactor_->conns_++;
+    StatSlot &stat = http_server_->metrics_.local();
+    stat.add(stat.accepted);
     state_ = kReadingHeader;
-    socket_.async_read_some(boost::asio::buffer(buffer_),
-        boost::bind(&HttpConnection::handle_read, shared_from_this(),
-        boost::asio::placeholders::error,
-        boost::asio::placeholders::bytes_transferred));
+    continue_request();
 }
 
 void HttpConnection::handle_read(const boost::system::error_code& e,
     std::size_t bytes_transferred)
 {
     if (!e) {
-        int ret = try_parse_request(bytes_transferred);
-        if (ret == 0) {
-            //pasre succeed
-            state_ = kProcessing;
-            process_request();
-        } else if (ret > 0) {
-            //go on read
-            socket_.async_read_some(boost::asio::buffer(buffer_),
-                boost::bind(&HttpConnection::handle_read, shared_from_this(),
-                boost::asio::placeholders::error,
-                boost::asio::placeholders::bytes_transferred));
-        } else {
-            // < 0 parse failed
-            socket_.close();
-        }
+        StatSlot &stat = http_server_->metrics_.local();
+        stat.add(stat.bytes_in, bytes_transferred);
+        wpos_ += bytes_transferred;
+        continue_request();
     } else {
-        socket_.close();
+        close();
     }
 }
 
-void HttpConnection::process_request()
+void HttpConnection::handle_read_post(const boost::system::error_code& e,
+    std::size_t bytes_transferred)
 {
-    http_ret_ = http_server_->req_handler_(resp_, req_);
-    if (http_ret_ == HTTP_SWITCH_THREAD) {
-        if (req_.threaded_ == true) {
-            http_ret_ = HTTP_508;
-            resp_.set_body("");
-            begin_response();
-        } else {
-            /* push to http_server's thread pool */
-            req_.threaded_ = true;
-            if (http_server_->threadnum_ == 0) {
-                ServerException e("Useing threadpool in callback handler"
-                        "but thread num set to zero");
-                throw e;
-            }
-            http_server_->push_to_threadpool(shared_from_this());
+    if (!e) {
+        StatSlot &stat = http_server_->metrics_.local();
+        stat.add(stat.bytes_in, bytes_transferred);
+        if (req_.postdata_.size() < postsize_) {
+            read_post_slice();
+            return;
         }
+        state_ = kProcessing;
+        process_request();
     } else {
-        begin_response();
+        close();
     }
 }
 
-int HttpConnection::parse_request_header()
+void HttpConnection::handle_write_continue(const boost::system::error_code& e)
 {
-    size_t spos;
-    const char *h;
-    if ((spos = request_.find("\r\n\r\n")) == std::string::npos) 
-        return -1;
-    spos += 4; //after \r\n\r\n
-    h = request_.c_str();
-
-#define PREFIX_EQ(haystack, needle) (::strncmp(haystack, needle, ::strlen(needle)) == 0)
-    if (PREFIX_EQ(h, "GET ")) {
-        req_.type_ = HTTP_GET;
-        h += ::strlen("GET ");
-    } else if (PREFIX_EQ(h, "POST ")) {
-        req_.type_ = HTTP_POST;
-        state_ = kReadingPost;
-        req_.postdata_ = request_.substr(spos);
-        h += ::strlen("POST ");
-    } else if (PREFIX_EQ(h, "HEAD ")) {
-        req_.type_ = HTTP_HEAD;
-        h += ::strlen("HEAD ");
-    } else if (PREFIX_EQ(h, "PUT ")) {
-        req_.type_ = HTTP_PUT;
-        state_ = kReadingPost;
-        req_.postdata_ = request_.substr(spos);
-        h += ::strlen("PUT ");
+    if (!e) {
+        continue_request();
     } else {
-        // not begin with GET/POST/PUT/HEAD..
-        return  -1;
+        close();
     }
+}
 
-
-    while(!PREFIX_EQ(h, " HTTP/1.")) {
-        req_.path_.append(1, *h);
-        h++;
+void HttpConnection::continue_request()
+{
+    if (ws_) {
+        continue_ws();
+        return;
     }
-
-    h += ::strlen(" HTTP/1.1\r\n");
-
-    auto split_kv = [this](const char *s) {
-        const char *p = s;
-        std::string key, value;
-        bool inkey = true;
-        for( ; *p != '\0'; ) {
-            if (PREFIX_EQ(p, "\r\n")) {
-                // \r\n found
-                if (!key.empty())
-                    this->req_.headers_[key] = value;
-                return p + 2;
-            }
-            if (inkey) {
-                // before  " : "
-                if (PREFIX_EQ(p, ": ")) {
-                    p += 2;
-                    inkey = false;
-                    continue;
-                } else if (PREFIX_EQ(p, " : ")) {
-                    p += 3;
-                    inkey = false;
-                    continue;
-                } else {
-                    key.append(1, *p);
-                }
+    if (h2_) {
+        continue_h2();
+        return;
+    }
+    // HTTP/2 with prior knowledge starts with its preface
+    if (http_server_->http2_ && served_ == 0 && state_ == kReadingHeader 
+            && wpos_ > 0) {
+        size_t n = std::min(wpos_, H2_PREFACE_LEN);
+        if (::memcmp(buffer_.data(), H2_PREFACE, n) == 0) {
+            if (n == H2_PREFACE_LEN) {
+                disarm_timer();
+                start_h2();
             } else {
-                // after " : "
-                value.append(1, *p);
+                arm_timer(kTimerHeader);
+                start_read();
             }
-            p++;
+            return;
+        }
+    }
+
+    int ret = try_parse_request();
+    if (ret == 0) {
+        //pasre succeed
+        disarm_timer();
+        if (http_server_->http2_ && upgrade_h2c())
+            return;
+        state_ = kProcessing;
+        process_request();
+    } else if (ret == 2) {
+        // rejected before reading the body, respond with http_ret_
+        keep_alive_ = false;
+        state_ = kProcessing;
+        begin_response();
+    } else if (ret > 0 && send_continue_) {
+        // client waits for this before sending body
+        send_continue_ = false;
+        arm_timer(kTimerWrite);
+        boost::asio::async_write(socket_, boost::asio::buffer(CONTINUE_100),
+            make_alloc_handler(handler_memory_,
+                boost::bind(&HttpConnection::handle_write_continue, shared_from_this(),
+                boost::asio::placeholders::error)));
+    } else if (ret > 0 && state_ == kReadingPost && body_mode_ == kBodyLength
+            && !sink_) {
+        // rest of post data goes to postdata_ directly
+        read_post_slice();
+    } else if (ret > 0) {
+        //go on read
+        if (state_ == kReadingPost) {
+            arm_timer(kTimerBody);
+        } else if (wpos_ > rpos_) {
+            // slow senders don't get more time by sending bit by bit
+            if (timer_kind_ != kTimerHeader)
+                arm_timer(kTimerHeader);
+        } else if (http_server_->stopping_) {
+            close();
+            return;
+        } else {
+            arm_timer(kTimerIdle);
+        }
+        start_read();
+    } else {
+        // < 0 parse failed
+        close();
+    }
+}
+
+// doubles postdata_ at most, so what it holds is bounded by what the
+// client really sent
+void HttpConnection::read_post_slice()
+{
+    size_t got = req_.postdata_.size();
+    size_t slice = std::min<uint64_t>(postsize_ - got, std::max(got, POST_SLICE));
+    req_.postdata_.resize(got + slice);
+    arm_timer(kTimerBody);
+    boost::asio::async_read(socket_,
+        boost::asio::buffer(&req_.postdata_[got], slice),
+        [this](const boost::system::error_code& e, std::size_t) -> std::size_t {
+            // body timeout counts from last progress, not from start
+            if (e)
+                return 0;
+            arm_timer(kTimerBody);
+            return 65536;
+        },
+        make_alloc_handler(handler_memory_,
+            boost::bind(&HttpConnection::handle_read_post, shared_from_this(),
+            boost::asio::placeholders::error,
+            boost::asio::placeholders::bytes_transferred)));
+}
+
+void HttpConnection::start_read()
+{
+#ifdef HTTP_IO_URING
+    io_uring_sqe *sqe = reactor_->ring_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = socket_.native_handle();
+    sqe->addr = (uintptr_t)(buffer_.data() + wpos_);
+    sqe->len = buffer_.size() - wpos_;
+    sqe->user_data = (uintptr_t)static_cast<UringOp *>(&ring_read_);
+    ring_read_.conn = shared_from_this();
+#else
+    socket_.async_read_some(
+        boost::asio::buffer(buffer_.data() + wpos_, buffer_.size() - wpos_),
+        make_alloc_handler(handler_memory_,
+            boost::bind(&HttpConnection::handle_read, shared_from_this(),
+            boost::asio::placeholders::error,
+            boost::asio::placeholders::bytes_transferred)));
+#endif
+}
+
+#ifdef HTTP_IO_URING
+void HttpConnection::RingRead::complete(int res, unsigned)
+{
+    HttpConnPtr self;
+    self.swap(conn);
+    if (res > 0)
+        self->handle_read(boost::system::error_code(), res);
+    else if (res == 0)
+        self->handle_read(boost::asio::error::eof, 0);
+    else
+        self->handle_read(boost::system::error_code(-res,
+                    boost::system::system_category()), 0);
+}
+
+// out_ goes in one sendmsg(), like writev()
+void HttpConnection::queue_ring_write()
+{
+    io_uring_sqe *sqe = reactor_->ring_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = socket_.native_handle();
+    sqe->addr = (uintptr_t)&write_msg_;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)static_cast<UringOp *>(&ring_write_);
+    ring_write_.conn = shared_from_this();
+}
+
+void HttpConnection::RingWrite::complete(int res, unsigned)
+{
+    HttpConnPtr self;
+    self.swap(conn);
+    self->handle_ring_write(res);
+}
+
+void HttpConnection::handle_ring_write(int res)
+{
+    if (res < 0) {
+        (this->*after_write_)(boost::system::error_code(-res,
+                    boost::system::system_category()));
+        return;
+    }
+    // a short write goes on from where it stopped
+    size_t n = res;
+    while (write_msg_.msg_iovlen > 0 && n >= write_msg_.msg_iov[0].iov_len) {
+        n -= write_msg_.msg_iov[0].iov_len;
+        write_msg_.msg_iov++;
+        write_msg_.msg_iovlen--;
+    }
+    if (write_msg_.msg_iovlen > 0) {
+        write_msg_.msg_iov[0].iov_base = (char *)write_msg_.msg_iov[0].iov_base + n;
+        write_msg_.msg_iov[0].iov_len -= n;
+        // timeout counts from last progress
+        arm_timer(kTimerWrite);
+        queue_ring_write();
+        return;
+    }
+    (this->*after_write_)(boost::system::error_code());
+}
+#endif
+
+void HttpConnection::next_request()
+{
+    req_.clear();
+    resp_.clear();
+    arena_.reset();
+    body_mode_ = kBodyNone;
+    postsize_ = 0;
+    sink_ = nullptr;
+    send_continue_ = false;
+    cache_bypass_ = false;
+    cached_.reset();
+    parser_.reset();
+    state_ = kReadingHeader;
+
+    // pipelined requests may be already in buffer_, 
+    // move them to front and parse them before reading again
+    if (next_ < wpos_ && next_ > 0) 
+        ::memmove(buffer_.data(), buffer_.data() + next_, wpos_ - next_);
+    wpos_ -= next_;
+    rpos_ = next_ = 0;
+    continue_request();
+}
+
+void HttpConnection::arm_timer(int kind)
+{
+    timer_kind_ = kind;
+    reactor_->wheel_.schedule(this, http_server_->timeouts_[kind], kind);
+}
+
+void HttpConnection::disarm_timer()
+{
+    if (timer_kind_ != kTimerNone) {
+        timer_kind_ = kTimerNone;
+        reactor_->wheel_.cancel(this);
+    }
+}
+
+void HttpConnection::handle_timeout()
+{
+    int kind = timer_kind_;
+    // pending operation fails and drops its reference
+    timer_kind_ = kTimerNone;
+    // a quiet WebSocket is pinged before it is given up
+    if (ws_ && kind == kTimerIdle && ws_->ping())
+        return;
+    StatSlot &stat = http_server_->metrics_.local();
+    stat.add(stat.timeouts);
+    close();
+}
+
+void HttpConnection::close()
+{
+    disarm_timer();
+    // a stream has no socket, it is reset instead
+    if (h2_conn_) {
+        h2_conn_->h2_->cancel(this);
+        return;
+    }
+    if (h2_)
+        h2_->shutdown();
+    if (ws_)
+        ws_->shutdown();
+#ifdef HTTP_IO_URING
+    // queued operations name the fd by number, they must reach the
+    // kernel before the number can be given to another socket
+    reactor_->flush_ring();
+#endif
+    boost::system::error_code ignored_ec;
+    socket_.shutdown(boost::asio::socket_base::shutdown_both, ignored_ec);
+    socket_.close(ignored_ec);
+}
+
+void HttpConnection::process_request()
+{
+    if (!req_.threaded_ && (serve_metrics() || serve_static() || find_route()))
+        return;
+
+    if (route_ && route_->websocket) {
+        accept_websocket();
+        return;
+    }
+    if (route_ && route_->async_handler) {
+        call_async_handler();
+        return;
+    }
+    uint64_t start = now_ns();
+    if (route_)
+        http_ret_ = route_->handler(resp_, req_);
+    else
+        http_ret_ = http_server_->req_handler_(resp_, req_);
+    http_server_->metrics_.local().record_latency(now_ns() - start);
+    if (http_ret_ == HTTP_SWITCH_THREAD) {
+        if (req_.threaded_ == true) {
+            http_ret_ = HTTP_508;
+            resp_.set_body("");
+            begin_response();
+        } else {
+            /* push to http_server's thread pool */
+            req_.threaded_ = true;
+            if (!http_server_->has_pool()) {
+                ServerException e("Useing threadpool in callback handler"
+                        "but thread num set to zero");
+                throw e;
+            }
+            if (!http_server_->push_to_threadpool(shared_from_this(),
+                        ThreadPool::PRIORITY_NORMAL))
+                reject_overloaded();
+        }
+    } else {
+        begin_response();
+    }
+}
+
+bool HttpConnection::serve_static()
+{
+    const std::vector<HttpServerInter::StaticDir> &dirs = http_server_->static_dirs_;
+    if (dirs.empty() || (req_.type_ != HTTP_GET && req_.type_ != HTTP_HEAD))
+        return false;
+
+    for(auto it = dirs.begin(); it != dirs.end(); it++) {
+        if (!req_.url_path_.starts_with(it->prefix.c_str()))
+            continue;
+        std::string path = it->dir;
+        if (append_url_path(path, req_.url_path_.data() + it->prefix.size(),
+                    req_.url_path_.end())) {
+            http_ret_ = HTTP_200;
+            resp_.set_file(path);
+            resp_.set_header("Content-Type", mime_type(path));
+        } else {
+            http_ret_ = HTTP_404;
+        }
+        begin_response();
+        return true;
+    }
+    return false;
+}
+
+bool HttpConnection::serve_metrics()
+{
+    const std::string &path = http_server_->metrics_path_;
+    if (path.empty() || req_.type_ != HTTP_GET 
+            || !req_.url_path_.equals(path.c_str()))
+        return false;
+    http_ret_ = HTTP_200;
+    http_server_->render_metrics(resp_.body_);
+    resp_.set_header("Content-Type", "text/plain; version=0.0.4");
+    begin_response();
+    return true;
+}
+
+void HttpConnection::call_async_handler()
+{
+    handler_start_ = now_ns();
+    std::shared_ptr<ResponderState> state = std::make_shared<ResponderState>();
+    state->conn = shared_from_this();
+    state->done = false;
+    route_->async_handler(Responder(state));
+}
+
+void HttpConnection::finish_async(int code)
+{
+    http_server_->metrics_.local().record_latency(now_ns() - handler_start_);
+    http_ret_ = code;
+    if (http_ret_ == HTTP_SWITCH_THREAD)
+        http_ret_ = HTTP_500;
+    begin_response();
+}
+
+// true if request is done with here: responded with 405, or queued
+// to thread pool for its route
+bool HttpConnection::serve_cached()
+{
+    ResponseCache &cache = http_server_->response_cache_;
+    if (!cache.enabled() || cache_bypass_ || postsize_ > 0
+            || (req_.type_ != HTTP_GET && req_.type_ != HTTP_HEAD))
+        return false;
+    // these may get 304 or 206 from the handler's response
+    if (req_.header_map_.has(HDR_RANGE) || req_.header_map_.has(HDR_IF_NONE_MATCH)
+            || req_.header_map_.has("If-Modified-Since"))
+        return false;
+    // a WebSocket handshake is answered per connection
+    if (req_.header_map_.has("Upgrade"))
+        return false;
+    cache_key_.assign(1, (char)('0' + req_.type_));
+#ifdef HTTP_COMPRESSION
+    // responses differ by the encoding chosen, not by the header itself
+    StrRef accept = req_.header(HDR_ACCEPT_ENCODING);
+    cache_key_.append(1, accept.empty() ? '-' 
+            : (char)('0' + choose_compression(accept.data(), accept.size())));
+#endif
+    // virtual hosts on one listener have pages of their own, the
+    // separator can't be in a host name
+    StrRef host = req_.header(HDR_HOST);
+    cache_key_.append(host.data(), host.size()).append(1, ' ');
+    cache_key_.append(req_.uri_.data(), req_.uri_.size());
+
+    CachedResponsePtr hit;
+    StatSlot &stat = http_server_->metrics_.local();
+    switch (cache.lookup(cache_key_, now_ns(), hit, [this]() {
+                HttpConnPtr self = shared_from_this();
+                return [self](const CachedResponsePtr &resp) {
+                    self->reactor_->io_.post(boost::bind(
+                            &HttpConnection::resume_cached, self, resp));
+                };
+            })) {
+        case ResponseCache::kHit:
+            stat.add(stat.cache_hits);
+            send_cached(hit);
+            return true;
+        case ResponseCache::kWait:
+            // kept alive by the waiter till the response is made
+            stat.add(stat.cache_waits);
+            return true;
+        default:
+            stat.add(stat.cache_misses);
+            cache_fill_ = true;
+            return false;
+    }
+}
+
+void HttpConnection::resume_cached(const CachedResponsePtr &resp)
+{
+    if (resp) {
+        send_cached(resp);
+    } else {
+        cache_bypass_ = true;
+        process_request();
+    }
+}
+
+void HttpConnection::send_cached(const CachedResponsePtr &resp)
+{
+    cached_ = resp;
+    http_ret_ = resp->code;
+    served_++;
+    if (served_ >= http_server_->max_keepalive_requests_
+            || http_server_->stopping_)
+        keep_alive_ = false;
+    HeaderWriter w(head_);
+    w.line(date_header_line());
+    w.line(keep_alive_ ? KEEP_ALIVE_LINE : CLOSE_LINE);
+    w.end();
+
+    out_.fill(boost::asio::const_buffer());
+    out_[0] = boost::asio::buffer(resp->head);
+    out_[1] = boost::asio::buffer(head_);
+    if (req_.type_ != HTTP_HEAD)
+        out_[2] = boost::asio::buffer(resp->body);
+    StatSlot &stat = http_server_->metrics_.local();
+    stat.add(stat.responses[http_ret_]);
+    stat.add(stat.bytes_out, boost::asio::buffer_size(out_));
+    after_write_ = &HttpConnection::handle_write;
+    start_write();
+}
+
+// head_[0, shared_head) is what every request for the key gets,
+// the body is moved into the cache rather than copied
+void HttpConnection::fill_cache(size_t shared_head)
+{
+    cache_fill_ = false;
+    CachedResponsePtr cached;
+    if (resp_.cache_ttl_ > 0 && http_ret_ == HTTP_200 && !file_ && !streaming_
+            && !resp_.headers_.has(HDR_DATE) && !resp_.headers_.has(HDR_CONNECTION)
+            && !resp_.headers_.has("Set-Cookie")) {
+        std::shared_ptr<CachedResponse> c = std::make_shared<CachedResponse>();
+        c->code = http_ret_;
+        c->head.assign(head_, 0, shared_head);
+        c->body.swap(resp_.body_);
+        c->expires = now_ns() + (uint64_t)resp_.cache_ttl_ * 1000000;
+        cached_ = cached = c;
+    }
+    http_server_->response_cache_.fill(cache_key_, cached);
+}
+
+bool HttpConnection::find_route()
+{
+    bool path_found;
+    unsigned allow;
+    route_ = http_server_->router_.match(req_.type_, req_.url_path_,
+            req_.params_, path_found, allow);
+    if (route_ == NULL && path_found) {
+        std::string methods;
+        for(int i = 0; i < HTTP_INVALID; i++) {
+            if (allow & (1u << i))
+                methods.append(methods.empty() ? "" : ", ").append(METHOD_STR[i]);
         }
-        return p;
+        http_ret_ = HTTP_405;
+        resp_.set_header("Allow", methods);
+        begin_response();
+        return true;
+    }
+    // only routes asking for it, others are never held waiting
+    if (route_ && route_->cacheable && serve_cached())
+        return true;
+    if (route_ == NULL || route_->policy == RUN_INLINE)
+        return false;
+
+    req_.threaded_ = true;
+    if (!http_server_->push_to_threadpool(shared_from_this(),
+                route_->policy == RUN_IN_POOL_HIGH
+                ? ThreadPool::PRIORITY_HIGH : ThreadPool::PRIORITY_NORMAL))
+        reject_overloaded();
+    return true;
+}
+
+void HttpConnection::run_in_pool()
+{
+    HttpConnPtr self;
+    self.swap(pooled_self_);
+    in_pool_ = true;
+    http_server_->metrics_.local().record_pool_wait(now_ns() - queued_at_);
+    if (state_ == kWriteBody)
+        write_chunk();
+    else
+        process_request();
+}
+
+// dropped from pool queue, answered in own thread instead
+void HttpConnection::shed()
+{
+    HttpConnPtr self;
+    self.swap(pooled_self_);
+    StatSlot &stat = http_server_->metrics_.local();
+    stat.add(stat.pool_shed);
+    reactor_->io_.post(boost::bind(&HttpConnection::reject_overloaded, self));
+}
+
+void HttpConnection::reject_overloaded()
+{
+    http_ret_ = HTTP_503;
+    resp_.set_body("");
+    resp_.set_header("Retry-After", (long)http_server_->retry_after_);
+    begin_response();
+}
+
+int HttpConnection::setup_request()
+{
+    const char *base = buffer_.data() + rpos_;
+    auto slice = [base](const RequestParser::Slice &sl) {
+        return StrRef(base + sl.off, sl.len);
     };
-    while(*h && !PREFIX_EQ(h, "\r\n")) {
-        h = split_kv(h);
+
+    req_.method_ = slice(parser_.method());
+    req_.type_ = request_type(req_.method_);
+    if (req_.type_ == HTTP_INVALID) {
+        // not GET/POST/PUT/HEAD..
+        StatSlot &stat = http_server_->metrics_.local();
+        stat.add(stat.requests[HTTP_INVALID]);
+        return -1;
+    }
+    StatSlot &stat = http_server_->metrics_.local();
+    stat.add(stat.requests[req_.type_]);
+
+    req_.version_ = parser_.version();
+    req_.set_uri(slice(parser_.uri()));
+
+    // the map keeps the first of repeated headers, so those telling
+    // where the body ends are checked on every line (RFC 7230 3.3.3)
+    const std::vector<RequestParser::Header> &hdrs = parser_.headers();
+    req_.header_map_.reserve(hdrs.size());
+    StrRef len;
+    bool has_len = false;
+    int te_count = 0;
+    bool bad_framing = false;
+    for(auto it = hdrs.begin(); it != hdrs.end(); it++) {
+        StrRef name = slice(it->name);
+        StrRef value = slice(it->value);
+        req_.header_map_.add(name, value);
+        if (name.equals_nocase("Content-Length")) {
+            if (has_len && (value.size() != len.size()
+                        || ::memcmp(value.data(), len.data(), len.size()) != 0))
+                bad_framing = true;
+            len = value;
+            has_len = true;
+        } else if (name.equals_nocase("Transfer-Encoding")) {
+            te_count++;
+        }
+    }
+    if (bad_framing || te_count > 1) {
+        http_ret_ = HTTP_400;
+        return 2;
+    }
+
+    // HTTP/1.1 keeps connection by default, HTTP/1.0 closes by default
+    keep_alive_ = req_.version_ >= 1;
+    StrRef conn = req_.header(HDR_CONNECTION);
+    // a list of tokens, e.g. "close, TE"
+    if (header_token(conn, "close"))
+        keep_alive_ = false;
+    else if (header_token(conn, "keep-alive"))
+        keep_alive_ = true;
+
+    // any request may have a body, told by Transfer-Encoding or Content-Length
+    StrRef te = req_.header(HDR_TRANSFER_ENCODING);
+    if (te_count > 0) {
+        if (!te.equals_nocase("chunked")) {
+            http_ret_ = HTTP_501;
+            return 2;
+        }
+        // both of them is a sign of request smuggling
+        if (has_len) {
+            http_ret_ = HTTP_400;
+            return 2;
+        }
+        body_mode_ = kBodyChunked;
+    } else if (has_len) {
+        if (len.empty()) {
+            http_ret_ = HTTP_400;
+            return 2;
+        }
+        postsize_ = 0;
+        for(const char *p = len.begin(); p != len.end(); p++) {
+            if (!isdigit((unsigned char)*p) || postsize_ > (UINT64_MAX - 9) / 10) {
+                http_ret_ = HTTP_400;
+                return 2;
+            }
+            postsize_ = postsize_ * 10 + (*p - '0');
+        }
+        if (postsize_ > 0)
+            body_mode_ = kBodyLength;
+    }
+    if (body_mode_ != kBodyNone)
+        state_ = kReadingPost;
+    return 0;
+}
+
+int HttpConnection::begin_body()
+{
+    uint64_t max = http_server_->max_body_size_;
+    if (body_mode_ == kBodyLength && max > 0 && postsize_ > max) {
+        http_ret_ = HTTP_413;
+        return 2;
+    }
+    if (http_server_->body_handler_) {
+        int code = http_server_->body_handler_(sink_, req_);
+        if (code != HTTP_200) {
+            http_ret_ = code;
+            return 2;
+        }
+        req_.body_streamed_ = (bool)sink_;
     }
-#undef PREFIX_EQ
-    auto it = req_.headers_.find("Content-Length");
-    if (it != req_.headers_.end()) {
-        postsize_ = ::atol(it->second.c_str());
+    // without a limit memory grows with the body itself, but a length
+    // postdata_ can never hold is refused at once
+    if (body_mode_ == kBodyLength && !sink_ && postsize_ > req_.postdata_.max_size()) {
+        http_ret_ = HTTP_413;
+        return 2;
     }
+    body_remain_ = postsize_;
+    body_decoder_.reset();
+
+    if (req_.version_ >= 1 && next_ == wpos_ 
+            && req_.header(HDR_EXPECT).equals_nocase("100-continue"))
+        send_continue_ = true;
+    return 0;
+}
+
+int HttpConnection::deliver_body(const char *data, size_t len)
+{
+    if (sink_)
+        return sink_(data, len) ? 0 : -1;
+
+    uint64_t max = http_server_->max_body_size_;
+    if (max > 0 && req_.postdata_.size() + len > max) {
+        http_ret_ = HTTP_413;
+        return 2;
+    }
+    req_.postdata_.append(data, len);
+    return 0;
+}
+
+int HttpConnection::read_body()
+{
+    int ret;
+    if (body_mode_ == kBodyLength) {
+        size_t got = std::min<uint64_t>(wpos_ - next_, body_remain_);
+        if (got > 0 && (ret = deliver_body(buffer_.data() + next_, got)) != 0)
+            return ret;
+        next_ += got;
+        body_remain_ -= got;
+        if (body_remain_ == 0)
+            return (sink_ && !sink_(NULL, 0)) ? -1 : 0;
+    } else {
+        for(;;) {
+            const char *data;
+            size_t len;
+            int r = body_decoder_.next(buffer_.data(), wpos_, next_, data, len);
+            if (r == ChunkedDecoder::kData) {
+                if ((ret = deliver_body(data, len)) != 0)
+                    return ret;
+            } else if (r == ChunkedDecoder::kDone) {
+                return (sink_ && !sink_(NULL, 0)) ? -1 : 0;
+            } else if (r == ChunkedDecoder::kError) {
+                http_ret_ = HTTP_400;
+                return 2;
+            } else {
+                break;
+            }
+        }
+    }
+
+    // body bytes are all consumed, reuse the space after header
+    if (next_ == wpos_)
+        next_ = wpos_ = body_start_;
+    return 1;
+}
+
+int HttpConnection::try_parse_request()
+{
+    if (state_ == kReadingHeader) {
+        int ret = parser_.parse(buffer_.data() + rpos_, wpos_ - rpos_);
+        if (ret == RequestParser::kNeedMore) {
+            if (wpos_ == buffer_.size()) {
+                if (rpos_ == 0)
+                    // header size less than 8K count as valid
+                    return -1;
+                // offsets in parser are relative to rpos_, move is safe
+                ::memmove(buffer_.data(), buffer_.data() + rpos_, wpos_ - rpos_);
+                wpos_ -= rpos_;
+                rpos_ = 0;
+            }
+            return 1;
+        } else if (ret != RequestParser::kDone) {
+            // malformed, answered and closed
+            http_ret_ = HTTP_400;
+            return 2;
+        }
+
+        next_ = body_start_ = rpos_ + parser_.header_size();
+        if ((ret = setup_request()) != 0)
+            return ret;
+        if (state_ == kReadingPost && (ret = begin_body()) != 0)
+            return ret;
+    } 
+    if (state_ == kReadingPost)
+        return read_body();
     return 0;
 }
 
-int HttpConnection::try_parse_request(std::size_t bytes_transferred)
+#ifdef HTTP_COMPRESSION
+// encoding compress_body() uses for the body, COMPRESS_NONE to send
+// it as it is
+CompressionFormat HttpConnection::body_compression()
+{
+    if (resp_.compression_ == 0 || resp_.body_.empty())
+        return COMPRESS_NONE;
+    StrRef accept = req_.header(HDR_ACCEPT_ENCODING);
+    if (accept.empty())
+        return COMPRESS_NONE;
+    // the response differs by Accept-Encoding from now on
+    resp_.set_header("Vary", "Accept-Encoding");
+    if (resp_.body_.size() < http_server_->compression_min_size_ 
+            || resp_.headers_.has(HDR_CONTENT_ENCODING))
+        return COMPRESS_NONE;
+    StrRef ct = resp_.headers_.get(HDR_CONTENT_TYPE);
+    if (!ct.empty() && !compressible_type(ct.data(), ct.size()))
+        return COMPRESS_NONE;
+    return choose_compression(accept.data(), accept.size());
+}
+
+void HttpConnection::compress_body()
+{
+    CompressionFormat format = body_compression();
+    if (format == COMPRESS_NONE)
+        return;
+    if (compress_to(resp_.body_.data(), resp_.body_.size(), 
+                resp_.compression_, format, zbuf_)
+            && zbuf_.size() < resp_.body_.size()) {
+        StatSlot &stat = http_server_->metrics_.local();
+        stat.add(stat.compress_in, resp_.body_.size());
+        stat.add(stat.compress_out, zbuf_.size());
+        resp_.body_.swap(zbuf_);
+        resp_.headers_.erase(HDR_CONTENT_LENGTH);
+        resp_.set_header("Content-Encoding", 
+                format == COMPRESS_GZIP ? "gzip" : "deflate");
+        mark_encoded_etag(format);
+    }
+}
+
+// compressed body is another representation, so it needs another
+// strong ETag: "tag" becomes "tag-gzip", see etag_core()
+void HttpConnection::mark_encoded_etag(CompressionFormat format)
+{
+    StrRef tag = resp_.headers_.get(HDR_ETAG);
+    if (tag.size() < 2 || tag.data()[tag.size() - 1] != '"')
+        return;
+    std::string encoded(tag.data(), tag.size() - 1);
+    encoded.append(format == COMPRESS_GZIP ? "-gzip\"" : "-deflate\"");
+    resp_.set_header("ETag", encoded);
+}
+
+void HttpConnection::begin_stream_compression()
+{
+    stream_compress_ = false;
+    StrRef accept = req_.header(HDR_ACCEPT_ENCODING);
+    if (resp_.compression_ == 0 || accept.empty() || req_.type_ == HTTP_HEAD)
+        return;
+    resp_.set_header("Vary", "Accept-Encoding");
+    if (resp_.headers_.has(HDR_CONTENT_ENCODING))
+        return;
+    StrRef ct = resp_.headers_.get(HDR_CONTENT_TYPE);
+    if (!ct.empty() && !compressible_type(ct.data(), ct.size()))
+        return;
+
+    CompressionFormat format = choose_compression(accept.data(), accept.size());
+    if (format == COMPRESS_NONE)
+        return;
+    if (!zstream_)
+        zstream_.reset(new StreamCompressor());
+    if (zstream_->begin(resp_.compression_, format)) {
+        stream_compress_ = true;
+        resp_.set_header("Content-Encoding", 
+                format == COMPRESS_GZIP ? "gzip" : "deflate");
+        mark_encoded_etag(format);
+    }
+}
+#endif
+
+// validators, conditional request and Range of a 200 response to GET or HEAD
+void HttpConnection::check_conditions()
+{
+    if (file_) {
+        if (!resp_.headers_.has(HDR_ETAG)) {
+            char tag[48];
+            int n = snprintf(tag, sizeof(tag), "\"%llx-%llx\"", 
+                    (unsigned long long)file_->mtime, (unsigned long long)file_->size);
+            resp_.set_header("ETag", 4, tag, n);
+        }
+        if (!resp_.headers_.has(HDR_LAST_MODIFIED))
+            resp_.set_last_modified(file_->mtime);
+        resp_.set_header("Accept-Ranges", "bytes");
+    } else if (!streaming_ && http_server_->auto_etag_ 
+            && !resp_.headers_.has(HDR_ETAG)) {
+        char tag[48];
+        int n = snprintf(tag, sizeof(tag), "\"%zx-%zx\"", resp_.body_.size(),
+                std::hash<std::string>()(resp_.body_));
+        resp_.set_header("ETag", 4, tag, n);
+    }
+
+    if (not_modified()) {
+        http_ret_ = HTTP_304;
+#ifdef HTTP_COMPRESSION
+        // same ETag and Vary as the 200 would have
+        CompressionFormat format = body_compression();
+        if (format != COMPRESS_NONE)
+            mark_encoded_etag(format);
+#endif
+        resp_.body_.clear();
+        resp_.stream_ = nullptr;
+        resp_.headers_.erase(HDR_CONTENT_TYPE);
+        resp_.headers_.erase(HDR_CONTENT_LENGTH);
+        file_.reset();
+        streaming_ = false;
+        return;
+    }
+    uint64_t length = file_ ? file_->size 
+        : streaming_ ? resp_.stream_length_ : resp_.body_.size();
+    if (req_.type_ == HTTP_GET && req_.header_map_.has(HDR_RANGE)
+            && length != Response::kUnknownLength && if_range_matches())
+        apply_range(length);
+}
+
+// If-None-Match wins over If-Modified-Since, as RFC 7232 says
+bool HttpConnection::not_modified()
+{
+    StrRef match = req_.header(HDR_IF_NONE_MATCH);
+    if (!match.empty())
+        return etag_listed(match, resp_.headers_.get(HDR_ETAG));
+    StrRef since = req_.header("If-Modified-Since");
+    StrRef modified = resp_.headers_.get(HDR_LAST_MODIFIED);
+    if (since.empty() || modified.empty())
+        return false;
+    time_t since_t = parse_http_date(since);
+    time_t modified_t = parse_http_date(modified);
+    return since_t >= 0 && modified_t >= 0 && modified_t <= since_t;
+}
+
+// a Range is served only if the body is still what If-Range tells,
+// by strong comparison of ETag or the exact Last-Modified
+bool HttpConnection::if_range_matches()
+{
+    StrRef cond = req_.header(HDR_IF_RANGE);
+    if (cond.empty())
+        return true;
+    if (cond.starts_with("\"")) {
+        StrRef tag = resp_.headers_.get(HDR_ETAG);
+        return tag.size() == cond.size() 
+            && ::memcmp(tag.data(), cond.data(), cond.size()) == 0;
+    }
+    if (cond.starts_with("W/"))
+        return false;
+    time_t modified = parse_http_date(resp_.headers_.get(HDR_LAST_MODIFIED));
+    return modified >= 0 && modified == parse_http_date(cond);
+}
+
+// one "bytes=" range gets 206 with that part. several ranges are
+// answered with the whole body, which RFC 7233 allows
+void HttpConnection::apply_range(uint64_t length)
+{
+    StrRef range = req_.header(HDR_RANGE);
+    if (!range.starts_with("bytes=") 
+            || ::memchr(range.data(), ',', range.size()) != NULL)
+        return;
+    const char *p = range.data() + 6;
+    const char *end = range.end();
+    uint64_t first, last, n;
+    if (p < end && *p == '-') {
+        // last n bytes
+        p++;
+        if (!parse_uint(p, end, n) || p != end)
+            return;
+        first = n >= length ? 0 : length - n;
+        last = length - 1;
+        if (n == 0)
+            first = length;
+    } else {
+        if (!parse_uint(p, end, first) || p == end || *p++ != '-')
+            return;
+        last = length - 1;
+        if (p != end) {
+            if (!parse_uint(p, end, last) || p != end || last < first)
+                return;
+            if (last >= length)
+                last = length - 1;
+        }
+    }
+
+    char value[64];
+    if (first >= length) {
+        http_ret_ = HTTP_416;
+        int len = snprintf(value, sizeof(value), "bytes */%llu", 
+                (unsigned long long)length);
+        resp_.set_header("Content-Range", 13, value, len);
+        resp_.body_.clear();
+        resp_.stream_ = nullptr;
+        resp_.headers_.erase(HDR_CONTENT_TYPE);
+        // handler's length was of the whole body
+        resp_.headers_.erase(HDR_CONTENT_LENGTH);
+        file_.reset();
+        streaming_ = false;
+        return;
+    }
+    http_ret_ = HTTP_206;
+    int len = snprintf(value, sizeof(value), "bytes %llu-%llu/%llu",
+            (unsigned long long)first, (unsigned long long)last,
+            (unsigned long long)length);
+    resp_.set_header("Content-Range", 13, value, len);
+    n = last - first + 1;
+#ifdef HTTP_COMPRESSION
+    // offsets are of the body as it is, not of a compressed one
+    resp_.compression_ = 0;
+#endif
+    if (file_) {
+        file_offset_ = first;
+        file_remain_ = n;
+    } else if (streaming_) {
+        stream_skip_ = first;
+        stream_remain_ = n;
+    } else {
+        resp_.body_.erase(first + n);
+        resp_.body_.erase(0, first);
+        resp_.headers_.erase(HDR_CONTENT_LENGTH);
+    }
+}
+
+void HttpConnection::begin_response()
+{
+    if (http_ret_ < 0 || http_ret_ >= HTTP_END) {
+        http_ret_ = HTTP_503;
+    }
+    if (!resp_.file_.empty() && http_ret_ == HTTP_200) {
+        file_ = http_server_->file_cache_.open(resp_.file_);
+        if (file_) {
+            resp_.body_.clear();
+            file_offset_ = 0;
+            file_remain_ = file_->size;
+        } else {
+            http_ret_ = HTTP_404;
+            resp_.headers_.erase(HDR_CONTENT_TYPE);
+        }
+    }
+    streaming_ = (bool)resp_.stream_;
+    stream_skip_ = 0;
+    stream_remain_ = Response::kUnknownLength;
+    // may turn it into 304, 206 or 416
+    if (http_ret_ == HTTP_200 && (req_.type_ == HTTP_GET || req_.type_ == HTTP_HEAD))
+        check_conditions();
+    if (file_)
+        resp_.set_header("Content-Length", file_remain_);
+    if (streaming_) {
+        resp_.body_.clear();
+        resp_.headers_.erase(HDR_CONTENT_LENGTH);
+        // HTTP/1.0 has no chunked encoding, body ends with connection.
+        // HTTP/2 has DATA frames instead
+        chunked_ = req_.version_ >= 1 && !h2_conn_;
+        if (!chunked_)
+            keep_alive_ = false;
+    }
+    if (http_ret_ != HTTP_200 && http_ret_ != HTTP_206 && http_ret_ != HTTP_304
+            && resp_.body_.empty() && !streaming_) {
+        resp_.set_body("<html><body><h1>" + STATUS_CODE_STR[http_ret_] + "</h1></body></html>");
+        resp_.set_header("Content-Type", "text/html");
+    }
+    served_++;
+    if (served_ >= http_server_->max_keepalive_requests_
+            || http_server_->stopping_)
+        keep_alive_ = false;
+    StrRef conn = resp_.headers_.get(HDR_CONNECTION);
+    if (header_token(conn, "close"))
+        keep_alive_ = false;
+#ifdef HTTP_COMPRESSION
+    if (streaming_)
+        begin_stream_compression();
+    else
+        compress_body();
+#endif
+
+    // status line and headers go out in one piece, body in another
+    const std::string &status = STATUS_CODE_STR[http_ret_];
+    size_t shared_head = write_response_head(head_, StrRef(status.data(), status.size()),
+            resp_.headers_, streaming_ && chunked_,
+            streaming_ || http_ret_ == HTTP_304 ? -1 : (int64_t)resp_.body_.size(),
+            keep_alive_);
+    if (cache_fill_)
+        fill_cache(shared_head);
+
+    out_.fill(boost::asio::const_buffer());
+    out_[0] = boost::asio::buffer(head_);
+    if (req_.type_ == HTTP_HEAD) {
+        file_.reset();
+        streaming_ = false;
+    } else { 
+        // body was moved into the cache if it was kept
+        out_[1] = boost::asio::buffer(cached_ ? cached_->body : resp_.body_);
+    }
+    StatSlot &stat = http_server_->metrics_.local();
+    stat.add(stat.responses[http_ret_]);
+    stat.add(stat.bytes_out, boost::asio::buffer_size(out_));
+    after_write_ = &HttpConnection::handle_write;
+    if (file_)
+        after_write_ = &HttpConnection::handle_write_file;
+    else if (streaming_)
+        after_write_ = &HttpConnection::handle_write_stream;
+    start_write();
+}
+
+// response is made in the thread which ran the handler, but the socket
+// is only used by the I/O thread of the connection
+void HttpConnection::start_write()
+{
+    if (in_pool_) {
+        pooled_self_ = shared_from_this();
+        reactor_->complete(this);
+        return;
+    }
+    if (h2_conn_) {
+        h2_conn_->h2_->submit(this);
+        return;
+    }
+    arm_timer(kTimerWrite);
+#ifdef HTTP_IO_URING
+    ::memset(&write_msg_, 0, sizeof(write_msg_));
+    write_msg_.msg_iov = write_iov_;
+    for(size_t i = 0; i < out_.size(); i++) {
+        if (out_[i].size() == 0)
+            continue;
+        iovec &v = write_iov_[write_msg_.msg_iovlen++];
+        v.iov_base = const_cast<void *>(out_[i].data());
+        v.iov_len = out_[i].size();
+    }
+    queue_ring_write();
+#else
+    boost::asio::async_write(socket_, out_,
+        [this](const boost::system::error_code& e, std::size_t) -> std::size_t {
+            if (e)
+                return 0;
+            arm_timer(kTimerWrite);
+            return WRITE_SLICE;
+        },
+        make_alloc_handler(handler_memory_,
+            boost::bind(after_write_, shared_from_this(),
+            boost::asio::placeholders::error)));
+#endif
+}
+
+void HttpConnection::handle_write(const boost::system::error_code& e) 
+{
+    if (!e && keep_alive_) {
+        next_request();
+    } else {
+        close();
+    }
+}
+
+void HttpConnection::handle_write_stream(const boost::system::error_code& e)
+{
+    if (e) {
+        close();
+        return;
+    }
+    // producer runs where the handler did
+    state_ = kWriteBody;
+    // already admitted, goes ahead of new requests. a producer of a
+    // pool route may block, so it never runs here, even if pool is full
+    if (req_.threaded_) {
+        if (!http_server_->push_to_threadpool(shared_from_this(),
+                    ThreadPool::PRIORITY_HIGH))
+            close();
+        return;
+    }
+    write_chunk();
+}
+
+void HttpConnection::write_chunk()
+{
+    chunk_.clear();
+    BodyStream body(chunk_);
+    bool more = resp_.stream_(body);
+    if (stream_skip_ > 0) {
+        size_t n = std::min<uint64_t>(stream_skip_, chunk_.size());
+        chunk_.erase(0, n);
+        stream_skip_ -= n;
+    }
+    if (chunk_.size() >= stream_remain_) {
+        chunk_.resize(stream_remain_);
+        more = false;
+    }
+    stream_remain_ -= chunk_.size();
+
+    const std::string *data = &chunk_;
+#ifdef HTTP_COMPRESSION
+    if (stream_compress_) {
+        if (!zstream_->compress(chunk_.data(), chunk_.size(), !more, zbuf_)) {
+            if (in_pool_)
+                reactor_->io_.post(boost::bind(&HttpConnection::close,
+                            shared_from_this()));
+            else
+                close();
+            return;
+        }
+        StatSlot &stat = http_server_->metrics_.local();
+        stat.add(stat.compress_in, chunk_.size());
+        stat.add(stat.compress_out, zbuf_.size());
+        data = &zbuf_;
+    }
+#endif
+
+    out_.fill(boost::asio::const_buffer());
+    if (!data->empty()) {
+        if (chunked_) {
+            int n = snprintf(chunk_size_, sizeof(chunk_size_), "%zx\r\n", data->size());
+            out_[0] = boost::asio::buffer(chunk_size_, n);
+            out_[2] = boost::asio::buffer(CRLF);
+        }
+        out_[1] = boost::asio::buffer(*data);
+    }
+    if (!more && chunked_)
+        out_[3] = boost::asio::buffer(LAST_CHUNK);
+    StatSlot &stat = http_server_->metrics_.local();
+    stat.add(stat.bytes_out, boost::asio::buffer_size(out_));
+    after_write_ = more ? &HttpConnection::handle_write_stream
+        : &HttpConnection::handle_write;
+    start_write();
+}
+
+void HttpConnection::handle_write_file(const boost::system::error_code& e)
+{
+    if (e) {
+        file_.reset();
+        close();
+        return;
+    }
+    if (h2_conn_) {
+        // a stream has no socket to sendfile() to, file is read into
+        // DATA frames a slice at a time
+        size_t n = std::min(file_remain_, H2_FILE_SLICE);
+        chunk_.resize(n);
+        ssize_t got;
+        while ((got = ::pread(file_->fd, &chunk_[0], n, file_offset_)) < 0 
+                && errno == EINTR)
+            ;
+        if (got < 0 || (n > 0 && got == 0)) {
+            file_.reset();
+            close();
+            return;
+        }
+        chunk_.resize(got);
+        file_offset_ += got;
+        file_remain_ -= got;
+        StatSlot &stat = http_server_->metrics_.local();
+        stat.add(stat.bytes_out, got);
+        out_.fill(boost::asio::const_buffer());
+        out_[0] = boost::asio::buffer(chunk_);
+        after_write_ = &HttpConnection::handle_write_file;
+        if (file_remain_ == 0) {
+            file_.reset();
+            after_write_ = &HttpConnection::handle_write;
+        }
+        start_write();
+        return;
+    }
+
+    // file content goes from page cache to socket directly
+    socket_.native_non_blocking(true);
+    size_t sent = 0;
+    while (file_remain_ > 0 && sent < SENDFILE_SLICE) {
+        ssize_t n = ::sendfile(socket_.native_handle(), file_->fd, 
+                &file_offset_, std::min(file_remain_, SENDFILE_SLICE - sent));
+        if (n > 0) {
+            file_remain_ -= n;
+            sent += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            break;
+        } else {
+            // error, or file is truncated
+            file_.reset();
+            close();
+            return;
+        }
+    }
+    StatSlot &stat = http_server_->metrics_.local();
+    stat.add(stat.bytes_out, sent);
+
+    if (file_remain_ == 0) {
+        file_.reset();
+        handle_write(e);
+    } else {
+        arm_timer(kTimerWrite);
+        socket_.async_wait(boost::asio::socket_base::wait_write,
+            make_alloc_handler(handler_memory_,
+                boost::bind(&HttpConnection::handle_write_file, shared_from_this(),
+                boost::asio::placeholders::error)));
+    }
+}
+
+// prior knowledge, client sent the preface instead of a request
+void HttpConnection::start_h2()
+{
+    h2_.reset(new Http2Session(this));
+    h2_->start(NULL);
+    continue_h2();
+}
+
+// h2c upgrade of RFC 7540 3.2, the request is answered as stream 1
+// after 101. one with a body stays HTTP/1
+bool HttpConnection::upgrade_h2c()
+{
+    // Connection must name both, so proxies don't pass them on
+    StrRef conn = req_.header(HDR_CONNECTION);
+    if (!header_token(req_.header("Upgrade"), "h2c") || !req_.has_header("HTTP2-Settings")
+            || !header_token(conn, "upgrade") || !header_token(conn, "http2-settings")
+            || body_mode_ != kBodyNone || req_.version_ < 1)
+        return false;
+    std::string settings;
+    if (!decode_base64url(req_.header("HTTP2-Settings"), settings))
+        return false;
+    h2_.reset(new Http2Session(this));
+    if (!h2_->start(&settings)) {
+        h2_.reset();
+        return false;
+    }
+    HttpConnPtr stream = h2_->upgrade_stream();
+    stream->copy_request(req_);
+
+    // what follows the request is the client preface and frames
+    req_.clear();
+    resp_.clear();
+    arena_.reset();
+    parser_.reset();
+    ::memmove(buffer_.data(), buffer_.data() + next_, wpos_ - next_);
+    wpos_ -= next_;
+    rpos_ = next_ = 0;
+    state_ = kProcessing;
+    stream->start_h2_stream(true);
+    continue_h2();
+    return true;
+}
+
+void HttpConnection::continue_h2()
+{
+    size_t used = h2_->receive(buffer_.data() + rpos_, wpos_ - rpos_, buffer_.size());
+    // a partial frame goes to front, the next read completes it
+    rpos_ += used;
+    if (rpos_ > 0) {
+        ::memmove(buffer_.data(), buffer_.data() + rpos_, wpos_ - rpos_);
+        wpos_ -= rpos_;
+        rpos_ = 0;
+    }
+    h2_->flush();
+    if (!h2_->closing())
+        start_read();
+}
+
+void HttpConnection::handle_write_h2(const boost::system::error_code& e)
+{
+    if (e) {
+        close();
+        return;
+    }
+    h2_->write_done();
+}
+
+// a header of a stream's request as HPACK decoded it, false if the
+// request is malformed
+bool HttpConnection::add_h2_header(StrRef name, StrRef value)
+{
+    for(const char *p = name.begin(); p != name.end(); p++) {
+        if (*p >= 'A' && *p <= 'Z')
+            return false;
+    }
+    // decoded strings only last for the call
+    StrRef v(arena_.copy(value.data(), value.size()), value.size());
+    if (name.starts_with(":")) {
+        if (name.equals(":method"))
+            req_.method_ = v;
+        else if (name.equals(":path"))
+            req_.set_uri(v);
+        else if (name.equals(":authority"))
+            req_.header_map_.add(known_header_name(HDR_HOST), v);
+        else if (!name.equals(":scheme"))
+            return false;
+        return true;
+    }
+    if (connection_header(name) || (name.equals("te") && !v.equals("trailers")))
+        return false;
+    StrRef n(arena_.copy(name.data(), name.size()), name.size());
+    // cookie may be split in pieces, handlers get them in one header
+    StrRef cookie;
+    if (n.equals("cookie") && !(cookie = req_.header_map_.get("cookie")).empty()) {
+        size_t len = cookie.size() + 2 + v.size();
+        char *joined = (char *)arena_.allocate(len, 1);
+        ::memcpy(joined, cookie.data(), cookie.size());
+        ::memcpy(joined + cookie.size(), "; ", 2);
+        ::memcpy(joined + cookie.size() + 2, v.data(), v.size());
+        req_.header_map_.set(n, StrRef(joined, len));
+        return true;
+    }
+    req_.header_map_.add(n, v);
+    return true;
+}
+
+// request of an h2c upgrade, into the arena of the stream
+void HttpConnection::copy_request(const Request &from)
+{
+    auto copy = [this](StrRef s) {
+        return StrRef(arena_.copy(s.data(), s.size()), s.size());
+    };
+    req_.method_ = copy(from.method_);
+    req_.set_uri(copy(from.uri_));
+    req_.header_map_.reserve(from.header_map_.size());
+    for(auto it = from.header_map_.begin(); it != from.header_map_.end(); it++) {
+        if (!connection_header(it->first))
+            req_.header_map_.add(copy(it->first), copy(it->second));
+    }
+}
+
+// headers of the stream are all added, the request goes on as an
+// HTTP/1.1 one would. its body comes by h2_data() till END_STREAM
+void HttpConnection::start_h2_stream(bool end_stream)
+{
+    state_ = kProcessing;
+    req_.version_ = 1;
+    req_.type_ = request_type(req_.method_);
+    StatSlot &stat = http_server_->metrics_.local();
+    stat.add(stat.requests[req_.type_]);
+    if (req_.method_.empty() || req_.uri_.empty()) {
+        http_ret_ = HTTP_400;
+        begin_response();
+        return;
+    }
+    if (req_.type_ == HTTP_INVALID) {
+        http_ret_ = HTTP_501;
+        begin_response();
+        return;
+    }
+    if (end_stream) {
+        process_request();
+        return;
+    }
+
+    // Content-Length is optional, END_STREAM tells where body ends
+    body_mode_ = kBodyChunked;
+    StrRef len = req_.header(HDR_CONTENT_LENGTH);
+    if (!len.empty()) {
+        const char *p = len.begin();
+        if (!parse_uint(p, len.end(), postsize_) || p != len.end()) {
+            http_ret_ = HTTP_400;
+            begin_response();
+            return;
+        }
+        body_mode_ = kBodyLength;
+    }
+    state_ = kReadingPost;
+    int ret = begin_body();
+    // no 100 Continue, the client sends the body anyway
+    send_continue_ = false;
+    if (ret != 0) {
+        state_ = kProcessing;
+        begin_response();
+    }
+}
+
+// false to reset the stream
+bool HttpConnection::h2_data(const char *data, size_t len, bool end_stream)
+{
+    // rest of a body already answered, by 413 or so
+    if (state_ != kReadingPost)
+        return true;
+    int ret = 0;
+    if (body_mode_ == kBodyLength && len > body_remain_) {
+        http_ret_ = HTTP_400;
+        ret = 2;
+    } else if (len > 0) {
+        ret = deliver_body(data, len);
+        body_remain_ -= body_mode_ == kBodyLength ? len : 0;
+    }
+    if (ret < 0)
+        return false;
+    if (ret == 0 && !end_stream)
+        return true;
+    if (ret == 0 && body_mode_ == kBodyLength && body_remain_ > 0) {
+        http_ret_ = HTTP_400;
+        ret = 2;
+    }
+    state_ = kProcessing;
+    if (ret == 2) {
+        begin_response();
+    } else {
+        if (sink_ && !sink_(NULL, 0))
+            return false;
+        process_request();
+    }
+    return true;
+}
+
+// opening handshake of RFC 6455 4.2 on a websocket route. once 101 is
+// queued the connection belongs to the route's WebSocketHandler
+void HttpConnection::accept_websocket()
+{
+    StrRef key = req_.header("Sec-WebSocket-Key");
+    if (h2_conn_ || req_.type_ != HTTP_GET || req_.version_ < 1
+            || body_mode_ != kBodyNone || key.size() != 24
+            || !header_token(req_.header("Upgrade"), "websocket")
+            || !header_token(req_.header(HDR_CONNECTION), "upgrade")) {
+        http_ret_ = HTTP_400;
+        begin_response();
+        return;
+    }
+    if (!req_.header("Sec-WebSocket-Version").equals("13")) {
+        resp_.set_header("Sec-WebSocket-Version", "13");
+        http_ret_ = HTTP_400;
+        begin_response();
+        return;
+    }
+
+    std::shared_ptr<WebSocketState> state = std::make_shared<WebSocketState>();
+    state->conn = shared_from_this();
+    state->reactor = reactor_;
+    std::shared_ptr<const WebSocketHandler> handler = route_->websocket;
+    ws_.reset(new WsSession(this, handler, state));
+    if (handler->on_open) {
+        int code = handler->on_open(ws_->socket(), req_);
+        if (code != HTTP_200) {
+            ws_.reset();
+            http_ret_ = code;
+            begin_response();
+            return;
+        }
+    }
+    HeaderWriter w(head_);
+    w.line("HTTP/1.1 101 Switching Protocols\r\n");
+    w.line("Upgrade: websocket\r\nConnection: Upgrade\r\n");
+    w.line("Sec-WebSocket-Accept: " + websocket_accept(key) + "\r\n");
+    w.end();
+
+    // frames may follow the request already
+    req_.clear();
+    resp_.clear();
+    arena_.reset();
+    parser_.reset();
+    ::memmove(buffer_.data(), buffer_.data() + next_, wpos_ - next_);
+    wpos_ -= next_;
+    rpos_ = next_ = 0;
+    state_ = kProcessing;
+    ws_->start(head_);
+    continue_ws();
+}
+
+void HttpConnection::continue_ws()
+{
+    rpos_ += ws_->receive(buffer_.data() + rpos_, wpos_ - rpos_);
+    if (rpos_ > 0) {
+        ::memmove(buffer_.data(), buffer_.data() + rpos_, wpos_ - rpos_);
+        wpos_ -= rpos_;
+        rpos_ = 0;
+    }
+    ws_->flush();
+    if (ws_->reading())
+        start_read();
+}
+
+void HttpConnection::handle_write_ws(const boost::system::error_code& e)
+{
+    if (e) {
+        close();
+        return;
+    }
+    ws_->write_done();
+}
+
+Http2Session::Http2Session(HttpConnection *conn)
+    : conn_(conn),
+      preface_(false),
+      header_stream_(0),
+      header_flags_(0),
+      last_stream_id_(0),
+      streams_served_(0),
+      send_window_(H2_DEFAULT_WINDOW),
+      recv_window_(kConnWindow),
+      initial_send_window_(H2_DEFAULT_WINDOW),
+      max_send_frame_(H2_DEFAULT_FRAME_SIZE),
+      goaway_(false),
+      closing_(false),
+      closed_(false),
+      writing_(false)
+{
+}
+
+bool Http2Session::start(const std::string *upgrade_settings)
+{
+    if (upgrade_settings) {
+        if (apply_settings(upgrade_settings->data(), upgrade_settings->size()) 
+                != H2_NO_ERROR)
+            return false;
+        obuf_.append(SWITCHING_PROTOCOLS);
+    }
+    static const uint32_t SETTINGS[][2] = {
+        {H2_MAX_CONCURRENT_STREAMS, kMaxStreams},
+        {H2_INITIAL_WINDOW_SIZE, kStreamWindow},
+    };
+    append_settings(obuf_, SETTINGS, sizeof(SETTINGS) / sizeof(SETTINGS[0]));
+    // connection window is not set by SETTINGS
+    append_window_update(obuf_, 0, kConnWindow - H2_DEFAULT_WINDOW);
+    return true;
+}
+
+size_t Http2Session::receive(const char *data, size_t len, size_t capacity)
+{
+    const char *p = data;
+    const char *end = data + len;
+    if (!preface_) {
+        size_t n = std::min(len, H2_PREFACE_LEN);
+        if (::memcmp(p, H2_PREFACE, n) != 0) {
+            fail(H2_PROTOCOL_ERROR);
+            return len;
+        }
+        if (n < H2_PREFACE_LEN)
+            return 0;
+        preface_ = true;
+        p += H2_PREFACE_LEN;
+    }
+    while (!closing_) {
+        if (!pending_.empty()) {
+            size_t total = H2_FRAME_HEADER_LEN + pending_header_.length;
+            size_t n = std::min<size_t>(end - p, total - pending_.size());
+            pending_.append(p, n);
+            p += n;
+            if (pending_.size() < total)
+                break;
+            on_frame(pending_header_, pending_.data() + H2_FRAME_HEADER_LEN);
+            pending_.clear();
+            continue;
+        }
+        if ((size_t)(end - p) < H2_FRAME_HEADER_LEN)
+            break;
+        Http2FrameHeader h;
+        parse_frame_header(p, h);
+        // larger than our SETTINGS_MAX_FRAME_SIZE
+        if (h.length > H2_DEFAULT_FRAME_SIZE) {
+            fail(H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        size_t total = H2_FRAME_HEADER_LEN + h.length;
+        if ((size_t)(end - p) < total) {
+            if (total > capacity) {
+                pending_header_ = h;
+                pending_.assign(p, end);
+                p = end;
+            }
+            break;
+        }
+        on_frame(h, p + H2_FRAME_HEADER_LEN);
+        p += total;
+    }
+    return closing_ ? len : p - data;
+}
+
+void Http2Session::on_frame(const Http2FrameHeader &h, const char *p)
+{
+    // nothing may come between HEADERS and its CONTINUATION
+    if (header_stream_ != 0
+            && (h.type != H2_CONTINUATION || h.stream_id != header_stream_)) {
+        fail(H2_PROTOCOL_ERROR);
+        return;
+    }
+    size_t len = h.length;
+    switch (h.type) {
+    case H2_DATA:
+        on_data(h, p);
+        break;
+    case H2_HEADERS:
+        if (h.stream_id == 0 || !frame_payload(h, p, len)) {
+            fail(H2_PROTOCOL_ERROR);
+        } else if (h.flags & H2_END_HEADERS) {
+            on_headers(h.stream_id, h.flags & H2_END_STREAM, p, len);
+        } else {
+            header_stream_ = h.stream_id;
+            header_flags_ = h.flags;
+            header_block_.assign(p, len);
+        }
+        break;
+    case H2_CONTINUATION:
+        if (header_stream_ == 0) {
+            fail(H2_PROTOCOL_ERROR);
+        } else if (header_block_.size() + len > kMaxHeaderBlock) {
+            fail(H2_ENHANCE_YOUR_CALM);
+        } else {
+            header_block_.append(p, len);
+            if (h.flags & H2_END_HEADERS) {
+                header_stream_ = 0;
+                on_headers(h.stream_id, header_flags_ & H2_END_STREAM,
+                        header_block_.data(), header_block_.size());
+                header_block_.clear();
+            }
+        }
+        break;
+    case H2_SETTINGS:
+        if (h.stream_id != 0) {
+            fail(H2_PROTOCOL_ERROR);
+        } else if (!(h.flags & H2_ACK)) {
+            Http2Error error = apply_settings(p, len);
+            if (error != H2_NO_ERROR) {
+                fail(error);
+                break;
+            }
+            append_frame_header(obuf_, 0, H2_SETTINGS, H2_ACK, 0);
+            // windows may have grown
+            write_data();
+        }
+        break;
+    case H2_PING:
+        if (h.stream_id != 0 || len != 8) {
+            fail(len != 8 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+        } else if (!(h.flags & H2_ACK)) {
+            append_frame_header(obuf_, 8, H2_PING, H2_ACK, 0);
+            obuf_.append(p, 8);
+        }
+        break;
+    case H2_RST_STREAM:
+        if (h.stream_id == 0 || len != 4)
+            fail(len != 4 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+        else
+            streams_.erase(h.stream_id);
+        break;
+    case H2_GOAWAY:
+        // streams going on are finished, then connection is closed
+        goaway_ = true;
+        break;
+    case H2_WINDOW_UPDATE:
+        if (len != 4)
+            fail(H2_FRAME_SIZE_ERROR);
+        else
+            on_window_update(h.stream_id, read_u32(p) & 0x7fffffff);
+        break;
+    case H2_PUSH_PROMISE:
+        // only servers push
+        fail(H2_PROTOCOL_ERROR);
+        break;
+    default:
+        // PRIORITY is not followed, unknown types are ignored
+        break;
+    }
+}
+
+void Http2Session::on_headers(uint32_t id, bool end_stream, 
+        const char *block, size_t len)
+{
+    std::map<uint32_t, Stream>::iterator it = streams_.find(id);
+    if (it != streams_.end() || id <= last_stream_id_) {
+        // trailers, or of a stream reset or done. decoded only to keep
+        // the dynamic table the same as the client's
+        if (!decoder_.decode(block, len, [](StrRef, StrRef) { return true; })) {
+            fail(H2_COMPRESSION_ERROR);
+            return;
+        }
+        if (it != streams_.end() && end_stream && !it->second.remote_closed) {
+            it->second.remote_closed = true;
+            HttpConnPtr s = it->second.conn;
+            if (!s->h2_data(NULL, 0, true))
+                reset(id, H2_CANCEL);
+        }
+        return;
+    }
+    // clients start odd streams
+    if ((id & 1) == 0) {
+        fail(H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    HttpConnPtr s;
+    if (!goaway_ && streams_.size() < kMaxStreams)
+        s = new_stream(id, end_stream);
+    last_stream_id_ = id;
+    HttpConnection *stream = s.get();
+    bool valid = true;
+    if (!decoder_.decode(block, len, [stream, &valid](StrRef name, StrRef value) {
+                if (stream && valid)
+                    valid = stream->add_h2_header(name, value);
+                return true;
+            })) {
+        fail(H2_COMPRESSION_ERROR);
+        return;
+    }
+    if (!s)
+        reset(id, H2_REFUSED_STREAM);
+    else if (!valid)
+        reset(id, H2_PROTOCOL_ERROR);
+    else
+        s->start_h2_stream(end_stream);
+}
+
+void Http2Session::on_data(const Http2FrameHeader &h, const char *p)
+{
+    if (h.stream_id == 0) {
+        fail(H2_PROTOCOL_ERROR);
+        return;
+    }
+    // padding counts against windows too. body is taken as it comes,
+    // so windows are given back at once
+    if ((int32_t)h.length > recv_window_) {
+        fail(H2_FLOW_CONTROL_ERROR);
+        return;
+    }
+    recv_window_ -= h.length;
+    if (recv_window_ < kConnWindow / 2) {
+        append_window_update(obuf_, 0, kConnWindow - recv_window_);
+        recv_window_ = kConnWindow;
+    }
+    size_t len = h.length;
+    if (!frame_payload(h, p, len)) {
+        fail(H2_PROTOCOL_ERROR);
+        return;
+    }
+    std::map<uint32_t, Stream>::iterator it = streams_.find(h.stream_id);
+    if (it == streams_.end()) {
+        // of a stream reset or done, unless it never started
+        if (h.stream_id > last_stream_id_)
+            fail(H2_PROTOCOL_ERROR);
+        return;
+    }
+    Stream &st = it->second;
+    if (st.remote_closed) {
+        reset(h.stream_id, H2_STREAM_CLOSED);
+        return;
+    }
+    if ((int32_t)h.length > st.recv_window) {
+        reset(h.stream_id, H2_FLOW_CONTROL_ERROR);
+        return;
+    }
+    st.recv_window -= h.length;
+    st.remote_closed = h.flags & H2_END_STREAM;
+    if (!st.remote_closed && st.recv_window < kStreamWindow / 2) {
+        append_window_update(obuf_, h.stream_id, kStreamWindow - st.recv_window);
+        st.recv_window = kStreamWindow;
+    }
+    HttpConnPtr s = st.conn;
+    if (!s->h2_data(p, len, h.flags & H2_END_STREAM))
+        reset(h.stream_id, H2_CANCEL);
+}
+
+Http2Error Http2Session::apply_settings(const char *p, size_t len)
+{
+    if (len % 6 != 0)
+        return H2_FRAME_SIZE_ERROR;
+    for(; len > 0; p += 6, len -= 6) {
+        unsigned id = ((unsigned)(uint8_t)p[0] << 8) | (uint8_t)p[1];
+        uint32_t value = read_u32(p + 2);
+        switch (id) {
+        case H2_HEADER_TABLE_SIZE:
+            encoder_.set_max_table_size(value);
+            break;
+        case H2_ENABLE_PUSH:
+            if (value > 1)
+                return H2_PROTOCOL_ERROR;
+            break;
+        case H2_INITIAL_WINDOW_SIZE:
+            if (value > (uint32_t)H2_MAX_WINDOW)
+                return H2_FLOW_CONTROL_ERROR;
+            // open streams get the difference, their windows may go
+            // below zero
+            for(auto it = streams_.begin(); it != streams_.end(); it++) {
+                Stream &st = it->second;
+                st.send_window += (int64_t)value - initial_send_window_;
+                if (st.pending && !st.queued && st.send_window > 0) {
+                    st.queued = true;
+                    sending_.push_back(it->first);
+                }
+            }
+            initial_send_window_ = value;
+            break;
+        case H2_MAX_FRAME_SIZE:
+            if (value < H2_DEFAULT_FRAME_SIZE || value > 0xffffff)
+                return H2_PROTOCOL_ERROR;
+            max_send_frame_ = std::min<size_t>(value, kMaxFrame);
+            break;
+        default:
+            break;
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+void Http2Session::on_window_update(uint32_t id, uint32_t increment)
+{
+    if (id == 0) {
+        if (increment == 0 || send_window_ + increment > H2_MAX_WINDOW) {
+            fail(increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+            return;
+        }
+        send_window_ += increment;
+    } else {
+        std::map<uint32_t, Stream>::iterator it = streams_.find(id);
+        if (it == streams_.end())
+            return;
+        Stream &st = it->second;
+        if (increment == 0 || st.send_window + increment > H2_MAX_WINDOW) {
+            reset(id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+            return;
+        }
+        st.send_window += increment;
+        if (st.pending && !st.queued) {
+            st.queued = true;
+            sending_.push_back(id);
+        }
+    }
+    write_data();
+}
+
+// connection error, GOAWAY is the last frame sent
+void Http2Session::fail(Http2Error error)
+{
+    if (closing_)
+        return;
+    append_goaway(obuf_, last_stream_id_, error);
+    goaway_ = closing_ = true;
+    streams_.clear();
+    sending_.clear();
+}
+
+void Http2Session::reset(uint32_t id, Http2Error error)
+{
+    if (closing_)
+        return;
+    append_rst_stream(obuf_, id, error);
+    streams_.erase(id);
+}
+
+void Http2Session::cancel(HttpConnection *stream)
+{
+    std::map<uint32_t, Stream>::iterator it = streams_.find(stream->stream_id_);
+    if (it == streams_.end() || it->second.conn.get() != stream)
+        return;
+    reset(stream->stream_id_, H2_CANCEL);
+    flush();
+}
+
+HttpConnPtr Http2Session::new_stream(uint32_t id, bool remote_closed)
+{
+    HttpConnPtr s(new HttpConnection(conn_->reactor_));
+    s->h2_conn_ = conn_->shared_from_this();
+    s->stream_id_ = id;
+    Stream &st = streams_[id];
+    st.conn = s;
+    st.send_window = initial_send_window_;
+    st.recv_window = kStreamWindow;
+    st.remote_closed = remote_closed;
+    st.headers_sent = st.pending = st.queued = st.last = false;
+    st.out_index = st.out_offset = 0;
+    last_stream_id_ = id;
+    // as for requests on a kept HTTP/1 connection, the limit ends it
+    // once these are done
+    if (++streams_served_ >= conn_->http_server_->max_keepalive_requests_ 
+            && !goaway_) {
+        append_goaway(obuf_, last_stream_id_, H2_NO_ERROR);
+        goaway_ = true;
+    }
+    return s;
+}
+
+// a write of the stream, out_ of it and after_write_ to call once the
+// buffers are taken. handle_write means the response is complete
+void Http2Session::submit(HttpConnection *stream)
+{
+    std::map<uint32_t, Stream>::iterator it = streams_.find(stream->stream_id_);
+    // reset by the client, or connection is gone
+    if (it == streams_.end() || it->second.conn.get() != stream)
+        return;
+    Stream &st = it->second;
+    st.last = stream->after_write_ == &HttpConnection::handle_write;
+    st.out_index = 0;
+    st.out_offset = 0;
+    int ret = st.headers_sent ? 0 : write_headers(it->first, st);
+    if (ret < 0) {
+        reset(it->first, H2_INTERNAL_ERROR);
+    } else if (ret > 0 || (!st.last && remaining(st) == 0)) {
+        finish_write(it);
+    } else {
+        st.pending = true;
+        if (!st.queued) {
+            st.queued = true;
+            sending_.push_back(it->first);
+        }
+        write_data();
+    }
+    flush();
+}
+
+// head of the response is HTTP/1 text which ends with an empty line,
+// from begin_response() or the cache. 1 if the stream ended with it
+int Http2Session::write_headers(uint32_t id, Stream &st)
+{
+    const std::array<boost::asio::const_buffer, 4> &out = st.conn->out_;
+    size_t end = std::string::npos;
+    head_.clear();
+    for(size_t i = 0; i < out.size(); i++) {
+        size_t before = head_.size();
+        head_.append((const char *)out[i].data(), out[i].size());
+        end = head_.find("\r\n\r\n", before < 3 ? 0 : before - 3);
+        if (end != std::string::npos) {
+            // body starts after it
+            st.out_index = i;
+            st.out_offset = end + 4 - before;
+            break;
+        }
+    }
+    // "HTTP/1.1 200 OK"
+    if (end == std::string::npos || head_.size() < 12)
+        return -1;
+
+    block_.clear();
+    encoder_.encode(block_, StrRef(":status", 7), StrRef(head_.data() + 9, 3));
+    for(size_t p = head_.find("\r\n") + 2; p < end + 2; ) {
+        size_t eol = head_.find("\r\n", p);
+        size_t colon = head_.find(':', p);
+        if (colon < eol) {
+            name_.assign(head_, p, colon - p);
+            for(size_t i = 0; i < name_.size(); i++)
+                name_[i] = ::tolower((unsigned char)name_[i]);
+            size_t v = colon + 1;
+            while (v < eol && (head_[v] == ' ' || head_[v] == '\t'))
+                v++;
+            StrRef name(name_.data(), name_.size());
+            // values which seldom repeat are kept out of the table
+            bool index = !name.equals("content-length") 
+                && !name.equals("content-range") && !name.equals("set-cookie");
+            if (!connection_header(name))
+                encoder_.encode(block_, name, StrRef(head_.data() + v, eol - v), index);
+        }
+        p = eol + 2;
+    }
+
+    bool end_stream = st.last && remaining(st) == 0;
+    int type = H2_HEADERS;
+    size_t pos = 0;
+    do {
+        size_t n = std::min(block_.size() - pos, max_send_frame_);
+        int flags = pos + n == block_.size() ? H2_END_HEADERS : 0;
+        if (type == H2_HEADERS && end_stream)
+            flags |= H2_END_STREAM;
+        append_frame_header(obuf_, n, type, flags, id);
+        obuf_.append(block_, pos, n);
+        pos += n;
+        type = H2_CONTINUATION;
+    } while (pos < block_.size());
+    st.headers_sent = true;
+    return end_stream ? 1 : 0;
+}
+
+size_t Http2Session::remaining(const Stream &st) const
+{
+    const std::array<boost::asio::const_buffer, 4> &out = st.conn->out_;
+    size_t n = 0;
+    for(size_t i = st.out_index; i < out.size(); i++)
+        n += out[i].size();
+    return n - st.out_offset;
+}
+
+// DATA frames of streams in turn, as windows and obuf_ allow
+void Http2Session::write_data()
+{
+    while (!sending_.empty() && obuf_.size() < kMaxBuffered && !closing_) {
+        uint32_t id = sending_.front();
+        std::map<uint32_t, Stream>::iterator it = streams_.find(id);
+        if (it == streams_.end()) {
+            sending_.pop_front();
+            continue;
+        }
+        Stream &st = it->second;
+        size_t left = remaining(st);
+        int64_t window = std::min(send_window_, st.send_window);
+        if (left > 0 && window <= 0) {
+            // all wait for the connection window, a stream for its own
+            if (send_window_ <= 0)
+                break;
+            sending_.pop_front();
+            st.queued = false;
+            continue;
+        }
+        sending_.pop_front();
+        st.queued = false;
+
+        size_t n = std::min(left, max_send_frame_);
+        if (n > 0 && (int64_t)n > window)
+            n = window;
+        bool end_stream = st.last && n == left;
+        append_frame_header(obuf_, n, H2_DATA, end_stream ? H2_END_STREAM : 0, id);
+        const std::array<boost::asio::const_buffer, 4> &out = st.conn->out_;
+        for(size_t k = n; k > 0; ) {
+            const boost::asio::const_buffer &b = out[st.out_index];
+            size_t m = std::min(k, b.size() - st.out_offset);
+            obuf_.append((const char *)b.data() + st.out_offset, m);
+            k -= m;
+            st.out_offset += m;
+            if (st.out_offset == b.size()) {
+                st.out_index++;
+                st.out_offset = 0;
+            }
+        }
+        send_window_ -= n;
+        st.send_window -= n;
+        if (n < left) {
+            st.queued = true;
+            sending_.push_back(id);
+        } else {
+            finish_write(it);
+        }
+    }
+}
+
+// buffers of a write are all in frames
+void Http2Session::finish_write(std::map<uint32_t, Stream>::iterator it)
+{
+    Stream &st = it->second;
+    st.pending = false;
+    if (st.last) {
+        // rest of the request body is not wanted
+        if (!st.remote_closed)
+            append_rst_stream(obuf_, it->first, H2_NO_ERROR);
+        streams_.erase(it);
+        return;
+    }
+    // next piece is asked for as after a socket write, not from here
+    HttpConnPtr s = st.conn;
+    s->reactor_->io_.post(boost::bind(s->after_write_, s, boost::system::error_code()));
+}
+
+void Http2Session::flush()
+{
+    if (closed_ || writing_)
+        return;
+    // done when streams are, after GOAWAY or while server stops
+    if (streams_.empty() && !closing_ 
+            && (goaway_ || conn_->http_server_->stopping_)) {
+        if (!goaway_)
+            append_goaway(obuf_, last_stream_id_, H2_NO_ERROR);
+        goaway_ = closing_ = true;
+    }
+    if (obuf_.empty()) {
+        if (closing_)
+            conn_->close();
+        else
+            update_timer();
+        return;
+    }
+    wbuf_.swap(obuf_);
+    obuf_.clear();
+    writing_ = true;
+    conn_->out_.fill(boost::asio::const_buffer());
+    conn_->out_[0] = boost::asio::buffer(wbuf_);
+    conn_->after_write_ = &HttpConnection::handle_write_h2;
+    conn_->start_write();
+}
+
+void Http2Session::write_done()
+{
+    writing_ = false;
+    write_data();
+    flush();
+}
+
+// idle without streams, while a write is in flight its timer runs
+void Http2Session::update_timer()
+{
+    if (streams_.empty())
+        conn_->arm_timer(HttpConnection::kTimerIdle);
+    else
+        conn_->disarm_timer();
+}
+
+// connection is closed, streams still working find no session
+void Http2Session::shutdown()
+{
+    closed_ = closing_ = true;
+    streams_.clear();
+    sending_.clear();
+}
+
+WsSession::WsSession(HttpConnection *conn,
+        const std::shared_ptr<const WebSocketHandler> &handler,
+        const std::shared_ptr<WebSocketState> &state)
+    : conn_(conn),
+      handler_(handler),
+      socket_(state),
+      in_frame_(false),
+      frame_left_(0),
+      frame_offset_(0),
+      message_opcode_(0),
+      queued_bytes_(0),
+      write_pending_(false),
+      open_(false),
+      reading_(true),
+      close_sent_(false),
+      closed_(false),
+      finished_(false),
+      pong_wait_(false)
+{
+}
+
+WsSession::~WsSession()
+{
+    unsubscribe_all();
+}
+
+void WsSession::start(const std::string &response)
+{
+    open_ = true;
+    queue_.push_front(std::make_shared<const std::string>(response));
+    queued_bytes_ += response.size();
+}
+
+size_t WsSession::receive(char *data, size_t len)
+{
+    char *p = data;
+    char *end = data + len;
+    // anything from peer shows it is still there
+    if (len > 0)
+        pong_wait_ = false;
+    while (reading_ && p < end) {
+        if (!in_frame_) {
+            int n = parse_ws_frame_header(p, end - p, frame_);
+            if (n == 0)
+                break;
+            int op = frame_.opcode;
+            // frames of a client must be masked
+            if (n < 0 || !frame_.masked) {
+                fail(WS_PROTOCOL_ERROR);
+                break;
+            }
+            if (ws_control(op)) {
+                if (op > WS_PONG || !frame_.fin || frame_.length > WS_MAX_CONTROL) {
+                    fail(WS_PROTOCOL_ERROR);
+                    break;
+                }
+            } else if (op > WS_BINARY || (op == WS_CONTINUATION) != (message_opcode_ != 0)) {
+                fail(WS_PROTOCOL_ERROR);
+                break;
+            } else if (frame_.length > handler_->max_message - message_.size()) {
+                fail(WS_TOO_BIG);
+                break;
+            }
+            if (op == WS_TEXT || op == WS_BINARY)
+                message_opcode_ = op;
+            p += n;
+            in_frame_ = true;
+            frame_left_ = frame_.length;
+            frame_offset_ = 0;
+        }
+        size_t n = (size_t)std::min<uint64_t>(frame_left_, end - p);
+        ws_unmask(p, n, frame_.mask, frame_offset_);
+        (ws_control(frame_.opcode) ? control_ : message_).append(p, n);
+        p += n;
+        frame_offset_ += n;
+        frame_left_ -= n;
+        if (frame_left_ > 0)
+            break;
+        in_frame_ = false;
+        if (ws_control(frame_.opcode))
+            on_control();
+        else if (frame_.fin)
+            on_message();
+    }
+    // what comes after CLOSE or an error is dropped
+    return reading_ ? p - data : len;
+}
+
+void WsSession::on_control()
+{
+    if (frame_.opcode == WS_PING) {
+        if (!close_sent_) {
+            std::shared_ptr<std::string> pong = std::make_shared<std::string>();
+            append_ws_frame(*pong, WS_PONG, control_.data(), control_.size());
+            queue(pong);
+        }
+    } else if (frame_.opcode == WS_CLOSE) {
+        int code = WS_NO_STATUS;
+        if (control_.size() >= 2)
+            code = ((uint8_t)control_[0] << 8) | (uint8_t)control_[1];
+        if (control_.size() == 1 || code < 1000 || (code >= 1004 && code <= 1006)
+                || code == 1015 || code >= 5000) {
+            control_.clear();
+            fail(WS_PROTOCOL_ERROR);
+            return;
+        }
+        if (control_.size() > 2 && !valid_utf8(control_.data() + 2, control_.size() - 2)) {
+            control_.clear();
+            fail(WS_INVALID_DATA);
+            return;
+        }
+        // answered with the same code, then the connection is closed
+        reading_ = false;
+        close(code == WS_NO_STATUS ? WS_NORMAL : code, StrRef());
+        finish(code);
+    }
+    // PONG only tells peer is there
+    control_.clear();
+}
+
+void WsSession::on_message()
+{
+    bool binary = message_opcode_ == WS_BINARY;
+    message_opcode_ = 0;
+    if (!binary && !valid_utf8(message_.data(), message_.size())) {
+        fail(WS_INVALID_DATA);
+        return;
+    }
+    // after our CLOSE they are dropped
+    if (!close_sent_ && handler_->on_message)
+        handler_->on_message(socket_, message_, binary);
+    if (message_.capacity() > MAX_KEPT_CAPACITY)
+        std::string().swap(message_);
+    else
+        message_.clear();
+}
+
+// CLOSE with code, the connection is closed once it is sent
+void WsSession::fail(int code)
+{
+    reading_ = false;
+    close(code, StrRef());
+    finish(code);
+}
+
+void WsSession::finish(int code)
+{
+    if (finished_)
+        return;
+    finished_ = true;
+    if (handler_->on_close)
+        handler_->on_close(socket_, code);
+}
+
+void WsSession::queue(const std::shared_ptr<const std::string> &frame)
+{
+    queue_.push_back(frame);
+    queued_bytes_ += frame->size();
+}
+
+void WsSession::send(const std::shared_ptr<const std::string> &frame)
+{
+    if (close_sent_ || closed_)
+        return;
+    // a peer which can't keep up is let go rather than buffered for
+    if (queued_bytes_ + frame->size() > handler_->max_queued) {
+        close_sent_ = true;
+        reading_ = false;
+        conn_->reactor_->io_.post(boost::bind(&HttpConnection::close,
+                    conn_->shared_from_this()));
+        return;
+    }
+    queue(frame);
+    flush();
+}
+
+void WsSession::close(int code, StrRef reason)
+{
+    if (close_sent_ || closed_)
+        return;
+    std::shared_ptr<std::string> frame = std::make_shared<std::string>();
+    append_ws_close(*frame, code, reason);
+    queue(frame);
+    close_sent_ = true;
+    flush();
+}
+
+void WsSession::subscribe(const std::string &topic, bool on)
+{
+    std::vector<std::string>::iterator it = std::find(topics_.begin(),
+            topics_.end(), topic);
+    if (on == (it != topics_.end()) || (on && closed_))
+        return;
+    std::vector<HttpConnection *> &subs = conn_->reactor_->topics_[topic];
+    if (on) {
+        topics_.push_back(topic);
+        subs.push_back(conn_);
+        return;
+    }
+    topics_.erase(it);
+    // order of subscribers doesn't matter
+    *std::find(subs.begin(), subs.end(), conn_) = subs.back();
+    subs.pop_back();
+    if (subs.empty())
+        conn_->reactor_->topics_.erase(topic);
+}
+
+void WsSession::unsubscribe_all()
+{
+    while (!topics_.empty())
+        subscribe(std::string(topics_.back()), false);
+}
+
+bool WsSession::ping()
+{
+    if (!open_ || close_sent_ || pong_wait_)
+        return false;
+    pong_wait_ = true;
+    std::shared_ptr<std::string> frame = std::make_shared<std::string>();
+    append_ws_frame(*frame, WS_PING, "", 0);
+    queue(frame);
+    flush();
+    return true;
+}
+
+void WsSession::flush()
+{
+    if (!open_ || closed_ || write_pending_)
+        return;
+    if (queue_.empty()) {
+        // CLOSE went both ways, or ours after an error
+        if (close_sent_ && !reading_)
+            conn_->close();
+        else
+            update_timer();
+        return;
+    }
+    conn_->out_.fill(boost::asio::const_buffer());
+    size_t bytes = 0;
+    for(size_t i = 0; i < writing_.size() && !queue_.empty(); i++) {
+        writing_[i].swap(queue_.front());
+        queue_.pop_front();
+        conn_->out_[i] = boost::asio::buffer(*writing_[i]);
+        bytes += writing_[i]->size();
+    }
+    queued_bytes_ -= bytes;
+    StatSlot &stat = conn_->http_server_->metrics_.local();
+    stat.add(stat.bytes_out, bytes);
+    write_pending_ = true;
+    conn_->after_write_ = &HttpConnection::handle_write_ws;
+    conn_->start_write();
+}
+
+void WsSession::write_done()
+{
+    write_pending_ = false;
+    for(size_t i = 0; i < writing_.size(); i++)
+        writing_[i].reset();
+    flush();
+}
+
+// quiet connection is pinged after ping_interval, one closing waits
+// for peer's CLOSE. while a write is in flight its timer runs
+void WsSession::update_timer()
+{
+    if (conn_->http_server_->stopping_ && !close_sent_) {
+        close(WS_GOING_AWAY, StrRef());
+        return;
+    }
+    if (close_sent_) {
+        conn_->arm_timer(HttpConnection::kTimerIdle);
+        return;
+    }
+    conn_->timer_kind_ = HttpConnection::kTimerIdle;
+    conn_->reactor_->wheel_.schedule(conn_, handler_->ping_interval,
+            HttpConnection::kTimerIdle);
+}
+
+// connection is closed, what handles still ask for is ignored
+void WsSession::shutdown()
+{
+    closed_ = true;
+    reading_ = false;
+    queue_.clear();
+    queued_bytes_ = 0;
+    unsubscribe_all();
+    finish(WS_ABNORMAL);
+}
+
+void Response::set_header(const char *key, size_t klen, 
+        const char *value, size_t vlen)
+{
+    StrRef v(arena_->copy(value, vlen), vlen);
+    // well-known names need no copy, the map has their canonical name
+    KnownHeader h = known_header(key, klen);
+    if (h != HDR_UNKNOWN)
+        headers_.set(h, v);
+    else
+        headers_.set(StrRef(arena_->copy(key, klen), klen), v);
+}
+
+void Response::set_header(const std::string& key, const std::string &value)
+{ 
+    set_header(key.data(), key.size(), value.data(), value.size());
+}
+
+void Response::set_header(const char *key, const char *value)
+{ 
+    set_header(key, ::strlen(key), value, ::strlen(value));
+}
+
+void Response::set_header(const std::string& key, long value)
+{
+    char strvalue[24];
+    int n = snprintf(strvalue, 24, "%ld", value);
+    set_header(key.data(), key.size(), strvalue, n);
+}
+
+HttpReactor::HttpReactor(HttpServerInter *http_server,
+        boost::asio::io_service *io)
+    : http_server_(http_server),
+      conns_(0),
+      own_io_(io ? NULL : new boost::asio::io_service()),
+      io_(io ? *io : *own_io_),
+      tick_(io_),
+#ifdef HTTP_IO_URING
+      ring_(4096),
+      ring_wakeup_(io_, ::dup(ring_.event_fd())),
+      flush_posted_(false),
+#endif
+      drained_(false),
+      drain_posted_(false)
+{
+}
+
+void HttpReactor::listen_tcp(const boost::asio::ip::tcp::endpoint &endpoint,
+        bool reuse_port)
 {
-    if (state_ == kReadingHeader) {
-        request_.append(buffer_.data(), bytes_transferred);
-        if (parse_request_header() < 0) {
-            if (request_.size() > 8192)
-                // header size less than 8K count as valid
-                return -1;
-            else 
-                return 1;
-        }
-        if (state_ == kReadingPost && req_.postdata_.size() < postsize_) 
-            return 1;
-        else 
-            return 0;
-    } else if (state_ == kReadingPost) {
-        req_.postdata_.append(buffer_.data(), bytes_transferred);
-        if (req_.postdata_.size() >= postsize_) 
-            return 0;
-        else 
-            return 1;
-    }
-    // impossible to reach
-    return -1;
+    // every reactor binds the same port with SO_REUSEPORT,
+    // kernel spreads incoming connections among them
+    typedef boost::asio::detail::socket_option::boolean<
+        SOL_SOCKET, SO_REUSEPORT> reuse_port_option;
+    boost::asio::generic::stream_protocol::endpoint ep(endpoint.data(),
+            endpoint.size(), IPPROTO_TCP);
+    std::unique_ptr<Listener> l(new Listener(io_, ep.protocol()));
+    l->acceptor.open(ep.protocol());
+    l->acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+    if (reuse_port)
+        l->acceptor.set_option(reuse_port_option(true));
+    // IPv4 may be listened on the same port separately
+    if (endpoint.address().is_v6())
+        l->acceptor.set_option(boost::asio::ip::v6_only(true));
+    l->acceptor.bind(ep);
+    l->acceptor.listen();
+    add_listener(l.release());
 }
 
-void HttpConnection::begin_response()
+void HttpReactor::listen_unix(int fd)
 {
-    if (http_ret_ < 0 || http_ret_ >= HTTP_END) {
-        http_ret_ = HTTP_503;
-    }
-    if (http_ret_ != HTTP_200 && resp_.body_.empty()) {
-        resp_.set_body("<html><body><h1>" + STATUS_CODE_STR[http_ret_] + "</h1></body></html>");
-        resp_.set_header("Content-Type", "text/html");
-    }
-    if (resp_.headers_.count("Server") == 0) 
-        resp_.set_header("Server", "SimpleWebSvr/1.0");
-    if (resp_.headers_.count("Connection") == 0) 
-        resp_.set_header("Connection", "Keep-Alive");
-#ifdef HTTP_COMPRESSION
-    auto it = req_.headers_.find("Accept-Encoding");
-    if (it != req_.headers_.end()
-            && it->second.find("deflate") != std::string::npos) {
-        // client support deflate compression
-        if (!resp_.body_.empty()) {
-            std::string deflated = zlib_compress(resp_.body_);
-            if (!deflated.empty()) {
-                resp_.body_ = deflated;
-                resp_.set_header("Content-Encoding", "deflate");
-            }
-        }
-    }
+    std::unique_ptr<Listener> l(new Listener(io_,
+                boost::asio::generic::stream_protocol(AF_UNIX, 0)));
+    int own = ::dup(fd);
+    if (own < 0)
+        throw boost::system::system_error(errno, boost::system::system_category(), "dup");
+    l->acceptor.assign(l->protocol, own);
+    add_listener(l.release());
+}
+
+void HttpReactor::add_listener(Listener *l)
+{
+    listeners_.push_back(std::unique_ptr<Listener>(l));
+#ifdef HTTP_IO_URING
+    l->ring_accept.reactor = this;
+    l->ring_accept.listener = l;
 #endif
-    if (resp_.headers_.count("Content-Length") == 0) 
-        resp_.set_header("Content-Length", resp_.body_.size());
+}
 
-    std::vector<boost::asio::const_buffer> buffers;
-    if (http_ret_ >= 0 && http_ret_ < HTTP_END) {
-        buffers.push_back(boost::asio::buffer(STATUS_CODE_STR[http_ret_]));
-        for(auto it = resp_.headers_.begin();
-                it != resp_.headers_.end(); it++) {
-            buffers.push_back(boost::asio::buffer(it->first));
-            buffers.push_back(boost::asio::buffer(KV_SEPARATOR));
-            buffers.push_back(boost::asio::buffer(it->second));
-            buffers.push_back(boost::asio::buffer(CRLF));
-        }
-        buffers.push_back(boost::asio::buffer(std::string(CRLF)));
-        buffers.push_back(boost::asio::buffer(resp_.body_));
-        boost::asio::async_write(socket_, buffers,
-            boost::bind(&HttpConnection::handle_write, shared_from_this(),
-            boost::asio::placeholders::error));
-    } else {
-        socket_.close();
+#ifdef HTTP_IO_URING
+io_uring_sqe *HttpReactor::ring_sqe()
+{
+    if (!flush_posted_) {
+        flush_posted_ = true;
+        io_.post(boost::bind(&HttpReactor::flush_ring, this));
     }
+    return ring_.get_sqe();
 }
 
-void HttpConnection::handle_write(const boost::system::error_code& e) 
+void HttpReactor::flush_ring()
 {
-    if (!e) {
-        boost::system::error_code ignored_ec;
-        socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored_ec);
-    }
-    //socket_.close();
-    request_.clear();
-    req_.clear();
-    resp_.clear();
-    postsize_ = 0;
-    start();
+    flush_posted_ = false;
+    if (ring_.pending())
+        ring_.submit();
 }
 
-void Response::set_header(const std::string& key, const std::string &value)
-{ 
-    headers_[key] = value; 
+void HttpReactor::start_ring_wait()
+{
+    ring_wakeup_.async_read_some(
+        boost::asio::buffer(&ring_events_, sizeof(ring_events_)),
+        boost::bind(&HttpReactor::handle_ring_wait, this,
+        boost::asio::placeholders::error));
 }
 
-void Response::set_header(const std::string& key, long value)
+void HttpReactor::handle_ring_wait(const boost::system::error_code& error)
 {
-    char strvalue[24];
-    snprintf(strvalue, 24, "%ld", value);
-    set_header(key, std::string(strvalue));
+    if (error == boost::asio::error::operation_aborted)
+        return;
+    // what completions queue goes out with the submit below, no
+    // flush needs to be posted meanwhile
+    bool posted = flush_posted_;
+    flush_posted_ = true;
+    ring_.reap();
+    flush_posted_ = posted;
+    if (ring_.pending())
+        ring_.submit();
+    // a wakeup read before check_drained() canceled the wait lands
+    // here, io_.run() returns once this one is not renewed
+    if (!http_server_->stopping_ || conns_ > 0)
+        start_ring_wait();
+}
+
+// one multishot accept gives a CQE per connection
+void HttpReactor::start_ring_accept(Listener *l)
+{
+    io_uring_sqe *sqe = ring_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = l->acceptor.native_handle();
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = (uintptr_t)static_cast<UringOp *>(&l->ring_accept);
+}
+
+void HttpReactor::RingAccept::complete(int res, unsigned flags)
+{
+    reactor->handle_ring_accept(listener, res, flags);
+}
+
+void HttpReactor::handle_ring_accept(Listener *l, int res, unsigned flags)
+{
+    if (res >= 0 && !l->acceptor.is_open()) {
+        // accepted before stop() canceled it
+        ::close(res);
+    } else if (res >= 0) {
+        HttpConnPtr new_conn(new HttpConnection(this));
+        boost::system::error_code ec;
+        new_conn->socket().assign(l->protocol, res, ec);
+        if (ec) {
+            ::close(res);
+        } else {
+            if (l->tcp)
+                new_conn->socket().set_option(boost::asio::ip::tcp::no_delay(true),
+                        ec);
+            new_conn->start();
+        }
+    }
+    // kernel ends a multishot accept on some errors
+    if (!(flags & IORING_CQE_F_MORE) && l->acceptor.is_open())
+        start_ring_accept(l);
 }
+#endif
 
-void HttpServerInter::start_accept()
+
+void HttpReactor::start_accept(Listener *l)
 {
     HttpConnPtr new_conn =
         HttpConnPtr(new HttpConnection(this));
 
-    acceptor_.async_accept(new_conn->socket(),
-        boost::bind(&HttpServerInter::handle_accept, this, new_conn,
+    l->acceptor.async_accept(new_conn->socket(),
+        boost::bind(&HttpReactor::handle_accept, this, l, new_conn,
         boost::asio::placeholders::error));
 }
 
-void HttpServerInter::handle_accept(HttpConnPtr new_conn,
+void HttpReactor::handle_accept(Listener *l, HttpConnPtr new_conn,
   const boost::system::error_code& error)
 {
     if (!error) {
+        // responses are written in one go, Nagle only delays them
+        boost::system::error_code ignored_ec;
+        if (l->tcp)
+            new_conn->socket().set_option(boost::asio::ip::tcp::no_delay(true),
+                    ignored_ec);
         new_conn->start();
+    } else if (!l->acceptor.is_open()) {
+        // closed by stop()
+        return;
     }
-    start_accept();
+    start_accept(l);
 }
 
-void HttpServerInter::push_to_threadpool(HttpConnPtr conn) 
+void HttpReactor::start_tick()
 {
-    /* push conn to queue belongs to least busy thread */
-    std::lock_guard<std::mutex> lk(threadpool_m_);
-    threadpool_q_.push_back(conn);
-    threadpool_cv_.notify_one();
+    tick_.expires_after(std::chrono::seconds(1));
+    tick_.async_wait(boost::bind(&HttpReactor::handle_tick, this,
+        boost::asio::placeholders::error));
 }
 
-void HttpServerInter::thread_proc(int id)
+void HttpReactor::handle_tick(const boost::system::error_code& error)
 {
-    std::list<HttpConnPtr> &q = threadpool_q_; //alias
+    if (error)
+        return;
+    // a connection being destroyed can't be locked, and is left alone
+    wheel_.advance([this](TimerEntry *e, int) {
+        HttpConnPtr conn = static_cast<HttpConnection *>(e)->weak_from_this().lock();
+        if (conn)
+            expired_.push_back(conn);
+    });
+    for(auto it = expired_.begin(); it != expired_.end(); it++)
+        (*it)->handle_timeout();
+    expired_.clear();
+    if (!http_server_->stopping_ || conns_ > 0)
+        start_tick();
+}
 
-    (void)(id);
-    for(;;) {
-        HttpConnPtr conn;
-        std::unique_lock<std::mutex> lk(threadpool_m_);
-        if (q.size() > 0) {
-            conn = q.front();
-            q.pop_front();
-            lk.unlock();
-        } else {
-            threadpool_cv_.wait(lk);
-            continue;
-        }
-        conn->process_request();
+// in io_ thread, or before io_ runs
+void HttpReactor::start()
+{
+    // begin_stop() is posted after this then
+    if (http_server_->stopping_)
+        return;
+#ifdef HTTP_IO_URING
+    start_ring_wait();
+#endif
+    start_tick();
+    for(auto it = listeners_.begin(); it != listeners_.end(); it++) {
+#ifdef HTTP_IO_URING
+        start_ring_accept(it->get());
+#else
+        start_accept(it->get());
+#endif
+    }
+}
+
+void HttpReactor::begin_stop()
+{
+    boost::system::error_code ignored_ec;
+#ifdef HTTP_IO_URING
+    for(auto it = listeners_.begin(); it != listeners_.end(); it++) {
+        io_uring_sqe *sqe = ring_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uintptr_t)static_cast<UringOp *>(&(*it)->ring_accept);
+    }
+    // submitted before the listening fds are closed and their numbers reused
+    flush_ring();
+#endif
+    for(auto it = listeners_.begin(); it != listeners_.end(); it++)
+        (*it)->acceptor.close(ignored_ec);
+    // idle connections are closed now, busy ones after their response
+    wheel_.for_each([this](TimerEntry *e, int kind) {
+        if (kind != HttpConnection::kTimerIdle)
+            return;
+        HttpConnPtr conn = static_cast<HttpConnection *>(e)->weak_from_this().lock();
+        if (conn)
+            expired_.push_back(conn);
+    });
+    for(auto it = expired_.begin(); it != expired_.end(); it++) {
+        // a WebSocket is told why, and closed after peer's answer
+        if ((*it)->ws_)
+            (*it)->ws_->close(WS_GOING_AWAY, StrRef());
+        else
+            (*it)->close();
+    }
+    expired_.clear();
+    check_drained();
+}
+
+void HttpReactor::complete(HttpConnection *conn)
+{
+    completed_.push(conn);
+    // one wakeup for all completed till the drain runs
+    if (!drain_posted_.exchange(true))
+        io_.post(boost::bind(&HttpReactor::drain_completed, this));
+}
+
+void HttpReactor::drain_completed()
+{
+    // cleared before popping, a push seen empty here posts another drain
+    drain_posted_.store(false);
+    MpscNode *node;
+    while ((node = completed_.pop()) != NULL) {
+        HttpConnection *conn = static_cast<HttpConnection *>(node);
+        HttpConnPtr self;
+        self.swap(conn->pooled_self_);
+        conn->in_pool_ = false;
+        conn->start_write();
+    }
+}
+
+void HttpReactor::publish(const std::string &topic,
+        const std::shared_ptr<const std::string> &frame)
+{
+    auto it = topics_.find(topic);
+    if (it == topics_.end())
+        return;
+    std::vector<HttpConnection *> &subs = it->second;
+    for(size_t i = 0; i < subs.size(); i++)
+        subs[i]->ws_->send(frame);
+}
+
+void HttpReactor::check_drained()
+{
+    // io_.run() returns once the tick is gone too
+    if (http_server_->stopping_ && conns_ == 0 && !drained_) {
+        drained_ = true;
+        tick_.cancel();
+#ifdef HTTP_IO_URING
+        boost::system::error_code ignored_ec;
+        ring_wakeup_.cancel(ignored_ec);
+#endif
+        // queued after the handlers of the cancels, nothing of this
+        // reactor is left in io_ when it runs
+        io_.post(boost::bind(&HttpServerInter::reactor_stopped, http_server_));
+    }
+}
+
+bool HttpServerInter::push_to_threadpool(HttpConnPtr conn,
+        ThreadPool::Priority priority)
+{
+    StatSlot &stat = metrics_.local();
+    // no timeout while handler runs, socket is not touched by others then
+    conn->disarm_timer();
+    conn->pooled_self_ = conn;
+    if (executor_) {
+        // its own queue, priority and set_pool_queue() limits don't apply
+        HttpConnection *task = conn.get();
+        task->queued_at_ = now_ns();
+        executor_([task]() { task->run_in_pool(); });
+        stat.add(stat.pool_tasks);
+        return true;
+    }
+    if (!threadpool_.push(conn.get(), priority)) {
+        conn->pooled_self_.reset();
+        stat.add(stat.pool_rejected);
+        return false;
     }
+    stat.add(stat.pool_tasks);
+    return true;
 }
 
 void HttpServerInter::set_handler(RequestHandler handler)
@@ -443,34 +3977,358 @@ void HttpServerInter::set_handler(RequestHandler handler)
     req_handler_ = handler;
 }
 
+void HttpServerInter::route(RequestType method, const std::string &pattern,
+        const Router::Route &route)
+{
+    if (route.policy != RUN_INLINE && !has_pool())
+        throw std::invalid_argument("RUN_IN_POOL route but thread num set to zero");
+    router_.add(method, pattern, route);
+}
+
+// framed once, each reactor sends it to its own subscribers
+void HttpServerInter::broadcast(const std::string &topic, const std::string &data,
+        bool binary)
+{
+    std::shared_ptr<std::string> frame = std::make_shared<std::string>();
+    append_ws_frame(*frame, binary ? WS_BINARY : WS_TEXT, data.data(), data.size());
+    std::shared_ptr<const std::string> shared(frame);
+    for(int i = 0; i < iothreadnum_; i++)
+        reactors_[i]->io_.post(boost::bind(&HttpReactor::publish, reactors_[i],
+                    topic, shared));
+}
+
+void HttpServerInter::set_body_handler(BodyHandler handler)
+{
+    body_handler_ = handler;
+}
+
+void HttpServerInter::set_max_body_size(uint64_t max_bytes)
+{
+    max_body_size_ = max_bytes;
+}
+
+void HttpServerInter::set_keepalive(int max_requests)
+{
+    max_keepalive_requests_ = max_requests;
+}
+
+void HttpServerInter::set_pool_queue(size_t max_queued, OverloadPolicy policy,
+        int retry_after)
+{
+    threadpool_.set_limit(max_queued, policy == SHED_OLDEST);
+    retry_after_ = retry_after;
+}
+
+void HttpServerInter::set_pool_delay_control(int target_ms, int interval_ms)
+{
+    threadpool_.set_delay_control((uint64_t)target_ms * 1000000,
+            (uint64_t)interval_ms * 1000000);
+}
+
+void HttpServerInter::set_executor(OffloadExecutor executor)
+{
+    executor_ = executor;
+}
+
+void HttpServerInter::add_static_dir(const std::string &url_prefix, 
+        const std::string &dir)
+{
+    StaticDir sd;
+    sd.prefix = url_prefix;
+    sd.dir = dir;
+    static_dirs_.push_back(sd);
+}
+
+void HttpServerInter::set_file_cache(size_t max_files)
+{
+    file_cache_.set_capacity(max_files);
+}
+
+void HttpServerInter::enable_etags(bool on)
+{
+    auto_etag_ = on;
+}
+
+void HttpServerInter::enable_http2(bool on)
+{
+    http2_ = on;
+}
+
+void HttpServerInter::enable_response_cache(size_t max_bytes)
+{
+    response_cache_.set_capacity(max_bytes);
+}
+
+#ifdef HTTP_COMPRESSION
+void HttpServerInter::set_compression_min_size(size_t min_size)
+{
+    compression_min_size_ = min_size;
+}
+#endif
+
+void HttpServerInter::enable_metrics(const std::string &path)
+{
+    metrics_path_ = path;
+}
+
+void HttpServerInter::set_timeouts(int idle, int header, int body, int write)
+{
+    int t[] = {idle, header, body, write};
+    for(int i = 0; i < HttpConnection::kTimerKinds; i++)
+        timeouts_[i] = t[i] < 0 ? 0 : t[i];
+}
+
+ServerStats HttpServerInter::stat() const
+{
+    ServerStats stats;
+    metrics_.collect(stats);
+    stats.pool_queue_depth = threadpool_.queued();
+    return stats;
+}
+
+void HttpServerInter::render_metrics(std::string &out) const
+{
+    ServerStats st = stat();
+    char line[160];
+    auto metric = [&out](const char *name, const char *type) {
+        out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+    };
+    auto value = [&out, &line](const char *name, const char *labels, double v) {
+        snprintf(line, sizeof(line), "%s%s %.15g\n", name, labels, v);
+        out.append(line);
+    };
+    auto histogram = [&](const char *name, const Histogram &h) {
+        char labels[32];
+        metric(name, "histogram");
+        std::string bucket = std::string(name) + "_bucket";
+        uint64_t seen = 0;
+        int b = 0;
+        for(size_t i = 0; i < sizeof(METRICS_BUCKETS) / sizeof(double); i++) {
+            // buckets whose values are all within the bound
+            while (b < Histogram::kBuckets 
+                    && Histogram::bucket_upper(b) <= METRICS_BUCKETS[i] * 1e9)
+                seen += h.counts[b++];
+            snprintf(labels, sizeof(labels), "{le=\"%g\"}", METRICS_BUCKETS[i]);
+            value(bucket.c_str(), labels, seen);
+        }
+        value(bucket.c_str(), "{le=\"+Inf\"}", h.count);
+        value((std::string(name) + "_sum").c_str(), "", h.sum / 1e9);
+        value((std::string(name) + "_count").c_str(), "", h.count);
+    };
+
+    out.clear();
+    metric("tws_connections_active", "gauge");
+    value("tws_connections_active", "", st.connections_active);
+    metric("tws_connections_accepted_total", "counter");
+    value("tws_connections_accepted_total", "", st.connections_accepted);
+    metric("tws_connections_closed_total", "counter");
+    value("tws_connections_closed_total", "", st.connections_closed);
+    metric("tws_connection_timeouts_total", "counter");
+    value("tws_connection_timeouts_total", "", st.timeouts);
+
+    metric("tws_requests_total", "counter");
+    for(int i = 0; i <= HTTP_INVALID; i++) {
+        char labels[32];
+        snprintf(labels, sizeof(labels), "{method=\"%s\"}", METHOD_STR[i]);
+        value("tws_requests_total", labels, st.requests[i]);
+    }
+    metric("tws_responses_total", "counter");
+    for(int i = 0; i < HTTP_END; i++) {
+        char labels[32];
+        // code is the 3 digits after "HTTP/1.1 "
+        snprintf(labels, sizeof(labels), "{code=\"%.3s\"}", 
+                STATUS_CODE_STR[i].c_str() + 9);
+        value("tws_responses_total", labels, st.responses[i]);
+    }
+
+    metric("tws_received_bytes_total", "counter");
+    value("tws_received_bytes_total", "", st.bytes_in);
+    metric("tws_sent_bytes_total", "counter");
+    value("tws_sent_bytes_total", "", st.bytes_out);
+    metric("tws_compression_input_bytes_total", "counter");
+    value("tws_compression_input_bytes_total", "", st.compress_in);
+    metric("tws_compression_output_bytes_total", "counter");
+    value("tws_compression_output_bytes_total", "", st.compress_out);
+    metric("tws_compression_ratio", "gauge");
+    value("tws_compression_ratio", "", st.compression_ratio());
+
+    metric("tws_pool_tasks_total", "counter");
+    value("tws_pool_tasks_total", "", st.pool_tasks);
+    metric("tws_pool_rejected_total", "counter");
+    value("tws_pool_rejected_total", "", st.pool_rejected);
+    metric("tws_pool_shed_total", "counter");
+    value("tws_pool_shed_total", "", st.pool_shed);
+    metric("tws_pool_queue_depth", "gauge");
+    value("tws_pool_queue_depth", "", st.pool_queue_depth);
+    metric("tws_response_cache_hits_total", "counter");
+    value("tws_response_cache_hits_total", "", st.cache_hits);
+    metric("tws_response_cache_misses_total", "counter");
+    value("tws_response_cache_misses_total", "", st.cache_misses);
+    metric("tws_response_cache_waits_total", "counter");
+    value("tws_response_cache_waits_total", "", st.cache_waits);
+    histogram("tws_pool_wait_seconds", st.pool_wait);
+    histogram("tws_handler_seconds", st.handler_latency);
+}
+
 void HttpServerInter::run()
 {
-    io_.run();
+    if (embedded_)
+        throw std::logic_error("run() of a server on host's io_context, use start()");
+    if (started_.exchange(true))
+        throw std::logic_error("server already started");
+    // nothing runs the loops yet, so no need to post
+    for(int i = 0; i < iothreadnum_; i++)
+        reactors_[i]->start();
+    // reactor 0 runs in caller's thread, others get their own
+    std::vector<std::thread> io_threads;
+    for(int i = 1; i < iothreadnum_; i++)
+        io_threads.emplace_back([this, i]() { reactors_[i]->io_.run(); });
+    reactors_[0]->io_.run();
+    for(auto &t : io_threads)
+        t.join();
+    // all connections are gone, so is every task they queued
+    threadpool_.stop();
+}
+
+void HttpServerInter::start()
+{
+    if (!embedded_)
+        throw std::logic_error("start() of a server with own threads, use run()");
+    if (started_.exchange(true))
+        throw std::logic_error("server already started");
+    // host's loops may be running already
+    for(int i = 0; i < iothreadnum_; i++)
+        reactors_[i]->io_.post(boost::bind(&HttpReactor::start, reactors_[i]));
+}
+
+void HttpServerInter::stop(std::function<void ()> on_stopped)
+{
+    if (stopping_.exchange(true))
+        return;
+    // read by reactor_stopped() only after the posts below
+    on_stopped_ = on_stopped;
+    for(int i = 0; i < iothreadnum_; i++)
+        reactors_[i]->io_.post(
+                boost::bind(&HttpReactor::begin_stop, reactors_[i]));
 }
 
-void HttpServerInter::stop()
+void HttpServerInter::reactor_stopped()
 {
-    //not implemented yet
+    if (running_.fetch_sub(1) != 1 || !on_stopped_)
+        return;
+    // it may destroy the server
+    std::function<void ()> on_stopped;
+    on_stopped.swap(on_stopped_);
+    on_stopped();
 }
 
 HttpServerInter::HttpServerInter(unsigned short port,
-        RequestHandler main_handler, int threadnum)
-    : io_(), 
-      acceptor_(io_, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
-      threadnum_(threadnum)
-{
-    threads_ = new std::thread*[threadnum_];
-    for(int i = 0; i < threadnum_; i++)
-        threads_[i] = new std::thread(
-                &HttpServerInter::thread_proc, this, i);
+        RequestHandler main_handler, int threadnum, int iothreadnum,
+        const std::vector<boost::asio::io_service *> &ios)
+    : iothreadnum_(!ios.empty() ? (int)ios.size() : iothreadnum < 1 ? 1 : iothreadnum),
+      embedded_(!ios.empty()),
+      threadpool_(threadnum),
+      body_handler_(NULL),
+      max_body_size_(16 << 20),
+      max_keepalive_requests_(100),
+      auto_etag_(false),
+      http2_(false),
+      stopping_(false),
+      started_(false),
+      running_(iothreadnum_),
+      retry_after_(1)
+#ifdef HTTP_COMPRESSION
+      , compression_min_size_(256)
+#endif
+{
+    static_assert(sizeof(timeouts_) / sizeof(int) == HttpConnection::kTimerKinds,
+            "a timeout for each TimerKind");
+    set_timeouts(15, 10, 30, 30);
     req_handler_ = main_handler;
-    start_accept();
+    reactors_ = new HttpReactor*[iothreadnum_];
+    for(int i = 0; i < iothreadnum_; i++)
+        reactors_[i] = new HttpReactor(this, embedded_ ? ios[i] : NULL);
+    if (port != 0)
+        listen(boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port));
+}
+
+HttpServerInter::~HttpServerInter()
+{
+    for(int i = 0; i < iothreadnum_; i++)
+        delete reactors_[i];
+    delete[] reactors_;
+    for(auto it = unix_paths_.begin(); it != unix_paths_.end(); it++)
+        ::unlink(it->c_str());
+}
+
+void HttpServerInter::listen(const boost::asio::ip::tcp::endpoint &endpoint)
+{
+    for(int i = 0; i < iothreadnum_; i++)
+        reactors_[i]->listen_tcp(endpoint, iothreadnum_ > 1);
+}
+
+// SO_REUSEPORT doesn't spread Unix connections, so one socket is
+// bound and all reactors accept on it
+void HttpServerInter::listen_unix(const std::string &path)
+{
+    bool abstract = !path.empty() && path[0] == '@';
+    boost::asio::local::stream_protocol::endpoint endpoint(
+            abstract ? std::string(1, '\0') + path.substr(1) : path);
+    boost::asio::io_service &io = reactors_[0]->io_;
+    struct stat st;
+    if (!abstract && ::lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        // left by a server that is gone if nobody answers on it
+        boost::asio::local::stream_protocol::socket probe(io);
+        boost::system::error_code ec;
+        probe.connect(endpoint, ec);
+        if (ec == boost::asio::error::connection_refused)
+            ::unlink(path.c_str());
+    }
+    boost::asio::local::stream_protocol::acceptor acceptor(io);
+    acceptor.open(endpoint.protocol());
+    acceptor.bind(endpoint);
+    if (!abstract)
+        unix_paths_.push_back(path);
+    acceptor.listen();
+    for(int i = 0; i < iothreadnum_; i++)
+        reactors_[i]->listen_unix(acceptor.native_handle());
 }
 
 HttpServer::HttpServer(unsigned short port,
+        RequestHandler main_handler, int threadnum, int iothreadnum)
+    : inter_(new HttpServerInter(port, main_handler, threadnum, iothreadnum,
+                std::vector<boost::asio::io_service *>()))
+{
+}
+
+HttpServer::HttpServer(boost::asio::io_context &io, unsigned short port,
         RequestHandler main_handler, int threadnum)
-    : inter_(new HttpServerInter(port, main_handler, threadnum))
+    : inter_(new HttpServerInter(port, main_handler, threadnum, 1,
+                std::vector<boost::asio::io_service *>(1, &io)))
+{
+}
+
+HttpServer::HttpServer(const std::vector<boost::asio::io_context *> &ios,
+        unsigned short port, RequestHandler main_handler, int threadnum)
+    : inter_(ios.empty() ? throw std::invalid_argument("no io_context for server")
+            : new HttpServerInter(port, main_handler, threadnum, 1, ios))
+{
+}
+
+HttpServer::~HttpServer()
+{
+    delete inter_;
+}
+
+void HttpServer::listen(const std::string &address, unsigned short port)
 {
+    inter_->listen(boost::asio::ip::tcp::endpoint(
+                boost::asio::ip::make_address(address), port));
+}
+
+void HttpServer::listen_unix(const std::string &path)
+{
+    inter_->listen_unix(path);
 }
 
 void HttpServer::set_handler(RequestHandler handler)
@@ -478,19 +4336,146 @@ void HttpServer::set_handler(RequestHandler handler)
     inter_->set_handler(handler);
 }
 
+void HttpServer::route(RequestType method, const std::string &pattern,
+        const RouteHandler &handler, ExecPolicy policy)
+{
+    Router::Route route;
+    route.handler = handler;
+    route.policy = policy;
+    inter_->route(method, pattern, route);
+}
+
+void HttpServer::route_cached(RequestType method, const std::string &pattern,
+        const RouteHandler &handler, ExecPolicy policy)
+{
+    Router::Route route;
+    route.handler = handler;
+    route.policy = policy;
+    route.cacheable = true;
+    inter_->route(method, pattern, route);
+}
+
+void HttpServer::route_async(RequestType method, const std::string &pattern,
+        const AsyncHandler &handler, ExecPolicy policy)
+{
+    Router::Route route;
+    route.async_handler = handler;
+    route.policy = policy;
+    inter_->route(method, pattern, route);
+}
+
+void HttpServer::websocket(const std::string &pattern,
+        const WebSocketHandler &handler)
+{
+    Router::Route route;
+    route.websocket = std::make_shared<const WebSocketHandler>(handler);
+    route.policy = RUN_INLINE;
+    inter_->route(HTTP_GET, pattern, route);
+}
+
+void HttpServer::broadcast(const std::string &topic, const std::string &data,
+        bool binary)
+{
+    inter_->broadcast(topic, data, binary);
+}
+
+void HttpServer::set_body_handler(BodyHandler handler)
+{
+    inter_->set_body_handler(handler);
+}
+
+void HttpServer::set_max_body_size(uint64_t max_bytes)
+{
+    inter_->set_max_body_size(max_bytes);
+}
+
+void HttpServer::set_keepalive(int max_requests)
+{
+    inter_->set_keepalive(max_requests);
+}
+
+void HttpServer::set_pool_queue(size_t max_queued, OverloadPolicy policy,
+        int retry_after)
+{
+    inter_->set_pool_queue(max_queued, policy, retry_after);
+}
+
+void HttpServer::set_pool_delay_control(int target_ms, int interval_ms)
+{
+    inter_->set_pool_delay_control(target_ms, interval_ms);
+}
+
+void HttpServer::set_executor(const OffloadExecutor &executor)
+{
+    inter_->set_executor(executor);
+}
+
+void HttpServer::add_static_dir(const std::string &url_prefix, 
+        const std::string &dir)
+{
+    inter_->add_static_dir(url_prefix, dir);
+}
+
+void HttpServer::set_file_cache(size_t max_files)
+{
+    inter_->set_file_cache(max_files);
+}
+
+void HttpServer::enable_etags(bool on)
+{
+    inter_->enable_etags(on);
+}
+
+void HttpServer::enable_http2(bool on)
+{
+    inter_->enable_http2(on);
+}
+
+void HttpServer::enable_response_cache(size_t max_bytes)
+{
+    inter_->enable_response_cache(max_bytes);
+}
+
+#ifdef HTTP_COMPRESSION
+void HttpServer::set_compression_min_size(size_t min_size)
+{
+    inter_->set_compression_min_size(min_size);
+}
+#endif
+
+void HttpServer::enable_metrics(const std::string &path)
+{
+    inter_->enable_metrics(path);
+}
+
+void HttpServer::set_timeouts(int idle, int header, int body, int write)
+{
+    inter_->set_timeouts(idle, header, body, write);
+}
+
 void HttpServer::run()
 {
     inter_->run();
 }
 
+void HttpServer::start()
+{
+    inter_->start();
+}
+
 void HttpServer::stop()
 {
-    inter_->stop();
+    inter_->stop(nullptr);
+}
+
+void HttpServer::stop(std::function<void ()> on_stopped)
+{
+    inter_->stop(on_stopped);
 }
 
-void HttpServer::stat()
+ServerStats HttpServer::stat() const
 {
-    //not implement
+    return inter_->stat();
 }
 
 }
@@ -1,7 +1,21 @@
 #ifndef _HTTP_SERVER_
 #define _HTTP_SERVER_
 #include <unordered_map>
+#include <algorithm>
+#include <functional>
+#include <vector>
 #include <string>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <strings.h>
+#include <arena.hpp>
+#include <header_map.hpp>
+#include <metrics.hpp>
+
+namespace boost { namespace asio { class io_context; } }
 
 namespace tws{
 
@@ -20,49 +34,271 @@ enum HttpCode {
     HTTP_503,
     HTTP_508, // unused by HTTP, means recursive thread switch, for internal use 
     HTTP_501,
+    HTTP_400,
+    HTTP_413,
+    HTTP_405,
+    HTTP_500,
+    HTTP_304,   // made by server for conditional GET, see Response::set_etag()
+    HTTP_206,   // made by server for Range requests
+    HTTP_416,
     HTTP_END,
 };
 
+// where a route's handler runs
+enum ExecPolicy {
+    RUN_INLINE,         // in network I/O thread, must not block
+    RUN_IN_POOL,        // in thread pool, may block
+    RUN_IN_POOL_HIGH,   // same, ahead of others and not shed on overload,
+                        // for health checks and the like
+};
+
+// what happens to a request for thread pool when its queue is full
+enum OverloadPolicy {
+    REJECT_NEW,     // new request gets 503
+    SHED_OLDEST,    // request waiting longest gets 503, new one is queued
+};
+
+// values of ":name" and "*name" segments of the matched route,
+// pointing into the request, names into the route
+struct RouteParams
+{
+    enum { kMax = 8 };
+    StrRef names[kMax];
+    StrRef values[kMax];
+    int count;
+};
+
 class Request
 {
     friend class HttpConnection;
-    std::unordered_map<std::string, std::string> headers_;
+
     RequestType type_;
-    std::string path_;
+    int version_; // minor version, 0 for HTTP/1.0, 1 for HTTP/1.1 and HTTP/2
+    StrRef method_;
+    StrRef uri_;
+    StrRef url_path_;
+    StrRef query_;
+    HeaderMap header_map_;
+    RouteParams params_;
     std::string postdata_;
+    bool body_streamed_;
     bool threaded_;
+
+    // copies for path() and headers(), only made on first call
+    mutable std::string path_;
+    mutable std::unordered_map<std::string, std::string> headers_;
+    mutable bool path_copied_;
+    mutable bool headers_copied_;
+
+    explicit Request(Arena *arena);
     void clear();
+    // uri_ and its path and query
+    void set_uri(StrRef uri);
 
 public:
-    const std::string &path() const { return path_;}
+    // slices of the receive buffer, no allocation
+    StrRef method() const { return method_; }
+    StrRef uri() const { return uri_; }          // path with query string
+    StrRef url_path() const { return url_path_; } // path before '?'
+    StrRef query() const { return query_; }      // after '?', may be empty
+    // case-insensitive, returns empty StrRef if not found
+    StrRef header(const char *name) const { return header_map_.get(name); }
+    StrRef header(KnownHeader h) const { return header_map_.get(h); }
+    bool has_header(const char *name) const { return header_map_.has(name); }
+    size_t header_count() const { return header_map_.size(); }
+    // segment of url_path() matched by ":name" or "*name" of the route,
+    // empty if none
+    StrRef param(const char *name) const;
+    StrRef header_name(size_t i) const { return header_map_[i].first; }
+    StrRef header_value(size_t i) const { return header_map_[i].second; }
+
+    // empty if body was given to a BodySink
     const std::string &postdata() const { return postdata_;}
+    bool body_streamed() const { return body_streamed_; }
     RequestType type() const { return type_; }
+    int version() const { return version_; }
     bool in_threadpool() const { return threaded_; }
-    const std::unordered_map<std::string, std::string> &headers() const {return headers_;}
+
+    // same as uri(), copied into a string 
+    const std::string &path() const;
+    // copied into a map, keys are in the case client sent
+    const std::unordered_map<std::string, std::string> &headers() const;
+};
+
+// pieces of a streamed response body are written into it
+class BodyStream
+{
+    friend class HttpConnection;
+    std::string &buf_;
+    explicit BodyStream(std::string &buf) : buf_(buf) {}
+
+public:
+    void write(const char *data, size_t len) { buf_.append(data, len); }
+    void write(const std::string &data) { buf_.append(data); }
 };
 
+// called each time the previous piece has been sent to client,
+// returns false after writing the last piece
+typedef std::function<bool (BodyStream&)> StreamProducer;
+
 class Response
 {
     friend class HttpConnection;
-    std::unordered_map<std::string, std::string> headers_;
+
+    // names and values are copied into arena
+    Arena *arena_;
+    HeaderMap headers_;
     std::string body_;
+    std::string file_;
+    StreamProducer stream_;
+    uint64_t stream_length_;
+    int cache_ttl_;
+
+    explicit Response(Arena *arena);
     void clear();
+    void set_header(const char *key, size_t klen, const char *value, size_t vlen);
 #ifdef HTTP_COMPRESSION
     int compression_;
 #endif
 
 public:
     void set_header(const std::string& key, const std::string &value);
+    void set_header(const char *key, const char *value);
     void set_header(const std::string& key, long value);
     void set_body(const std::string &body) { body_ = body;}
+    // send a file as body with sendfile(2), responds 404 if cannot open
+    void set_file(const std::string &filepath) { file_ = filepath;}
+    // send body in pieces made by producer, with chunked transfer 
+    // encoding (or until close for HTTP/1.0). the producer runs in the 
+    // same thread handler runs, next piece is asked only after last one 
+    // is sent, so at most one piece is held in memory
+    // length is of the whole body if known in advance, it lets Range
+    // requests be answered with the part they ask for
+    static const uint64_t kUnknownLength = UINT64_MAX;
+    void set_stream(const StreamProducer &producer, 
+            uint64_t length = kUnknownLength)
+    { stream_ = producer; stream_length_ = length;}
+
+    // validators of the body. a 200 response to GET or HEAD is turned
+    // into 304 without body when If-None-Match or If-Modified-Since of
+    // the request matches them, and If-Range is checked against them.
+    // files get both from their stat() unless set here, other bodies
+    // get an ETag from a hash of them if HttpServer::enable_etags() is on.
+    // tag is quoted here if it is not, W/"..." makes a weak one
+    void set_etag(const std::string &tag);
+    void set_last_modified(time_t mtime);
+    // let the server keep this response for ttl_ms and send it to
+    // requests with the same method, uri and Accept-Encoding without
+    // calling the handler, see HttpServer::route_cached().
+    // only 200 responses with a body set by set_body() are kept, not
+    // those setting Set-Cookie, Date or Connection. requests with Range
+    // or conditional headers don't use the cache
+    void set_cache_ttl(int ttl_ms) { cache_ttl_ = ttl_ms;}
 
-    // 0 to 9, 0 means no compression support
+    // 0 to 9, 0 means no compression support, default 5
+    // gzip or deflate is chosen by request's Accept-Encoding
 #ifdef HTTP_COMPRESSION
     void set_compression(int level = 0);
 #endif
 };
 
 typedef int (*RequestHandler)(Response&, const Request&);
+// handler of a route, any callable. may return HTTP_SWITCH_THREAD too,
+// but RUN_IN_POOL saves calling it twice
+typedef std::function<int (Response&, const Request&)> RouteHandler;
+
+// receives request body in pieces as they arrive, len 0 means end of body,
+// return false to abort the request and close the connection.
+// it is not called with len 0 if the request fails before body ends
+typedef std::function<bool (const char *data, size_t len)> BodySink;
+
+struct ResponderState;
+
+// handle of a response being made by an AsyncHandler. copies share it,
+// the response is sent when finish() is called, from any thread.
+// request and response stay valid until then. if all copies are gone
+// without finish(), HTTP_500 is sent
+class Responder
+{
+    friend class HttpConnection;
+    std::shared_ptr<ResponderState> state_;
+    explicit Responder(const std::shared_ptr<ResponderState> &state)
+        : state_(state) {}
+
+public:
+    const Request &request() const;
+    Response &response() const;
+    // only first call counts
+    void finish(int code) const;
+    // event loop of the connection, for timers and sockets used
+    // in making the response, their handlers run in network I/O thread
+    boost::asio::io_context &io_context() const;
+};
+
+// handler finishing its response later, without holding a thread
+// while it waits for something, see HttpServer::route_async()
+typedef std::function<void (Responder)> AsyncHandler;
+
+// called in network I/O thread when headers of a request with body 
+// arrived, before the body is read. may set sink to get the body in pieces
+// instead of Request::postdata(), RequestHandler is called after body ends.
+// return HTTP_200 to go on, other codes reject the request at once
+// (e.g. HTTP_413), without reading its body
+typedef int (*BodyHandler)(BodySink& sink, const Request&);
+
+struct WebSocketState;
+
+// handle of a WebSocket connection, copies refer to the same one. may
+// be kept and used from any thread, calls are carried out in its
+// network I/O thread and do nothing after the connection ended
+class WebSocket
+{
+    friend class HttpConnection;
+    friend class WsSession;
+    std::shared_ptr<WebSocketState> state_;
+    explicit WebSocket(const std::shared_ptr<WebSocketState> &state)
+        : state_(state) {}
+
+public:
+    // one message in one frame, TEXT must be UTF-8
+    void send(const std::string &data, bool binary = false) const;
+    // starts the closing handshake, messages still coming are dropped
+    void close(int code = 1000, const std::string &reason = "") const;
+    // messages of HttpServer::broadcast() to topic are sent to it too
+    void subscribe(const std::string &topic) const;
+    void unsubscribe(const std::string &topic) const;
+    // event loop of the connection, handlers run in its thread
+    boost::asio::io_context &io_context() const;
+};
+
+// what a websocket route does with its connections, see
+// HttpServer::websocket(). callbacks run in network I/O thread
+struct WebSocketHandler
+{
+    // handshake request, valid during the call only. return HTTP_200 to
+    // accept, other codes are sent as response instead
+    std::function<int (WebSocket ws, const Request &req)> on_open;
+    // a whole message, fragmented ones are joined first
+    std::function<void (WebSocket ws, const std::string &msg, bool binary)> on_message;
+    // once, with the code of peer's CLOSE, or 1006 if the connection
+    // ended without one
+    std::function<void (WebSocket ws, int code)> on_close;
+    // seconds of silence before a PING, one more without any frame from
+    // peer closes the connection. 0 means never, default 30
+    int ping_interval;
+    // larger messages close the connection with 1009, default 1M
+    size_t max_message;
+    // bytes waiting to be sent at most, a connection which can't keep
+    // up with what is sent to it is closed. default 16M
+    size_t max_queued;
+
+    WebSocketHandler()
+        : ping_interval(30), max_message(1 << 20), max_queued(16 << 20) {}
+};
+
+// runs f somewhere else than the network I/O thread, e.g. posts it to
+// a thread pool of the host application. it must run every f it gets
+typedef std::function<void (std::function<void ()> f)> OffloadExecutor;
 
 class HttpServerInter;
 class HttpServer
@@ -70,28 +306,177 @@ class HttpServer
     HttpServerInter *inter_;
     
 public:
+    // port: TCP port listened on all IPv4 addresses, 0 for none (see
+    //   listen())
+    // threadnum: size of thread-pool for HTTP_SWITCH_THREAD requests
+    // iothreadnum: number of network I/O threads, each one has its own
+    //   event loop and SO_REUSEPORT listening socket
     HttpServer(unsigned short port,
+            RequestHandler main_handler = &default_handler, int threadnum = 0,
+            int iothreadnum = 1);
+    // embedded mode: the server runs on event loops of the host
+    // application, in the threads which run them, with no thread of its
+    // own but a pool of threadnum. each io is like an I/O thread above,
+    // with its own listening socket, and must be run by one thread at a
+    // time. start() and stop() replace run(), the server may be destroyed
+    // after on_stopped of stop() is called, or when ios no longer run
+    // and before they are destroyed
+    HttpServer(boost::asio::io_context &io, unsigned short port,
             RequestHandler main_handler = &default_handler, int threadnum = 0);
+    HttpServer(const std::vector<boost::asio::io_context *> &ios,
+            unsigned short port, RequestHandler main_handler = &default_handler,
+            int threadnum = 0);
+    ~HttpServer();
 
+    // more sockets to listen on, before run() or start(). connections of all of
+    // them go to the same handlers, routes and thread pool.
+    // address is IPv4 or IPv6, e.g. "127.0.0.1" or "::", an IPv6 one
+    // takes IPv6 only so IPv4 may be added on the same port.
+    // throws boost::system::system_error if it can't be bound
+    void listen(const std::string &address, unsigned short port);
+    // Unix domain stream socket at path, or in the abstract namespace
+    // if path starts with '@'. a socket file nobody answers on is
+    // replaced, the file is removed when the server is destroyed
+    void listen_unix(const std::string &path);
+
+    // called for requests no route matches
     void set_handler(RequestHandler handler);
 
+    // handler for requests whose url_path() matches pattern, e.g.
+    // "/users/:id", "/files/*path", see Router. method HTTP_INVALID 
+    // means any method, HEAD is answered by GET route if it has none.
+    // all routes must be added before run() or start()
+    void route(RequestType method, const std::string &pattern,
+            const RouteHandler &handler, ExecPolicy policy = RUN_INLINE);
+    // same, and its requests go through the response cache (see
+    // enable_response_cache()): while one response for a key is made,
+    // other requests for it wait and get the same one if the handler
+    // called Response::set_cache_ttl(), or call the handler themselves
+    void route_cached(RequestType method, const std::string &pattern,
+            const RouteHandler &handler, ExecPolicy policy = RUN_INLINE);
+    // same as route() with a handler that returns before the response is made,
+    // e.g. after starting an asynchronous operation. policy tells
+    // where the handler itself is called
+    void route_async(RequestType method, const std::string &pattern,
+            const AsyncHandler &handler, ExecPolicy policy = RUN_INLINE);
+
+    // WebSocket endpoint on GET pattern (see route()). requests asking
+    // to upgrade get the handshake and their connection is given to
+    // handler, others get 400. HTTP/1.1 only, not on HTTP/2 streams
+    void websocket(const std::string &pattern, const WebSocketHandler &handler);
+    // sends a message to every WebSocket subscribed to topic. it is
+    // framed once and the same buffer is written to all of them.
+    // may be called from any thread
+    void broadcast(const std::string &topic, const std::string &data,
+            bool binary = false);
+
+    // optional, see BodyHandler
+    void set_body_handler(BodyHandler handler);
+
+    // requests with larger body are rejected with 413, before reading
+    // the body if Content-Length tells. default 16M, 0 means no limit
+    void set_max_body_size(uint64_t max_bytes);
+
+    // requests waiting for thread pool at most, 0 means its capacity of
+    // 1024 per thread. those over it get 503 with "Retry-After: 
+    // retry_after" seconds as policy tells, RUN_IN_POOL_HIGH ones are not
+    // counted. stream continuations (see BodyStream) always go first
+    void set_pool_queue(size_t max_queued, OverloadPolicy policy = REJECT_NEW,
+            int retry_after = 1);
+    // answer 503 to requests waiting in pool queue more than 2 * target_ms
+    // while the queue has not emptied for interval_ms (see CoDel).
+    // off by default, 0 turns it off
+    void set_pool_delay_control(int target_ms, int interval_ms = 100);
+    // RUN_IN_POOL and HTTP_SWITCH_THREAD requests go to executor instead
+    // of the thread pool, which then needs no threads. it queues them
+    // itself, so priorities and the limits above don't apply
+    void set_executor(const OffloadExecutor &executor);
+
+    // max requests served on one persistent connection, default 100
+    // 0 or 1 disables keep-alive
+    void set_keepalive(int max_requests);
+
+    // serve GET/HEAD requests under url_prefix from files in dir 
+    // before calling handler, e.g. add_static_dir("/download/", "/data/pub")
+    void add_static_dir(const std::string &url_prefix, const std::string &dir);
+    // max opened files kept for static files and Response::set_file(),
+    // default 256
+    void set_file_cache(size_t max_files);
+
+    // make an ETag from a hash of the body of 200 responses to GET and
+    // HEAD without one, see Response::set_etag(). off by default
+    void enable_etags(bool on = true);
+
+    // accept HTTP/2 without TLS (h2c) on the same port, from clients
+    // starting with its preface or asking by "Upgrade: h2c". requests of
+    // all streams of a connection go to the same routes, handlers and
+    // thread pool as HTTP/1 ones, at the same time. off by default
+    void enable_http2(bool on = true);
+
+    // keep responses of route_cached() routes which set
+    // Response::set_cache_ttl(), up to max_bytes of them. while one is
+    // being made, other requests for it wait and get the same response.
+    // off by default, 0 turns it off
+    void enable_response_cache(size_t max_bytes);
+
+#ifdef HTTP_COMPRESSION
+    // bodies smaller than this are sent uncompressed, default 256
+    void set_compression_min_size(size_t min_size);
+#endif
+
+    // serve counters from stat() in Prometheus text format on GET path,
+    // before static files and handler. off by default
+    void enable_metrics(const std::string &path = "/metrics");
+
+    // seconds a connection may wait for, 0 means no limit, it is closed
+    // when one passes. idle: next request on a kept connection, default 15
+    // header: whole request header from its first byte, default 10
+    // body: more of request body, default 30. write: response write to 
+    // make progress, default 30
+    void set_timeouts(int idle, int header, int body, int write);
+
+    // returns when stop() is called and everything is finished
     void run();
+    // embedded mode instead of run(), returns at once. the server serves
+    // while host runs its ios
+    void start();
 
-    void stop(); //not implement yet
+    // stops accepting, closes idle connections and lets requests in 
+    // progress finish, then run() returns with all threads joined.
+    // returns at once, can be called from any thread or handler
+    void stop();
+    // same, on_stopped is called when everything is finished, in a
+    // network I/O thread. only the first stop() counts
+    void stop(std::function<void ()> on_stopped);
 
-    void stat(); //not implement yet
+    // counters merged from all threads, cheap enough to poll
+    ServerStats stat() const;
 
     static int default_handler(Response& resp, const Request& req)
     {
         std::string body;
         std::string type;
         
-        // default callback will run in network I/O thread(single thread)  
+        // default callback will run in network I/O thread
+        // (single thread per connection)
         // but can switch to thread-pool if you think the callback will consume much time
         // use 'if (req.in_threadpool())' too see if calling from threadpool
-        if (req.path().substr(0, 7) == "/thread" && !req.in_threadpool())
+        if (req.uri().starts_with("/thread") && !req.in_threadpool())
             return HTTP_SWITCH_THREAD;
 
+        // body made piece by piece, sent with chunked transfer encoding
+        if (req.uri().starts_with("/stream")) {
+            int line = 0;
+            resp.set_header("Content-Type", "text/plain");
+            resp.set_stream([line](BodyStream &out) mutable {
+                char buf[32];
+                snprintf(buf, sizeof(buf), "line %d\n", line);
+                out.write(buf, ::strlen(buf));
+                return ++line < 1000;
+            });
+            return HTTP_200;
+        }
+
         switch(req.type()) {
             case HTTP_GET:
                 type = "GET";
@@ -128,16 +513,79 @@ public:
 int main(int argc, char *argv[])
 {
     int port = 8000;
-    printf("Usage: %s [port=8000]\n", argv[0]);
+    int iothreads = 1;
+    printf("Usage: %s [port=8000] [iothreads=1] [static_dir] [unix_socket]\n", argv[0]);
     printf("try 'curl http://localhost:port/xxx/\n");
     printf(" or 'curl http://localhost:port/thread/xxx/\n");
     printf(" or 'curl -d \"MSG\" http://localhost:port/xxx/\n");
     printf(" or 'curl -d \"MSG\" http://localhost:port/thread/xxx/\n");
+    printf(" or 'curl http://localhost:port/static/file' if static_dir is set\n");
+    printf(" or 'curl --unix-socket unix_socket http://localhost/xxx' if it is set\n");
+    printf(" or 'curl http://localhost:port/metrics'\n");
+    printf(" or 'curl http://localhost:port/hello/name'\n");
+    printf(" or 'curl http://localhost:port/pool/xxx'\n");
+    printf(" or 'curl http://localhost:port/later/ms'\n");
+    printf(" or 'curl http://localhost:port/report/xxx'\n");
+    printf(" or 'curl --http2-prior-knowledge http://localhost:port/xxx'\n");
+    printf(" or a WebSocket client on ws://localhost:port/chat\n");
     if (argc > 1)
         port = atoi(argv[1]);
+    if (argc > 2)
+        iothreads = atoi(argv[2]);
     
     // should catch execeptions if not sure the port is valid
-    tws::HttpServer http_server(port, &tws::HttpServer::default_handler, 4);
+    tws::HttpServer http_server(port, &tws::HttpServer::default_handler, 4,
+            iothreads);
+    if (argc > 3)
+        http_server.add_static_dir("/static/", argv[3]);
+    // same server for local clients, without the TCP stack
+    if (argc > 4)
+        http_server.listen_unix(argv[4]);
+    http_server.enable_metrics("/metrics");
+    // h2c by prior knowledge or Upgrade, HTTP/1 goes on as before
+    http_server.enable_http2();
+    // routes are matched before default_handler is called
+    http_server.route(tws::HTTP_GET, "/hello/:name",
+        [](tws::Response &resp, const tws::Request &req) {
+            resp.set_body("hello " + req.param("name").str() + "\n");
+            return tws::HTTP_200;
+        });
+    http_server.route(tws::HTTP_INVALID, "/pool/:job",
+        [](tws::Response &resp, const tws::Request &req) {
+            // runs in thread pool, may block
+            resp.set_body("from pool: " + req.param("job").str() + "\n");
+            return tws::HTTP_200;
+        }, tws::RUN_IN_POOL);
+    http_server.enable_response_cache(16 << 20);
+    http_server.route_cached(tws::HTTP_GET, "/report/:name",
+        [](tws::Response &resp, const tws::Request &req) {
+            // made at most once a second, requests meanwhile get a copy
+            resp.set_body("report " + req.param("name").str() + "\n");
+            resp.set_cache_ttl(1000);
+            return tws::HTTP_200;
+        }, tws::RUN_IN_POOL);
+    http_server.route_async(tws::HTTP_GET, "/later/:ms",
+        [](tws::Responder r) {
+            // responds when the timer fires, no thread waits for it
+            std::shared_ptr<boost::asio::steady_timer> timer =
+                std::make_shared<boost::asio::steady_timer>(r.io_context(),
+                    std::chrono::milliseconds(atoi(r.request().param("ms").str().c_str())));
+            timer->async_wait([r, timer](const boost::system::error_code &) {
+                r.response().set_body("later\n");
+                r.finish(tws::HTTP_200);
+            });
+        });
+    // everyone connected gets what anyone sends
+    tws::WebSocketHandler chat;
+    chat.on_open = [](tws::WebSocket ws, const tws::Request &) {
+        ws.subscribe("chat");
+        return tws::HTTP_200;
+    };
+    chat.on_message = [&http_server](tws::WebSocket, const std::string &msg,
+            bool binary) {
+        http_server.broadcast("chat", msg, binary);
+    };
+    http_server.websocket("/chat", chat);
     http_server.run();
     return 0;
 }
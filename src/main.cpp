@@ -1,20 +1,84 @@
 #include <http_server.hpp>
+#include <boost/asio.hpp>
 #include <cstdio>
 #include <cstdlib>
 
 int main(int argc, char *argv[])
 {
     int port = 8000;
-    printf("Usage: %s [port=8000]\n", argv[0]);
+    int iothreads = 1;
+    printf("Usage: %s [port=8000] [iothreads=1] [static_dir] [unix_socket]\n", argv[0]);
     printf("try 'curl http://localhost:port/xxx/\n");
     printf(" or 'curl http://localhost:port/thread/xxx/\n");
     printf(" or 'curl -d \"MSG\" http://localhost:port/xxx/\n");
     printf(" or 'curl -d \"MSG\" http://localhost:port/thread/xxx/\n");
+    printf(" or 'curl http://localhost:port/static/file' if static_dir is set\n");
+    printf(" or 'curl --unix-socket unix_socket http://localhost/xxx' if it is set\n");
+    printf(" or 'curl http://localhost:port/metrics'\n");
+    printf(" or 'curl http://localhost:port/hello/name'\n");
+    printf(" or 'curl http://localhost:port/pool/xxx'\n");
+    printf(" or 'curl http://localhost:port/later/ms'\n");
+    printf(" or 'curl http://localhost:port/report/xxx'\n");
+    printf(" or 'curl --http2-prior-knowledge http://localhost:port/xxx'\n");
+    printf(" or a WebSocket client on ws://localhost:port/chat\n");
     if (argc > 1)
         port = atoi(argv[1]);
+    if (argc > 2)
+        iothreads = atoi(argv[2]);
     
     // should catch execeptions if not sure the port is valid
-    tws::HttpServer http_server(port, &tws::HttpServer::default_handler, 4);
+    tws::HttpServer http_server(port, &tws::HttpServer::default_handler, 4,
+            iothreads);
+    if (argc > 3)
+        http_server.add_static_dir("/static/", argv[3]);
+    // same server for local clients, without the TCP stack
+    if (argc > 4)
+        http_server.listen_unix(argv[4]);
+    http_server.enable_metrics("/metrics");
+    // h2c by prior knowledge or Upgrade, HTTP/1 goes on as before
+    http_server.enable_http2();
+    // routes are matched before default_handler is called
+    http_server.route(tws::HTTP_GET, "/hello/:name",
+        [](tws::Response &resp, const tws::Request &req) {
+            resp.set_body("hello " + req.param("name").str() + "\n");
+            return tws::HTTP_200;
+        });
+    http_server.route(tws::HTTP_INVALID, "/pool/:job",
+        [](tws::Response &resp, const tws::Request &req) {
+            // runs in thread pool, may block
+            resp.set_body("from pool: " + req.param("job").str() + "\n");
+            return tws::HTTP_200;
+        }, tws::RUN_IN_POOL);
+    http_server.enable_response_cache(16 << 20);
+    http_server.route_cached(tws::HTTP_GET, "/report/:name",
+        [](tws::Response &resp, const tws::Request &req) {
+            // made at most once a second, requests meanwhile get a copy
+            resp.set_body("report " + req.param("name").str() + "\n");
+            resp.set_cache_ttl(1000);
+            return tws::HTTP_200;
+        }, tws::RUN_IN_POOL);
+    http_server.route_async(tws::HTTP_GET, "/later/:ms",
+        [](tws::Responder r) {
+            // responds when the timer fires, no thread waits for it
+            std::shared_ptr<boost::asio::steady_timer> timer =
+                std::make_shared<boost::asio::steady_timer>(r.io_context(),
+                    std::chrono::milliseconds(atoi(r.request().param("ms").str().c_str())));
+            timer->async_wait([r, timer](const boost::system::error_code &) {
+                r.response().set_body("later\n");
+                r.finish(tws::HTTP_200);
+            });
+        });
+    // everyone connected gets what anyone sends
+    tws::WebSocketHandler chat;
+    chat.on_open = [](tws::WebSocket ws, const tws::Request &) {
+        ws.subscribe("chat");
+        return tws::HTTP_200;
+    };
+    chat.on_message = [&http_server](tws::WebSocket, const std::string &msg,
+            bool binary) {
+        http_server.broadcast("chat", msg, binary);
+    };
+    http_server.websocket("/chat", chat);
     http_server.run();
     return 0;
 }
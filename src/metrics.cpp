@@ -0,0 +1,166 @@
+#include <metrics.hpp>
+#include <cstring>
+#include <ctime>
+
+namespace {
+
+std::atomic<int> next_slot(0);
+
+inline void merge(uint64_t *dst, const std::atomic<uint64_t> *src, int n)
+{
+    for(int i = 0; i < n; i++)
+        dst[i] += src[i].load(std::memory_order_relaxed);
+}
+
+}
+
+namespace tws {
+
+int Histogram::bucket_of(uint64_t v)
+{
+    if (v < kSub)
+        return v;
+    int e = 63 - __builtin_clzll(v);
+    if (e > kMaxExp)
+        return kBuckets - 1;
+    return (e - kSubBits + 1) * kSub + ((v >> (e - kSubBits)) & (kSub - 1));
+}
+
+uint64_t Histogram::bucket_upper(int i)
+{
+    if (i < kSub)
+        return i;
+    int e = i / kSub + kSubBits - 1;
+    uint64_t lower = (uint64_t)(kSub + i % kSub) << (e - kSubBits);
+    return lower + ((uint64_t)1 << (e - kSubBits)) - 1;
+}
+
+Histogram::Histogram()
+    : count(0),
+      sum(0)
+{
+    ::memset(counts, 0, sizeof(counts));
+}
+
+uint64_t Histogram::percentile(double q) const
+{
+    if (count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(q * count);
+    if (rank >= count)
+        rank = count - 1;
+    uint64_t seen = 0;
+    for(int i = 0; i < kBuckets; i++) {
+        seen += counts[i];
+        if (seen > rank)
+            return bucket_upper(i);
+    }
+    return bucket_upper(kBuckets - 1);
+}
+
+ServerStats::ServerStats()
+{
+    connections_active = connections_accepted = connections_closed = 0;
+    timeouts = 0;
+    ::memset(requests, 0, sizeof(requests));
+    ::memset(responses, 0, sizeof(responses));
+    bytes_in = bytes_out = 0;
+    compress_in = compress_out = 0;
+    pool_tasks = pool_rejected = pool_shed = pool_queue_depth = 0;
+    cache_hits = cache_misses = cache_waits = 0;
+}
+
+StatSlot::StatSlot()
+    : accepted(0),
+      closed(0),
+      timeouts(0),
+      bytes_in(0),
+      bytes_out(0),
+      compress_in(0),
+      compress_out(0),
+      pool_tasks(0),
+      pool_rejected(0),
+      pool_shed(0),
+      cache_hits(0),
+      cache_misses(0),
+      cache_waits(0),
+      pool_wait_sum(0),
+      latency_sum(0)
+{
+    for(int i = 0; i < STAT_METHODS; i++)
+        requests[i].store(0, std::memory_order_relaxed);
+    for(int i = 0; i < STAT_CODES; i++)
+        responses[i].store(0, std::memory_order_relaxed);
+    for(int i = 0; i < Histogram::kBuckets; i++) {
+        pool_wait[i].store(0, std::memory_order_relaxed);
+        latency[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void StatSlot::record_pool_wait(uint64_t ns)
+{
+    add(pool_wait[Histogram::bucket_of(ns)]);
+    add(pool_wait_sum, ns);
+}
+
+void StatSlot::record_latency(uint64_t ns)
+{
+    add(latency[Histogram::bucket_of(ns)]);
+    add(latency_sum, ns);
+}
+
+Metrics::Metrics()
+    : slots_(new StatSlot[kMaxSlots])
+{
+}
+
+StatSlot &Metrics::local()
+{
+    // same index for a thread in all servers
+    thread_local int slot = next_slot.fetch_add(1) % kMaxSlots;
+    return slots_[slot];
+}
+
+void Metrics::collect(ServerStats &stats) const
+{
+    for(int i = 0; i < kMaxSlots; i++) {
+        const StatSlot &s = slots_[i];
+        stats.connections_accepted += s.accepted.load(std::memory_order_relaxed);
+        stats.connections_closed += s.closed.load(std::memory_order_relaxed);
+        stats.timeouts += s.timeouts.load(std::memory_order_relaxed);
+        merge(stats.requests, s.requests, STAT_METHODS);
+        merge(stats.responses, s.responses, STAT_CODES);
+        stats.bytes_in += s.bytes_in.load(std::memory_order_relaxed);
+        stats.bytes_out += s.bytes_out.load(std::memory_order_relaxed);
+        stats.compress_in += s.compress_in.load(std::memory_order_relaxed);
+        stats.compress_out += s.compress_out.load(std::memory_order_relaxed);
+        stats.pool_tasks += s.pool_tasks.load(std::memory_order_relaxed);
+        stats.pool_rejected += s.pool_rejected.load(std::memory_order_relaxed);
+        stats.pool_shed += s.pool_shed.load(std::memory_order_relaxed);
+        stats.cache_hits += s.cache_hits.load(std::memory_order_relaxed);
+        stats.cache_misses += s.cache_misses.load(std::memory_order_relaxed);
+        stats.cache_waits += s.cache_waits.load(std::memory_order_relaxed);
+        merge(stats.pool_wait.counts, s.pool_wait, Histogram::kBuckets);
+        stats.pool_wait.sum += s.pool_wait_sum.load(std::memory_order_relaxed);
+        merge(stats.handler_latency.counts, s.latency, Histogram::kBuckets);
+        stats.handler_latency.sum += s.latency_sum.load(std::memory_order_relaxed);
+    }
+    stats.pool_wait.count = stats.handler_latency.count = 0;
+    for(int i = 0; i < Histogram::kBuckets; i++) {
+        stats.pool_wait.count += stats.pool_wait.counts[i];
+        stats.handler_latency.count += stats.handler_latency.counts[i];
+    }
+    // closes may be seen before their accepts, as slots are read one by one
+    stats.connections_active =
+        stats.connections_accepted > stats.connections_closed
+        ? stats.connections_accepted - stats.connections_closed : 0;
+}
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+}
@@ -0,0 +1,122 @@
+#ifndef _METRICS_HPP_
+#define _METRICS_HPP_
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+namespace tws{
+
+/* HDR-style histogram of durations in nanoseconds. values under 16 have
+ * their own buckets, above that each power of two is split into 16
+ * linear buckets, so a value is known within 1/16. up to about 137s,
+ * bigger ones are counted in the last bucket */
+class Histogram
+{
+public:
+    enum {
+        kSubBits = 4,
+        kSub = 1 << kSubBits,
+        kMaxExp = 36,
+        kBuckets = (kMaxExp - kSubBits + 2) * kSub,
+    };
+
+    static int bucket_of(uint64_t v);
+    // biggest value falling in bucket i
+    static uint64_t bucket_upper(int i);
+
+    uint64_t counts[kBuckets];
+    uint64_t count;
+    uint64_t sum;
+
+    Histogram();
+    // value at quantile q (0 to 1), upper bound of its bucket
+    uint64_t percentile(double q) const;
+};
+
+// counters are indexed by these, enough for RequestType and HttpCode
+const int STAT_METHODS = 8;
+const int STAT_CODES = 32;
+
+// counters of a server merged from all threads, see HttpServer::stat()
+struct ServerStats
+{
+    uint64_t connections_active;
+    uint64_t connections_accepted;
+    uint64_t connections_closed;
+    uint64_t timeouts;                  // connections closed by a timeout
+    uint64_t requests[STAT_METHODS];    // by RequestType
+    uint64_t responses[STAT_CODES];     // by HttpCode
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    // body sizes before and after compression, of compressed responses
+    uint64_t compress_in;
+    uint64_t compress_out;
+    uint64_t pool_tasks;
+    uint64_t pool_rejected;     // 503 as queue was full
+    uint64_t pool_shed;         // 503 after waiting in queue
+    uint64_t pool_queue_depth;
+    uint64_t cache_hits;        // responses sent from response cache
+    uint64_t cache_misses;      // requests not found in it
+    uint64_t cache_waits;       // requests waiting for one being made
+    Histogram pool_wait;        // from push to thread pool till run
+    Histogram handler_latency;  // time spent in RequestHandler
+
+    ServerStats();
+    double compression_ratio() const
+    { return compress_in ? (double)compress_out / compress_in : 1.0; }
+};
+
+/* counters updated by one thread. each thread takes its own slot, so
+ * updating is a relaxed add on a cache line no other thread writes */
+struct StatSlot
+{
+    std::atomic<uint64_t> accepted;
+    std::atomic<uint64_t> closed;
+    std::atomic<uint64_t> timeouts;
+    std::atomic<uint64_t> requests[STAT_METHODS];
+    std::atomic<uint64_t> responses[STAT_CODES];
+    std::atomic<uint64_t> bytes_in;
+    std::atomic<uint64_t> bytes_out;
+    std::atomic<uint64_t> compress_in;
+    std::atomic<uint64_t> compress_out;
+    std::atomic<uint64_t> pool_tasks;
+    std::atomic<uint64_t> pool_rejected;
+    std::atomic<uint64_t> pool_shed;
+    std::atomic<uint64_t> cache_hits;
+    std::atomic<uint64_t> cache_misses;
+    std::atomic<uint64_t> cache_waits;
+    std::atomic<uint64_t> pool_wait[Histogram::kBuckets];
+    std::atomic<uint64_t> pool_wait_sum;
+    std::atomic<uint64_t> latency[Histogram::kBuckets];
+    std::atomic<uint64_t> latency_sum;
+    char pad_[64];
+
+    StatSlot();
+    void add(std::atomic<uint64_t> &counter, uint64_t n = 1)
+    { counter.fetch_add(n, std::memory_order_relaxed); }
+    void record_pool_wait(uint64_t ns);
+    void record_latency(uint64_t ns);
+};
+
+class Metrics
+{
+    // threads beyond this share slots, which stays correct but may contend
+    static const int kMaxSlots = 64;
+    std::unique_ptr<StatSlot[]> slots_;
+
+public:
+    Metrics();
+
+    // slot of calling thread
+    StatSlot &local();
+    // sums all slots, gauges are left for caller
+    void collect(ServerStats &stats) const;
+};
+
+// monotonic clock in nanoseconds
+uint64_t now_ns();
+
+}
+
+#endif
@@ -0,0 +1,45 @@
+#include <mpsc_queue.hpp>
+
+namespace tws {
+
+MpscQueue::MpscQueue()
+    : head_(&stub_),
+      tail_(&stub_)
+{
+}
+
+void MpscQueue::push(MpscNode *node)
+{
+    node->mpsc_next_.store(NULL, std::memory_order_relaxed);
+    MpscNode *prev = head_.exchange(node, std::memory_order_acq_rel);
+    // queue is cut here till prev is linked, pop() sees it empty meanwhile
+    prev->mpsc_next_.store(node, std::memory_order_release);
+}
+
+MpscNode *MpscQueue::pop()
+{
+    MpscNode *tail = tail_;
+    MpscNode *next = tail->mpsc_next_.load(std::memory_order_acquire);
+    if (tail == &stub_) {
+        if (next == NULL)
+            return NULL;
+        tail_ = tail = next;
+        next = next->mpsc_next_.load(std::memory_order_acquire);
+    }
+    if (next) {
+        tail_ = next;
+        return tail;
+    }
+    if (tail != head_.load(std::memory_order_acquire))
+        return NULL;
+    // tail is the last one, stub goes behind it so it can be taken
+    push(&stub_);
+    next = tail->mpsc_next_.load(std::memory_order_acquire);
+    if (next) {
+        tail_ = next;
+        return tail;
+    }
+    return NULL;
+}
+
+}
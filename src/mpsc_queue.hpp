@@ -0,0 +1,44 @@
+#ifndef _MPSC_QUEUE_HPP_
+#define _MPSC_QUEUE_HPP_
+#include <atomic>
+#include <cstddef>
+
+namespace tws{
+
+/* something queued in a MpscQueue, linked in place so pushing never
+ * allocates. it may be in one queue at a time */
+class MpscNode
+{
+    friend class MpscQueue;
+    std::atomic<MpscNode *> mpsc_next_;
+
+public:
+    MpscNode() : mpsc_next_(NULL) {}
+};
+
+/* unbounded intrusive multi-producer single-consumer queue
+ * (D. Vyukov's algorithm). push is one exchange and never waits,
+ * pop may see nothing while a push is half done, the pusher has to
+ * tell the consumer to look again then, see HttpReactor::complete() */
+class MpscQueue
+{
+    std::atomic<MpscNode *> head_;  // last pushed
+    char pad_[64];
+    MpscNode *tail_;                // next to pop, consumer only
+    MpscNode stub_;
+
+    MpscQueue(const MpscQueue&);
+    MpscQueue &operator=(const MpscQueue&);
+
+public:
+    MpscQueue();
+
+    // any thread
+    void push(MpscNode *node);
+    // consumer thread only, NULL if empty
+    MpscNode *pop();
+};
+
+}
+
+#endif
@@ -0,0 +1,255 @@
+#include <request_parser.hpp>
+#include <cstring>
+#include <cctype>
+
+namespace {
+
+inline bool is_space(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+// tchar of RFC 7230, what a header name is made of
+inline bool is_token(char c)
+{
+    return isalnum((unsigned char)c) || (c != 0 && ::strchr("!#$%&'*+-.^_`|~", c));
+}
+
+}
+
+namespace tws {
+
+RequestParser::RequestParser(size_t max_header_size, size_t max_headers)
+    : max_header_size_(max_header_size),
+      max_headers_(max_headers)
+{
+    headers_.reserve(16);
+    reset();
+}
+
+void RequestParser::reset()
+{
+    state_ = kRequestLine;
+    line_ = 0;
+    scan_ = 0;
+    method_.off = method_.len = 0;
+    uri_.off = uri_.len = 0;
+    version_ = 1;
+    headers_.clear();
+    header_size_ = 0;
+}
+
+int RequestParser::parse(const char *buf, size_t len)
+{
+    while (state_ != kFinished) {
+        const char *nl = (const char *)::memchr(buf + scan_, '\n', len - scan_);
+        if (nl == NULL) {
+            scan_ = len;
+            return len > max_header_size_ ? kError : kNeedMore;
+        }
+
+        size_t eol = nl - buf;
+        if (eol >= max_header_size_)
+            return kError;
+        // both "\r\n" and bare "\n" end a line
+        size_t end = eol;
+        if (end > line_ && buf[end - 1] == '\r')
+            end--;
+
+        int ret = (state_ == kRequestLine)
+            ? parse_request_line(buf, line_, end)
+            : parse_header_line(buf, line_, end);
+        if (ret < 0)
+            return kError;
+
+        line_ = scan_ = eol + 1;
+    }
+    header_size_ = line_;
+    return kDone;
+}
+
+int RequestParser::parse_request_line(const char *buf, size_t begin, size_t end)
+{
+    // empty lines before request line should be ignored
+    if (begin == end)
+        return 0;
+
+    const char *line = buf + begin;
+    size_t n = end - begin;
+    const char *sp1 = (const char *)::memchr(line, ' ', n);
+    if (sp1 == NULL || sp1 == line)
+        return -1;
+    const char *uri = sp1 + 1;
+    const char *sp2 = (const char *)::memchr(uri, ' ', line + n - uri);
+    if (sp2 == NULL || sp2 == uri)
+        return -1;
+    const char *ver = sp2 + 1;
+    if (line + n - ver != 8 || ::memcmp(ver, "HTTP/1.", 7) != 0
+            || ver[7] < '0' || ver[7] > '9')
+        return -1;
+
+    method_.off = begin;
+    method_.len = sp1 - line;
+    uri_.off = uri - buf;
+    uri_.len = sp2 - uri;
+    version_ = ver[7] - '0';
+    state_ = kHeaderLine;
+    return 0;
+}
+
+int RequestParser::parse_header_line(const char *buf, size_t begin, size_t end)
+{
+    if (begin == end) {
+        // empty line, end of headers
+        state_ = kFinished;
+        return 0;
+    }
+
+    const char *line = buf + begin;
+    // obsolete line folding is rejected
+    if (is_space(*line) || headers_.size() >= max_headers_)
+        return -1;
+    const char *colon = (const char *)::memchr(line, ':', end - begin);
+    if (colon == NULL)
+        return -1;
+
+    // no whitespace before the colon (RFC 7230 3.2.4), a proxy may
+    // read "Transfer-Encoding :" as another header than we do
+    const char *nend = colon;
+    if (nend == line)
+        return -1;
+    for(const char *p = line; p < nend; p++) {
+        if (!is_token(*p))
+            return -1;
+    }
+
+    const char *v = colon + 1;
+    const char *vend = buf + end;
+    while (v < vend && is_space(*v))
+        v++;
+    while (vend > v && is_space(vend[-1]))
+        vend--;
+
+    Header h;
+    h.name.off = begin;
+    h.name.len = nend - line;
+    h.value.off = v - buf;
+    h.value.len = vend - v;
+    headers_.push_back(h);
+    return 0;
+}
+
+ChunkedDecoder::ChunkedDecoder()
+{
+    reset();
+}
+
+void ChunkedDecoder::reset()
+{
+    state_ = kSize;
+    remain_ = 0;
+    digits_ = 0;
+}
+
+int ChunkedDecoder::next(const char *buf, size_t len, size_t &pos,
+        const char *&data, size_t &data_len)
+{
+    while (pos < len) {
+        char c = buf[pos];
+        switch (state_) {
+        case kSize:
+            if (isxdigit((unsigned char)c)) {
+                // 15 hex digits at most, no overflow
+                if (++digits_ > 15)
+                    return kError;
+                remain_ = remain_ * 16 + (isdigit((unsigned char)c) 
+                        ? c - '0' : (tolower(c) - 'a' + 10));
+            } else if (digits_ == 0) {
+                return kError;
+            } else if (c == ';' || is_space(c)) {
+                state_ = kExtension;
+            } else if (c == '\r') {
+                state_ = kSizeLF;
+            } else if (c == '\n') {
+                state_ = remain_ ? kChunkData : kTrailer;
+            } else {
+                return kError;
+            }
+            pos++;
+            break;
+        case kExtension:
+            // chunk extensions are ignored
+            if (c == '\r')
+                state_ = kSizeLF;
+            else if (c == '\n')
+                state_ = remain_ ? kChunkData : kTrailer;
+            pos++;
+            break;
+        case kSizeLF:
+            if (c != '\n')
+                return kError;
+            state_ = remain_ ? kChunkData : kTrailer;
+            pos++;
+            break;
+        case kChunkData: {
+            size_t n = len - pos;
+            if (n > remain_)
+                n = remain_;
+            data = buf + pos;
+            data_len = n;
+            pos += n;
+            remain_ -= n;
+            if (remain_ == 0)
+                state_ = kDataCR;
+            return kData;
+        }
+        case kDataCR:
+            if (c == '\r') {
+                state_ = kDataLF;
+            } else if (c == '\n') {
+                state_ = kSize;
+                digits_ = 0;
+            } else {
+                return kError;
+            }
+            pos++;
+            break;
+        case kDataLF:
+            if (c != '\n')
+                return kError;
+            state_ = kSize;
+            digits_ = 0;
+            pos++;
+            break;
+        case kTrailer:
+            // empty line ends the body, trailer fields are ignored
+            if (c == '\r') {
+                state_ = kTrailerLF;
+            } else if (c == '\n') {
+                state_ = kFinished;
+            } else {
+                state_ = kTrailerLine;
+            }
+            pos++;
+            break;
+        case kTrailerLine:
+            if (c == '\n')
+                state_ = kTrailer;
+            pos++;
+            break;
+        case kTrailerLF:
+            if (c != '\n')
+                return kError;
+            state_ = kFinished;
+            pos++;
+            break;
+        case kFinished:
+            return kDone;
+        }
+        if (state_ == kFinished)
+            return kDone;
+    }
+    return state_ == kFinished ? kDone : kNeedMore;
+}
+
+}
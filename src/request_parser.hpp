@@ -0,0 +1,114 @@
+#ifndef _REQUEST_PARSER_HPP_
+#define _REQUEST_PARSER_HPP_
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace tws{
+
+/* Resumable HTTP/1.x request header parser.
+ * Works on the caller's buffer and only records offsets into it, so
+ * nothing is copied. Each call goes on from where the last one stopped,
+ * every byte is scanned once however the request is fragmented.
+ * The buffer may be moved between calls as long as the request start
+ * is passed again, all offsets are relative to it. */
+class RequestParser
+{
+public:
+    enum Result {
+        kError = -1,
+        kDone = 0,
+        kNeedMore = 1,
+    };
+
+    struct Slice {
+        uint32_t off;
+        uint32_t len;
+    };
+
+    struct Header {
+        Slice name;
+        Slice value;
+    };
+
+    RequestParser(size_t max_header_size = 8192, size_t max_headers = 64);
+
+    void reset();
+
+    // buf points to the start of request, len is bytes available so far
+    int parse(const char *buf, size_t len);
+
+    const Slice &method() const { return method_; }
+    const Slice &uri() const { return uri_; }
+    // minor version, 0 for HTTP/1.0, 1 for HTTP/1.1
+    int version() const { return version_; }
+    const std::vector<Header> &headers() const { return headers_; }
+    // bytes of request line and headers, including the empty line
+    size_t header_size() const { return header_size_; }
+
+private:
+    enum State {
+        kRequestLine,
+        kHeaderLine,
+        kFinished,
+    };
+
+    int parse_request_line(const char *buf, size_t begin, size_t end);
+    int parse_header_line(const char *buf, size_t begin, size_t end);
+
+    size_t max_header_size_;
+    size_t max_headers_;
+
+    int state_;
+    size_t line_;   // start of current line
+    size_t scan_;   // where to go on searching for '\n'
+
+    Slice method_;
+    Slice uri_;
+    int version_;
+    std::vector<Header> headers_;
+    size_t header_size_;
+};
+
+/* Decoder of "Transfer-Encoding: chunked" request bodies.
+ * Resumable like RequestParser, chunk data is handed out in place,
+ * so input bytes can be dropped once next() returned them. */
+class ChunkedDecoder
+{
+public:
+    enum Result {
+        kError = -1,
+        kDone = 0,      // last chunk and trailers consumed
+        kNeedMore = 1,  // all input consumed
+        kData = 2,      // a piece of data is returned
+    };
+
+    ChunkedDecoder();
+    void reset();
+
+    // decodes buf[pos, len), pos is advanced past what's consumed
+    int next(const char *buf, size_t len, size_t &pos,
+            const char *&data, size_t &data_len);
+
+private:
+    enum State {
+        kSize,
+        kExtension,
+        kSizeLF,
+        kChunkData,
+        kDataCR,
+        kDataLF,
+        kTrailer,
+        kTrailerLine,
+        kTrailerLF,
+        kFinished,
+    };
+
+    int state_;
+    uint64_t remain_;
+    int digits_;
+};
+
+}
+
+#endif
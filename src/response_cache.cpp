@@ -0,0 +1,92 @@
+#include <response_cache.hpp>
+
+namespace tws {
+
+namespace {
+// rough cost of an entry besides its strings: map node, list node,
+// CachedResponse and its control block
+const size_t ENTRY_OVERHEAD = 192;
+}
+
+void ResponseCache::Shard::unlink(Entry &e)
+{
+    lru.erase(e.lru);
+    bytes -= e.bytes;
+    e.resp.reset();
+}
+
+ResponseCache::ResponseCache()
+    : shard_capacity_(0)
+{
+}
+
+ResponseCache::Shard &ResponseCache::shard_of(const std::string &key)
+{
+    return shards_[std::hash<std::string>()(key) % kShards];
+}
+
+void ResponseCache::set_capacity(size_t max_bytes)
+{
+    shard_capacity_ = max_bytes / kShards;
+}
+
+ResponseCache::Lookup ResponseCache::lookup(const std::string &key,
+        uint64_t now, CachedResponsePtr &resp,
+        const std::function<Waiter ()> &make_waiter)
+{
+    Shard &s = shard_of(key);
+    std::lock_guard<std::mutex> lk(s.m);
+    auto it = s.map.find(key);
+    if (it == s.map.end()) {
+        // an entry without response marks it is being made
+        s.map[key];
+        return kMiss;
+    }
+    Entry &e = it->second;
+    if (!e.resp) {
+        e.waiters.push_back(make_waiter());
+        return kWait;
+    }
+    if (e.resp->expires <= now || shard_capacity_ == 0) {
+        s.unlink(e);
+        return kMiss;
+    }
+    s.lru.splice(s.lru.begin(), s.lru, e.lru);
+    resp = e.resp;
+    return kHit;
+}
+
+void ResponseCache::fill(const std::string &key, const CachedResponsePtr &resp)
+{
+    std::vector<Waiter> waiters;
+    {
+        Shard &s = shard_of(key);
+        std::lock_guard<std::mutex> lk(s.m);
+        auto it = s.map.find(key);
+        if (it == s.map.end() || it->second.resp)
+            return;
+        Entry &e = it->second;
+        waiters.swap(e.waiters);
+        size_t bytes = resp ? key.size() + resp->head.size()
+            + resp->body.size() + ENTRY_OVERHEAD : 0;
+        if (!resp || bytes > shard_capacity_) {
+            s.map.erase(it);
+        } else {
+            e.resp = resp;
+            e.bytes = bytes;
+            s.lru.push_front(&it->first);
+            e.lru = s.lru.begin();
+            s.bytes += bytes;
+            // evicted responses stay alive until writes using them finish
+            while (s.bytes > shard_capacity_) {
+                auto victim = s.map.find(*s.lru.back());
+                s.unlink(victim->second);
+                s.map.erase(victim);
+            }
+        }
+    }
+    for(size_t i = 0; i < waiters.size(); i++)
+        waiters[i](resp);
+}
+
+}
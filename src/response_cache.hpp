@@ -0,0 +1,89 @@
+#ifndef _RESPONSE_CACHE_HPP_
+#define _RESPONSE_CACHE_HPP_
+#include <unordered_map>
+#include <functional>
+#include <vector>
+#include <list>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+namespace tws{
+
+// a response as it goes out, minus the lines made per request
+struct CachedResponse
+{
+    int code;
+    std::string head;   // status line and headers, without Date,
+                        // Connection and the empty line
+    std::string body;   // compressed already if it was
+    uint64_t expires;   // now_ns() when it goes stale
+};
+
+typedef std::shared_ptr<const CachedResponse> CachedResponsePtr;
+
+/* responses shared by requests with the same key, for a short time.
+ * the first miss of a key makes the response while later ones wait
+ * for it, so a burst of requests for one page calls its handler once.
+ * keys are spread over shards with a lock and an LRU list each,
+ * every shard holds at most its part of the capacity in bytes */
+class ResponseCache
+{
+public:
+    // called once when the response being made for a key is filled,
+    // with NULL if that response was not cached
+    typedef std::function<void (const CachedResponsePtr&)> Waiter;
+
+    enum Lookup {
+        kHit,   // resp is set
+        kMiss,  // caller makes the response, then must call fill()
+        kWait,  // another one is making it, waiter will be called
+    };
+
+private:
+    enum { kShards = 16 };
+
+    struct Entry {
+        CachedResponsePtr resp;     // NULL while being made
+        std::vector<Waiter> waiters;
+        std::list<const std::string *>::iterator lru;
+        size_t bytes;
+    };
+
+    struct Shard {
+        std::mutex m;
+        std::unordered_map<std::string, Entry> map;
+        // keys of filled entries, most recently used first
+        std::list<const std::string *> lru;
+        size_t bytes;
+        char pad_[64];
+
+        Shard() : bytes(0) {}
+        void unlink(Entry &e);
+    };
+
+    Shard shards_[kShards];
+    size_t shard_capacity_;
+
+    Shard &shard_of(const std::string &key);
+
+public:
+    ResponseCache();
+
+    // 0 turns caching off, entries are dropped as they are used
+    void set_capacity(size_t max_bytes);
+    bool enabled() const { return shard_capacity_ > 0; }
+
+    // make_waiter is called only for kWait, under the shard lock, so
+    // a hit doesn't pay for building a Waiter
+    Lookup lookup(const std::string &key, uint64_t now,
+            CachedResponsePtr &resp, const std::function<Waiter ()> &make_waiter);
+    // after kMiss, resp is NULL if the response can't be cached.
+    // waiters are called in caller's thread
+    void fill(const std::string &key, const CachedResponsePtr &resp);
+};
+
+}
+
+#endif
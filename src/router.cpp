@@ -0,0 +1,208 @@
+#include <router.hpp>
+#include <stdexcept>
+#include <cstring>
+
+namespace tws {
+
+Router::Node::~Node()
+{
+    for(size_t i = 0; i < children.size(); i++)
+        delete children[i];
+    delete param;
+    delete tail;
+}
+
+bool Router::Node::has_route() const
+{
+    for(int i = 0; i < kMethods; i++) {
+        if (routes[i])
+            return true;
+    }
+    return false;
+}
+
+Router::Router()
+    : empty_(true)
+{
+}
+
+Router::~Router()
+{
+}
+
+void Router::add(RequestType method, const std::string &pattern,
+        const Route &route)
+{
+    if (pattern.empty() || pattern[0] != '/')
+        throw std::invalid_argument("route must start with '/': " + pattern);
+
+    Node *node = &root_;
+    size_t i = 0;
+    while (i < pattern.size()) {
+        if (pattern[i] == ':') {
+            size_t end = pattern.find('/', i);
+            if (end == std::string::npos)
+                end = pattern.size();
+            std::string name = pattern.substr(i + 1, end - i - 1);
+            if (pattern[i - 1] != '/' || name.empty()
+                    || name.find_first_of(":*") != std::string::npos)
+                throw std::invalid_argument("bad parameter in route: " + pattern);
+            if (!node->param) {
+                node->param = new Node;
+                node->param_name = name;
+            } else if (node->param_name != name) {
+                throw std::invalid_argument("parameter named differently: " + pattern);
+            }
+            node = node->param;
+            i = end;
+        } else if (pattern[i] == '*') {
+            std::string name = pattern.substr(i + 1);
+            if (name.find_first_of("/:*") != std::string::npos)
+                throw std::invalid_argument("'*' must end route: " + pattern);
+            if (!node->tail) {
+                node->tail = new Node;
+                node->tail_name = name;
+            } else if (node->tail_name != name) {
+                throw std::invalid_argument("parameter named differently: " + pattern);
+            }
+            node = node->tail;
+            i = pattern.size();
+        } else {
+            size_t end = pattern.find_first_of(":*", i);
+            if (end == std::string::npos)
+                end = pattern.size();
+            node = insert_static(node, pattern.data() + i, end - i);
+            i = end;
+        }
+    }
+
+    if (node->routes[method])
+        throw std::invalid_argument("route added twice: " + pattern);
+    node->routes[method].reset(new Route(route));
+    empty_ = false;
+}
+
+Router::Node *Router::insert_static(Node *node, const char *s, size_t len)
+{
+    while (len > 0) {
+        Node *child = NULL;
+        size_t idx = 0;
+        for(; idx < node->children.size(); idx++) {
+            if (node->children[idx]->label[0] == s[0]) {
+                child = node->children[idx];
+                break;
+            }
+        }
+        if (child == NULL) {
+            child = new Node;
+            child->label.assign(s, len);
+            node->children.push_back(child);
+            return child;
+        }
+
+        size_t common = 0;
+        while (common < len && common < child->label.size()
+                && child->label[common] == s[common])
+            common++;
+        if (common < child->label.size()) {
+            // split the edge, shared part becomes a node of its own
+            Node *mid = new Node;
+            mid->label = child->label.substr(0, common);
+            child->label.erase(0, common);
+            mid->children.push_back(child);
+            node->children[idx] = mid;
+            child = mid;
+        }
+        node = child;
+        s += common;
+        len -= common;
+    }
+    return node;
+}
+
+const Router::Route *Router::match(RequestType method, StrRef path,
+        RouteParams &params, bool &path_found, unsigned &allow) const
+{
+    params.count = 0;
+    path_found = false;
+    allow = 0;
+    if (empty_)
+        return NULL;
+    return match(&root_, method, path, 0, params, path_found, allow);
+}
+
+const Router::Route *Router::route_of(const Node *node, RequestType method,
+        bool &path_found, unsigned &allow) const
+{
+    if (node->routes[method])
+        return node->routes[method].get();
+    // HEAD is answered by GET handler, body is not sent
+    if (method == HTTP_HEAD && node->routes[HTTP_GET])
+        return node->routes[HTTP_GET].get();
+    if (node->routes[HTTP_INVALID])
+        return node->routes[HTTP_INVALID].get();
+    for(int i = 0; i < HTTP_INVALID; i++) {
+        if (node->routes[i]) {
+            path_found = true;
+            allow |= 1u << i;
+        }
+    }
+    return NULL;
+}
+
+const Router::Route *Router::match(const Node *node, RequestType method,
+        StrRef path, size_t pos, RouteParams &params, bool &path_found,
+        unsigned &allow) const
+{
+    const Route *r;
+    int count = params.count;
+    if (pos == path.size()) {
+        if ((r = route_of(node, method, path_found, allow)) != NULL)
+            return r;
+    } else {
+        const char *p = path.data() + pos;
+        size_t left = path.size() - pos;
+        for(size_t i = 0; i < node->children.size(); i++) {
+            const Node *child = node->children[i];
+            if (child->label[0] != *p)
+                continue;
+            // at most one child starts with this char
+            if (child->label.size() <= left
+                    && ::memcmp(child->label.data(), p, child->label.size()) == 0
+                    && (r = match(child, method, path, pos + child->label.size(),
+                            params, path_found, allow)) != NULL)
+                return r;
+            break;
+        }
+        if (node->param) {
+            const char *slash = (const char *)::memchr(p, '/', left);
+            size_t seg = slash ? slash - p : left;
+            if (seg > 0) {
+                if (count < RouteParams::kMax) {
+                    params.names[count] = StrRef(node->param_name.data(),
+                            node->param_name.size());
+                    params.values[count] = StrRef(p, seg);
+                    params.count = count + 1;
+                }
+                if ((r = match(node->param, method, path, pos + seg,
+                                params, path_found, allow)) != NULL)
+                    return r;
+                params.count = count;
+            }
+        }
+    }
+    if (node->tail) {
+        if ((r = route_of(node->tail, method, path_found, allow)) != NULL) {
+            if (count < RouteParams::kMax) {
+                params.names[count] = StrRef(node->tail_name.data(),
+                        node->tail_name.size());
+                params.values[count] = StrRef(path.data() + pos, path.size() - pos);
+                params.count = count + 1;
+            }
+            return r;
+        }
+    }
+    return NULL;
+}
+
+}
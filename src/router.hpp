@@ -0,0 +1,82 @@
+#ifndef _ROUTER_HPP_
+#define _ROUTER_HPP_
+#include <string>
+#include <vector>
+#include <memory>
+#include <http_server.hpp>
+
+namespace tws{
+
+// compressed radix tree of routes. a pattern is made of
+//   static text         "/users/list"
+//   ":name" segments    "/users/:id", any non-empty text up to next '/'
+//   a "*name" tail      "/files/*path", rest of path, maybe empty
+// and each route has handlers per method. matching walks the path once,
+// preferring static text over parameters over tails, and allocates
+// nothing. routes must all be added before the server runs
+class Router
+{
+public:
+    // one per method, HTTP_INVALID holds the any-method handler
+    enum { kMethods = HTTP_INVALID + 1 };
+
+    // one of the handlers is set
+    struct Route {
+        RouteHandler handler;
+        AsyncHandler async_handler;
+        // handshake and connection of a WebSocket endpoint
+        std::shared_ptr<const WebSocketHandler> websocket;
+        ExecPolicy policy;
+        // requests go through the response cache, see route_cached()
+        bool cacheable;
+
+        Route() : policy(RUN_INLINE), cacheable(false) {}
+    };
+
+    Router();
+    ~Router();
+
+    // method HTTP_INVALID means any method, throws std::invalid_argument
+    // on a bad pattern or a route added twice
+    void add(RequestType method, const std::string &pattern,
+            const Route &route);
+    bool empty() const { return empty_; }
+
+    // NULL if no route matches. path_found tells if some route matched
+    // the path for another method, then allow gets its methods
+    // (bit 1 << RequestType)
+    const Route *match(RequestType method, StrRef path, RouteParams &params,
+            bool &path_found, unsigned &allow) const;
+
+private:
+    struct Node {
+        std::string label;              // static text leading to this node
+        std::vector<Node *> children;   // static children, by first char
+        Node *param;                    // ":name" child
+        std::string param_name;
+        Node *tail;                     // "*name" child, ends the pattern
+        std::string tail_name;
+        std::unique_ptr<Route> routes[kMethods];
+
+        Node() : param(NULL), tail(NULL) {}
+        ~Node();
+        bool has_route() const;
+    };
+
+    Node *insert_static(Node *node, const char *s, size_t len);
+    const Route *match(const Node *node, RequestType method, StrRef path,
+            size_t pos, RouteParams &params, bool &path_found,
+            unsigned &allow) const;
+    const Route *route_of(const Node *node, RequestType method,
+            bool &path_found, unsigned &allow) const;
+
+    Node root_;
+    bool empty_;
+
+    Router(const Router&);
+    Router &operator=(const Router&);
+};
+
+}
+
+#endif
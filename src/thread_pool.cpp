@@ -0,0 +1,358 @@
+#include <thread_pool.hpp>
+#include <metrics.hpp>
+#include <utility>
+#include <cstdint>
+
+namespace {
+
+const int SPIN_ROUNDS = 256;
+
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    std::this_thread::yield();
+#endif
+}
+
+}
+
+namespace tws {
+
+TaskQueue::TaskQueue(size_t capacity)
+{
+    size_t n = 2;
+    while (n < capacity)
+        n <<= 1;
+    cells_.reset(new Cell[n]);
+    mask_ = n - 1;
+    for(size_t i = 0; i < n; i++)
+        cells_[i].seq.store(i, std::memory_order_relaxed);
+    enqueue_pos_.store(0, std::memory_order_relaxed);
+    dequeue_pos_.store(0, std::memory_order_relaxed);
+}
+
+bool TaskQueue::push(PoolTask *task)
+{
+    Cell *cell;
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for(;;) {
+        cell = &cells_[pos & mask_];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                        std::memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            // full
+            return false;
+        } else {
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+    cell->task = task;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+PoolTask *TaskQueue::pop()
+{
+    Cell *cell;
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    for(;;) {
+        cell = &cells_[pos & mask_];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                        std::memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            // empty
+            return NULL;
+        } else {
+            pos = dequeue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+    PoolTask *task = cell->task;
+    cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+    return task;
+}
+
+size_t TaskQueue::size_approx() const
+{
+    size_t e = enqueue_pos_.load(std::memory_order_relaxed);
+    size_t d = dequeue_pos_.load(std::memory_order_relaxed);
+    return e > d ? e - d : 0;
+}
+
+QueueDelayControl::QueueDelayControl()
+    : target_(0),
+      interval_(0),
+      interval_end_(0),
+      min_delay_(0),
+      overloaded_(false)
+{
+}
+
+void QueueDelayControl::set(uint64_t target, uint64_t interval)
+{
+    target_ = target;
+    interval_ = interval;
+}
+
+bool QueueDelayControl::should_drop(uint64_t delay, uint64_t now)
+{
+    uint64_t end = interval_end_.load(std::memory_order_relaxed);
+    if (now >= end) {
+        // one thread closes the interval, judging it by the shortest wait
+        if (interval_end_.compare_exchange_strong(end, now + interval_,
+                    std::memory_order_relaxed)) {
+            uint64_t min = min_delay_.exchange(delay, std::memory_order_relaxed);
+            overloaded_.store(min > target_, std::memory_order_relaxed);
+        }
+    } else {
+        uint64_t min = min_delay_.load(std::memory_order_relaxed);
+        while (delay < min && !min_delay_.compare_exchange_weak(min, delay,
+                    std::memory_order_relaxed))
+            ;
+    }
+    return overloaded_.load(std::memory_order_relaxed) && delay > 2 * target_;
+}
+
+ThreadPool::ThreadPool(int threadnum, size_t queue_size)
+    : threadnum_(threadnum),
+      next_(0),
+      spinning_(0),
+      stopping_(false),
+      stopped_(false),
+      normal_queued_(0),
+      shed_oldest_(false)
+{
+    // what the rings of all workers hold, rounded like TaskQueue does
+    capacity_ = 2;
+    while (capacity_ < queue_size)
+        capacity_ <<= 1;
+    capacity_ *= threadnum_;
+    max_queued_ = capacity_;
+    workers_ = new Worker*[threadnum_];
+    for(int i = 0; i < threadnum_; i++)
+        workers_[i] = new Worker(queue_size);
+    for(int i = 0; i < threadnum_; i++)
+        workers_[i]->thread = std::thread(&ThreadPool::thread_proc, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    stop();
+    for(int i = 0; i < threadnum_; i++)
+        delete workers_[i];
+    delete[] workers_;
+}
+
+void ThreadPool::stop()
+{
+    if (stopped_)
+        return;
+    stopped_ = true;
+    stopping_.store(true);
+    for(int i = 0; i < threadnum_; i++)
+        wake(i);
+    for(int i = 0; i < threadnum_; i++)
+        workers_[i]->thread.join();
+}
+
+void ThreadPool::set_limit(size_t max_queued, bool shed_oldest)
+{
+    max_queued_ = max_queued == 0 || max_queued > capacity_ ? capacity_ : max_queued;
+    shed_oldest_ = shed_oldest;
+}
+
+void ThreadPool::set_delay_control(uint64_t target, uint64_t interval)
+{
+    delay_control_.set(target, interval);
+}
+
+bool ThreadPool::push(PoolTask *task, Priority priority)
+{
+    if (threadnum_ == 0)
+        return false;
+
+    if (priority == PRIORITY_NORMAL
+            && normal_queued_.fetch_add(1, std::memory_order_relaxed) >= max_queued_) {
+        // the task shed gives its place to the new one
+        PoolTask *oldest = shed_oldest_ ? take_oldest() : NULL;
+        if (oldest == NULL) {
+            normal_queued_.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        oldest->shed();
+    }
+    task->queued_at_ = now_ns();
+
+    // power of two choices, push to the less busy one
+    unsigned a = next_.fetch_add(1, std::memory_order_relaxed) % threadnum_;
+    unsigned b = (a + 1) % threadnum_;
+    if (workers_[b]->queues[priority]->size_approx()
+            < workers_[a]->queues[priority]->size_approx())
+        std::swap(a, b);
+
+    int target = -1;
+    for(int i = 0; i < threadnum_; i++) {
+        int id = (a + i) % threadnum_;
+        if (workers_[id]->queues[priority]->push(task)) {
+            target = id;
+            break;
+        }
+    }
+    if (target < 0) {
+        if (priority == PRIORITY_NORMAL)
+            normal_queued_.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // pairs with the fence in thread_proc before parking
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // a spinning worker will steal it
+    if (spinning_.load(std::memory_order_relaxed) > 0)
+        return true;
+    if (!wake(target)) {
+        for(int i = 1; i < threadnum_; i++) {
+            if (wake((target + i) % threadnum_))
+                break;
+        }
+    }
+    return true;
+}
+
+bool ThreadPool::wake(int id)
+{
+    Worker *w = workers_[id];
+    if (!w->sleeping.load(std::memory_order_relaxed)
+            || !w->sleeping.exchange(false))
+        return false;
+    {
+        std::lock_guard<std::mutex> lk(w->m);
+    }
+    w->cv.notify_one();
+    return true;
+}
+
+bool ThreadPool::pending() const
+{
+    for(int i = 0; i < threadnum_; i++) {
+        for(int p = 0; p < kPriorities; p++) {
+            if (workers_[i]->queues[p]->size_approx() > 0)
+                return true;
+        }
+    }
+    return false;
+}
+
+size_t ThreadPool::queued() const
+{
+    size_t n = 0;
+    for(int i = 0; i < threadnum_; i++) {
+        for(int p = 0; p < kPriorities; p++)
+            n += workers_[i]->queues[p]->size_approx();
+    }
+    return n;
+}
+
+PoolTask *ThreadPool::take(int id, int &priority)
+{
+    for(int p = 0; p < kPriorities; p++) {
+        for(int i = 0; i < threadnum_; i++) {
+            PoolTask *task = workers_[(id + i) % threadnum_]->queues[p]->pop();
+            if (task) {
+                if (p == PRIORITY_NORMAL)
+                    normal_queued_.fetch_sub(1, std::memory_order_relaxed);
+                priority = p;
+                return task;
+            }
+        }
+    }
+    return NULL;
+}
+
+// head of the longest normal queue, each queue is FIFO so it has about
+// the longest wait of all
+PoolTask *ThreadPool::take_oldest()
+{
+    int longest = 0;
+    size_t most = 0;
+    for(int i = 0; i < threadnum_; i++) {
+        size_t n = workers_[i]->queues[PRIORITY_NORMAL]->size_approx();
+        if (n > most) {
+            most = n;
+            longest = i;
+        }
+    }
+    for(int i = 0; i < threadnum_; i++) {
+        PoolTask *task =
+            workers_[(longest + i) % threadnum_]->queues[PRIORITY_NORMAL]->pop();
+        if (task) {
+            normal_queued_.fetch_sub(1, std::memory_order_relaxed);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+void ThreadPool::thread_proc(int id)
+{
+    Worker *self = workers_[id];
+    for(;;) {
+        int priority = PRIORITY_NORMAL;
+        PoolTask *task = take(id, priority);
+        if (task == NULL) {
+            spinning_.fetch_add(1);
+            for(int i = 0; task == NULL && i < SPIN_ROUNDS; i++) {
+                cpu_relax();
+                task = take(id, priority);
+            }
+            // last spinner leaving with work wakes a sleeper for the rest
+            if (spinning_.fetch_sub(1) == 1 && task != NULL && pending()) {
+                for(int i = 1; i < threadnum_; i++) {
+                    if (wake((id + i) % threadnum_))
+                        break;
+                }
+            }
+        }
+
+        if (task == NULL) {
+            // queues are empty, nothing more is coming when stopping
+            if (stopping_.load())
+                return;
+            // park, check again after announcing it so a push or stop()
+            // in between either gets seen here or sees us sleeping
+            self->sleeping.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            task = take(id, priority);
+            if (task == NULL && stopping_.load()) {
+                self->sleeping.store(false);
+                return;
+            }
+            if (task == NULL) {
+                std::unique_lock<std::mutex> lk(self->m);
+                while (self->sleeping.load())
+                    self->cv.wait(lk);
+                continue;
+            }
+            self->sleeping.store(false);
+        }
+
+        if (priority == PRIORITY_NORMAL && delay_control_.enabled()) {
+            uint64_t now = now_ns();
+            if (delay_control_.should_drop(now - task->queued_at_, now)) {
+                task->shed();
+                continue;
+            }
+        }
+        task->run_in_pool();
+    }
+}
+
+}
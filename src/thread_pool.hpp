@@ -0,0 +1,151 @@
+#ifndef _THREAD_POOL_HPP_
+#define _THREAD_POOL_HPP_
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+namespace tws{
+
+/* work item for ThreadPool, queued by pointer so pushing never allocates.
+ * owner must keep it alive until run_in_pool() or shed() is called */
+class PoolTask
+{
+public:
+    uint64_t queued_at_;    // now_ns() when pushed
+
+    PoolTask() : queued_at_(0) {}
+    virtual ~PoolTask() {}
+    virtual void run_in_pool() = 0;
+    // called instead of run_in_pool() when the task is dropped from
+    // queue by overload control, in any thread, must not block
+    virtual void shed() { run_in_pool(); }
+};
+
+/* bounded lock-free multi-producer multi-consumer ring
+ * (D. Vyukov's algorithm), capacity is rounded up to power of 2 */
+class TaskQueue
+{
+    struct Cell {
+        std::atomic<size_t> seq;
+        PoolTask *task;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    char pad0_[64];
+    std::atomic<size_t> enqueue_pos_;
+    char pad1_[64];
+    std::atomic<size_t> dequeue_pos_;
+    char pad2_[64];
+
+public:
+    explicit TaskQueue(size_t capacity);
+
+    bool push(PoolTask *task);
+    PoolTask *pop();
+    size_t size_approx() const;
+};
+
+/* CoDel-style overload detection on queueing delay, as servers use it:
+ * queue is overloaded when even the shortest wait seen through a whole
+ * interval was above target, i.e. the queue never drained. only tasks
+ * waiting over 2 * target are dropped then, so a short burst is
+ * absorbed and a standing queue is cut down. approximate under
+ * concurrent use, which is fine for this */
+class QueueDelayControl
+{
+    uint64_t target_;
+    uint64_t interval_;
+    std::atomic<uint64_t> interval_end_;
+    std::atomic<uint64_t> min_delay_;
+    std::atomic<bool> overloaded_;
+
+public:
+    QueueDelayControl();
+
+    // nanoseconds, target 0 disables it
+    void set(uint64_t target, uint64_t interval);
+    bool enabled() const { return target_ != 0; }
+    // true if a task which waited delay should be dropped
+    bool should_drop(uint64_t delay, uint64_t now);
+};
+
+/* each worker owns a queue per priority, producers put tasks to the less
+ * loaded one of two neighbour workers, idle workers steal from others,
+ * and high priority tasks are taken first from all queues.
+ * workers spin a while before parking, and producers only wake a parked
+ * worker when nobody is spinning, so a burst costs few wakeups.
+ * normal priority tasks are limited by set_limit() and QueueDelayControl,
+ * high priority ones only by queue capacity */
+class ThreadPool
+{
+public:
+    enum Priority {
+        PRIORITY_HIGH,
+        PRIORITY_NORMAL,
+        kPriorities,
+    };
+
+private:
+    struct Worker {
+        std::unique_ptr<TaskQueue> queues[kPriorities];
+        std::atomic<bool> sleeping;
+        std::mutex m;
+        std::condition_variable cv;
+        std::thread thread;
+        explicit Worker(size_t capacity) : sleeping(false)
+        {
+            for(int i = 0; i < kPriorities; i++)
+                queues[i].reset(new TaskQueue(capacity));
+        }
+    };
+
+    Worker **workers_;
+    int threadnum_;
+    size_t capacity_;
+    std::atomic<unsigned> next_;
+    std::atomic<int> spinning_;
+    std::atomic<bool> stopping_;
+    bool stopped_;
+
+    // normal priority tasks queued, and the limit of it
+    std::atomic<size_t> normal_queued_;
+    size_t max_queued_;
+    bool shed_oldest_;
+    QueueDelayControl delay_control_;
+
+    void thread_proc(int id);
+    PoolTask *take(int id, int &priority);
+    PoolTask *take_oldest();
+    bool pending() const;
+    bool wake(int id);
+
+public:
+    ThreadPool(int threadnum, size_t queue_size = 1024);
+    ~ThreadPool();
+
+    // normal priority tasks queued at most, 0 or more than capacity
+    // means capacity (queue_size per thread). when the limit is reached
+    // a push fails, or with shed_oldest the task waiting longest (about)
+    // is shed to make room. call before pushing
+    void set_limit(size_t max_queued, bool shed_oldest);
+    // see QueueDelayControl, nanoseconds, 0 target disables (default)
+    void set_delay_control(uint64_t target, uint64_t interval);
+
+    // false when the task can't be queued, it is not run then
+    bool push(PoolTask *task, Priority priority = PRIORITY_NORMAL);
+    // runs tasks already queued, then joins all threads.
+    // nothing may be pushed after it is called
+    void stop();
+    int threadnum() const { return threadnum_; }
+    // tasks waiting in all queues, approximate
+    size_t queued() const;
+};
+
+}
+
+#endif
@@ -0,0 +1,54 @@
+#include <timer_wheel.hpp>
+
+namespace tws {
+
+TimerWheel::TimerWheel(size_t slots)
+    : slots_(slots < 2 ? 2 : slots),
+      now_(0),
+      size_(0)
+{
+    for(size_t i = 0; i < slots_.size(); i++)
+        slots_[i].prev_ = slots_[i].next_ = &slots_[i];
+}
+
+void TimerWheel::unlink(TimerEntry *e)
+{
+    e->prev_->next_ = e->next_;
+    e->next_->prev_ = e->prev_;
+    e->prev_ = e->next_ = NULL;
+    size_--;
+}
+
+void TimerWheel::link(TimerEntry *e, uint64_t expire)
+{
+    // entries never expiring go anywhere, slot 0 is as good as others
+    TimerEntry *head = &slots_[expire == kNever ? 0 : expire % slots_.size()];
+    e->expire_ = expire;
+    e->prev_ = head;
+    e->next_ = head->next_;
+    head->next_->prev_ = e;
+    head->next_ = e;
+    size_++;
+}
+
+void TimerWheel::schedule(TimerEntry *e, unsigned ticks, int kind)
+{
+    if (e->prev_)
+        unlink(e);
+    e->kind_ = kind;
+    // current tick is partly gone, one more makes it at least ticks
+    link(e, ticks == 0 ? kNever : now_ + ticks + 1);
+}
+
+void TimerWheel::cancel(TimerEntry *e)
+{
+    if (e->prev_)
+        unlink(e);
+}
+
+size_t TimerWheel::size()
+{
+    return size_;
+}
+
+}
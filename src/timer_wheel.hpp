@@ -0,0 +1,82 @@
+#ifndef _TIMER_WHEEL_HPP_
+#define _TIMER_WHEEL_HPP_
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace tws{
+
+/* something with a deadline in a TimerWheel, linked into the wheel
+ * in place so arming never allocates. owner must cancel it before
+ * being destroyed */
+class TimerEntry
+{
+    friend class TimerWheel;
+    TimerEntry *prev_;
+    TimerEntry *next_;
+    uint64_t expire_;
+    int kind_;
+
+public:
+    TimerEntry() : prev_(NULL), next_(NULL), expire_(0), kind_(0) {}
+    virtual ~TimerEntry() {}
+};
+
+/* hashed timing wheel, a deadline is put in the slot of its tick and
+ * checked when the clock gets there, so arming, rearming and
+ * canceling are O(1) however many entries there are. deadlines more
+ * than a round away stay in their slot until their round comes.
+ * not locked, each reactor's wheel is used in its I/O thread only */
+class TimerWheel
+{
+    std::vector<TimerEntry> slots_; // list heads
+    uint64_t now_;
+    size_t size_;
+
+    void unlink(TimerEntry *e);
+    void link(TimerEntry *e, uint64_t expire);
+
+public:
+    static const uint64_t kNever = UINT64_MAX;
+
+    explicit TimerWheel(size_t slots = 64);
+
+    // expires after at least ticks full ticks, or never if ticks is 0
+    // (entry is still kept, see for_each()). kind is told back on expiry
+    void schedule(TimerEntry *e, unsigned ticks, int kind);
+    void cancel(TimerEntry *e);
+    size_t size();
+
+    // moves clock by one tick, expired entries are removed and given
+    // to fn(entry, kind). fn must not call back into the wheel
+    template <typename Fn>
+    void advance(Fn fn)
+    {
+        now_++;
+        TimerEntry *head = &slots_[now_ % slots_.size()];
+        for(TimerEntry *e = head->next_; e != head; ) {
+            TimerEntry *next = e->next_;
+            if (e->expire_ <= now_) {
+                unlink(e);
+                fn(e, e->kind_);
+            }
+            e = next;
+        }
+    }
+
+    // calls fn(entry, kind) on every entry, which must not call back
+    // into the wheel
+    template <typename Fn>
+    void for_each(Fn fn)
+    {
+        for(size_t i = 0; i < slots_.size(); i++) {
+            TimerEntry *head = &slots_[i];
+            for(TimerEntry *e = head->next_; e != head; e = e->next_)
+                fn(e, e->kind_);
+        }
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,189 @@
+#ifdef HTTP_IO_URING
+#include <uring.hpp>
+#include <system_error>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace tws {
+
+namespace {
+
+int uring_setup(unsigned entries, io_uring_params *p)
+{
+    return (int)::syscall(__NR_io_uring_setup, entries, p);
+}
+
+int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)::syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+            flags, NULL, 0);
+}
+
+int uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+    return (int)::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// ring indexes are shared with the kernel
+inline unsigned load_acquire(const unsigned *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+inline void store_release(unsigned *p, unsigned v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+void *map_ring(int fd, size_t size, off_t offset)
+{
+    void *p = ::mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (p == MAP_FAILED)
+        throw std::system_error(errno, std::system_category(), "io_uring mmap");
+    return p;
+}
+
+}
+
+Uring::Uring(unsigned entries)
+    : fd_(-1),
+      event_fd_(-1),
+      sq_queued_(0),
+      sqes_(NULL),
+      sq_ring_(NULL),
+      cq_ring_(NULL)
+{
+    // no IORING_SETUP_SINGLE_ISSUER, the ring is made by one thread and
+    // used by the one running the loop
+    io_uring_params p;
+    ::memset(&p, 0, sizeof(p));
+    fd_ = uring_setup(entries, &p);
+    if (fd_ < 0)
+        throw std::system_error(errno, std::system_category(), "io_uring_setup");
+
+    try {
+        sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+        sq_ring_ = map_ring(fd_, sq_ring_size_, IORING_OFF_SQ_RING);
+        cq_ring_ = map_ring(fd_, cq_ring_size_, IORING_OFF_CQ_RING);
+        sqes_ = (io_uring_sqe *)map_ring(fd_, sqes_size_, IORING_OFF_SQES);
+    } catch (...) {
+        release();
+        throw;
+    }
+
+    char *sq = (char *)sq_ring_;
+    sq_head_ = (unsigned *)(sq + p.sq_off.head);
+    sq_tail_ = (unsigned *)(sq + p.sq_off.tail);
+    sq_flags_ = (unsigned *)(sq + p.sq_off.flags);
+    sq_mask_ = *(unsigned *)(sq + p.sq_off.ring_mask);
+    sq_entries_ = *(unsigned *)(sq + p.sq_off.ring_entries);
+    // SQE i always sits in slot i, so the index array is set once
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    for(unsigned i = 0; i < sq_entries_; i++)
+        array[i] = i;
+    sq_queued_ = *sq_tail_;
+
+    char *cq = (char *)cq_ring_;
+    cq_head_ = (unsigned *)(cq + p.cq_off.head);
+    cq_tail_ = (unsigned *)(cq + p.cq_off.tail);
+    cq_mask_ = *(unsigned *)(cq + p.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    event_fd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (event_fd_ < 0
+            || uring_register(fd_, IORING_REGISTER_EVENTFD, &event_fd_, 1) < 0) {
+        int err = errno;
+        release();
+        throw std::system_error(err, std::system_category(), "io_uring eventfd");
+    }
+}
+
+Uring::~Uring()
+{
+    release();
+}
+
+void Uring::release()
+{
+    if (sqes_)
+        ::munmap(sqes_, sqes_size_);
+    if (cq_ring_)
+        ::munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_)
+        ::munmap(sq_ring_, sq_ring_size_);
+    if (event_fd_ >= 0)
+        ::close(event_fd_);
+    if (fd_ >= 0)
+        ::close(fd_);
+    sqes_ = NULL;
+    cq_ring_ = sq_ring_ = NULL;
+    event_fd_ = fd_ = -1;
+}
+
+io_uring_sqe *Uring::get_sqe()
+{
+    if (sq_queued_ - load_acquire(sq_head_) >= sq_entries_)
+        submit();
+    if (sq_queued_ - load_acquire(sq_head_) >= sq_entries_)
+        throw std::system_error(errno, std::system_category(), "io_uring_enter");
+    io_uring_sqe *sqe = &sqes_[sq_queued_ & sq_mask_];
+    ::memset(sqe, 0, sizeof(*sqe));
+    sq_queued_++;
+    return sqe;
+}
+
+bool Uring::pending() const
+{
+    return sq_queued_ != load_acquire(sq_head_);
+}
+
+void Uring::submit()
+{
+    store_release(sq_tail_, sq_queued_);
+    unsigned flags = 0;
+    // completions the CQ had no room for wait in the kernel till asked
+    if (load_acquire(sq_flags_) & IORING_SQ_CQ_OVERFLOW)
+        flags |= IORING_ENTER_GETEVENTS;
+    unsigned to_submit = sq_queued_ - load_acquire(sq_head_);
+    if (to_submit == 0 && flags == 0)
+        return;
+    int ret;
+    while ((ret = uring_enter(fd_, to_submit, 0, flags)) < 0 && errno == EINTR)
+        ;
+    if (ret < 0 && errno != EAGAIN && errno != EBUSY)
+        throw std::system_error(errno, std::system_category(), "io_uring_enter");
+}
+
+int Uring::reap()
+{
+    int n = 0;
+    unsigned head = *cq_head_;
+    unsigned tail;
+    while (head != (tail = load_acquire(cq_tail_))) {
+        for(; head != tail; head++) {
+            io_uring_cqe *cqe = &cqes_[head & cq_mask_];
+            UringOp *op = (UringOp *)(uintptr_t)cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            // slot is given back before the operation goes on, it may
+            // queue more work
+            store_release(cq_head_, head + 1);
+            if (op) {
+                op->complete(res, flags);
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+}
+
+#endif
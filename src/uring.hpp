@@ -0,0 +1,73 @@
+#ifndef _URING_HPP_
+#define _URING_HPP_
+#ifdef HTTP_IO_URING
+#include <linux/io_uring.h>
+#include <cstddef>
+#include <cstdint>
+
+namespace tws{
+
+// something with an operation in flight on a Uring, its address is
+// the user_data of the SQE
+class UringOp
+{
+public:
+    virtual ~UringOp() {}
+    // res is what the syscall would return, -errno on error
+    virtual void complete(int res, unsigned flags) = 0;
+};
+
+/* io_uring set up by raw syscalls, without liburing. meant for one
+ * event loop thread: SQEs are queued by get_sqe() as the loop runs and
+ * go to the kernel together in one io_uring_enter() by submit().
+ * completions make the eventfd readable, so the loop can wait for them
+ * along with everything else and call reap() */
+class Uring
+{
+    int fd_;
+    int event_fd_;
+
+    unsigned *sq_head_;
+    unsigned *sq_tail_;
+    unsigned *sq_flags_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    unsigned sq_queued_;    // local tail, published by submit()
+    io_uring_sqe *sqes_;
+
+    unsigned *cq_head_;
+    unsigned *cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe *cqes_;
+
+    void *sq_ring_;
+    size_t sq_ring_size_;
+    void *cq_ring_;
+    size_t cq_ring_size_;
+    size_t sqes_size_;
+
+    Uring(const Uring&);
+    Uring& operator=(const Uring&);
+    void release();
+
+public:
+    // throws std::system_error if the kernel has no io_uring
+    explicit Uring(unsigned entries);
+    ~Uring();
+
+    int event_fd() const { return event_fd_; }
+    // zeroed SQE to fill, submit() is called first if the queue is full.
+    // throws std::system_error if the kernel takes none of them
+    io_uring_sqe *get_sqe();
+    bool pending() const;
+    // hands queued SQEs to the kernel
+    void submit();
+    // calls complete() of finished operations, user_data 0 is ignored.
+    // returns how many there were
+    int reap();
+};
+
+}
+
+#endif
+#endif
@@ -0,0 +1,246 @@
+#include <websocket.hpp>
+#include <algorithm>
+#include <cstring>
+
+namespace tws {
+
+namespace {
+
+const char WS_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+inline uint32_t rol(uint32_t v, int n)
+{
+    return (v << n) | (v >> (32 - n));
+}
+
+// SHA-1 (RFC 3174) is needed for the handshake only, on short input
+void sha1(const std::string &in, uint8_t digest[20])
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    std::string msg(in);
+    uint64_t bits = (uint64_t)in.size() * 8;
+    msg.push_back((char)0x80);
+    while (msg.size() % 64 != 56)
+        msg.push_back(0);
+    for(int i = 7; i >= 0; i--)
+        msg.push_back((char)(bits >> (i * 8)));
+
+    for(size_t block = 0; block < msg.size(); block += 64) {
+        const uint8_t *u = (const uint8_t *)msg.data() + block;
+        uint32_t w[80];
+        for(int i = 0; i < 16; i++)
+            w[i] = ((uint32_t)u[i * 4] << 24) | ((uint32_t)u[i * 4 + 1] << 16)
+                | ((uint32_t)u[i * 4 + 2] << 8) | u[i * 4 + 3];
+        for(int i = 16; i < 80; i++)
+            w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for(int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for(int i = 0; i < 5; i++) {
+        digest[i * 4] = (uint8_t)(h[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(h[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(h[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)h[i];
+    }
+}
+
+std::string encode_base64(const uint8_t *data, size_t len)
+{
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for(size_t i = 0; i < len; i += 3) {
+        uint32_t v = (uint32_t)data[i] << 16;
+        if (i + 1 < len)
+            v |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < len)
+            v |= data[i + 2];
+        out.push_back(digits[(v >> 18) & 63]);
+        out.push_back(digits[(v >> 12) & 63]);
+        out.push_back(i + 1 < len ? digits[(v >> 6) & 63] : '=');
+        out.push_back(i + 2 < len ? digits[v & 63] : '=');
+    }
+    return out;
+}
+
+}
+
+int parse_ws_frame_header(const char *p, size_t len, WsFrameHeader &h)
+{
+    if (len < 2)
+        return 0;
+    const uint8_t *u = (const uint8_t *)p;
+    // no extension is agreed on, so RSV1-3 must be 0
+    if (u[0] & 0x70)
+        return -1;
+    h.fin = (u[0] & 0x80) != 0;
+    h.opcode = u[0] & 0x0f;
+    h.masked = (u[1] & 0x80) != 0;
+    uint64_t length = u[1] & 0x7f;
+    size_t pos = 2;
+    if (length == 126) {
+        if (len < 4)
+            return 0;
+        length = ((uint64_t)u[2] << 8) | u[3];
+        pos = 4;
+    } else if (length == 127) {
+        if (len < 10)
+            return 0;
+        length = 0;
+        for(int i = 2; i < 10; i++)
+            length = (length << 8) | u[i];
+        if (length >> 63)
+            return -1;
+        pos = 10;
+    }
+    if (h.masked) {
+        if (len < pos + 4)
+            return 0;
+        ::memcpy(h.mask, p + pos, 4);
+        pos += 4;
+    }
+    h.length = length;
+    return (int)pos;
+}
+
+void ws_unmask(char *data, size_t len, const uint8_t mask[4], uint64_t offset)
+{
+    // eight bytes at a time, the mask repeated twice and rotated to offset
+    uint8_t m[8];
+    for(int i = 0; i < 8; i++)
+        m[i] = mask[(offset + i) & 3];
+    uint64_t m64;
+    ::memcpy(&m64, m, 8);
+    size_t i = 0;
+    for(; i + 8 <= len; i += 8) {
+        uint64_t v;
+        ::memcpy(&v, data + i, 8);
+        v ^= m64;
+        ::memcpy(data + i, &v, 8);
+    }
+    for(; i < len; i++)
+        data[i] ^= m[i & 7];
+}
+
+void append_ws_frame_header(std::string &out, int opcode, bool fin, uint64_t length)
+{
+    char b[10];
+    b[0] = (char)((fin ? 0x80 : 0) | opcode);
+    size_t n;
+    if (length < 126) {
+        b[1] = (char)length;
+        n = 2;
+    } else if (length < 0x10000) {
+        b[1] = 126;
+        b[2] = (char)(length >> 8);
+        b[3] = (char)length;
+        n = 4;
+    } else {
+        b[1] = 127;
+        for(int i = 0; i < 8; i++)
+            b[2 + i] = (char)(length >> ((7 - i) * 8));
+        n = 10;
+    }
+    out.append(b, n);
+}
+
+void append_ws_frame(std::string &out, int opcode, const char *data, size_t len)
+{
+    out.reserve(out.size() + len + 10);
+    append_ws_frame_header(out, opcode, true, len);
+    out.append(data, len);
+}
+
+void append_ws_close(std::string &out, int code, StrRef reason)
+{
+    size_t n = std::min(reason.size(), WS_MAX_CONTROL - 2);
+    append_ws_frame_header(out, WS_CLOSE, true, n + 2);
+    out.push_back((char)(code >> 8));
+    out.push_back((char)code);
+    out.append(reason.data(), n);
+}
+
+std::string websocket_accept(StrRef key)
+{
+    std::string s(key.data(), key.size());
+    s.append(WS_GUID);
+    uint8_t digest[20];
+    sha1(s, digest);
+    return encode_base64(digest, 20);
+}
+
+bool valid_utf8(const char *p, size_t len)
+{
+    const uint8_t *u = (const uint8_t *)p;
+    const uint8_t *end = u + len;
+    while (u < end) {
+        // ASCII runs a word at a time
+        if (end - u >= 8) {
+            uint64_t v;
+            ::memcpy(&v, u, 8);
+            if ((v & 0x8080808080808080ULL) == 0) {
+                u += 8;
+                continue;
+            }
+        }
+        uint8_t c = *u;
+        if (c < 0x80) {
+            u++;
+            continue;
+        }
+        int n;
+        uint32_t cp;
+        if ((c & 0xe0) == 0xc0) {
+            n = 1;
+            cp = c & 0x1f;
+        } else if ((c & 0xf0) == 0xe0) {
+            n = 2;
+            cp = c & 0x0f;
+        } else if ((c & 0xf8) == 0xf0) {
+            n = 3;
+            cp = c & 0x07;
+        } else {
+            return false;
+        }
+        if (end - u <= n)
+            return false;
+        for(int i = 1; i <= n; i++) {
+            if ((u[i] & 0xc0) != 0x80)
+                return false;
+            cp = (cp << 6) | (u[i] & 0x3f);
+        }
+        static const uint32_t min_cp[4] = {0, 0x80, 0x800, 0x10000};
+        if (cp < min_cp[n] || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+            return false;
+        u += n + 1;
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,73 @@
+#ifndef _WEBSOCKET_HPP_
+#define _WEBSOCKET_HPP_
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <header_map.hpp>
+
+namespace tws{
+
+// frame layer of WebSocket (RFC 6455), the connection is in http_server.cpp
+
+enum WsOpcode {
+    WS_CONTINUATION = 0,
+    WS_TEXT = 1,
+    WS_BINARY = 2,
+    WS_CLOSE = 8,
+    WS_PING = 9,
+    WS_PONG = 10,
+};
+
+// status codes of CLOSE frames
+enum WsCloseCode {
+    WS_NORMAL = 1000,
+    WS_GOING_AWAY = 1001,
+    WS_PROTOCOL_ERROR = 1002,
+    WS_UNSUPPORTED_DATA = 1003,
+    WS_NO_STATUS = 1005,        // never sent, CLOSE had no code
+    WS_ABNORMAL = 1006,         // never sent, connection ended without CLOSE
+    WS_INVALID_DATA = 1007,
+    WS_POLICY = 1008,
+    WS_TOO_BIG = 1009,
+    WS_INTERNAL_ERROR = 1011,
+};
+
+// payload of control frames
+const size_t WS_MAX_CONTROL = 125;
+
+struct WsFrameHeader
+{
+    bool fin;
+    uint8_t opcode;
+    bool masked;
+    uint8_t mask[4];
+    uint64_t length;
+};
+
+inline bool ws_control(int opcode) { return opcode & 0x8; }
+
+// header at p, its length if all of it is there, 0 if more is needed,
+// -1 if reserved bits are set or the length is too big
+int parse_ws_frame_header(const char *p, size_t len, WsFrameHeader &h);
+
+// XOR of payload bytes with mask, in place. offset is the position of
+// data in the payload, so a payload can be unmasked piece by piece
+void ws_unmask(char *data, size_t len, const uint8_t mask[4], uint64_t offset);
+
+// frames of a server are not masked. a message may be sent in several
+// frames, the first with its opcode, the others WS_CONTINUATION, the
+// last with fin
+void append_ws_frame_header(std::string &out, int opcode, bool fin, uint64_t length);
+void append_ws_frame(std::string &out, int opcode, const char *data, size_t len);
+// CLOSE with code and reason, which is cut to fit a control frame
+void append_ws_close(std::string &out, int code, StrRef reason);
+
+// Sec-WebSocket-Accept answering Sec-WebSocket-Key
+std::string websocket_accept(StrRef key);
+
+// TEXT messages must be UTF-8, without overlong forms or surrogates
+bool valid_utf8(const char *p, size_t len);
+
+}
+
+#endif
@@ -6,54 +6,258 @@
 #ifdef HTTP_COMPRESSION
 #include <string>
 #include <cstring>
+#include <cstdlib>
 #include <stdexcept>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 
 #include <zlib.h>
+#include <strings.h>
 
-namespace tws{
+namespace {
 
-/** Compress a STL string using zlib with given compression level and return
-  * the binary data. */
-std::string zlib_compress(const std::string& str, int compressionlevel)
+// inputs below this use a stream with small window and hash table,
+// deflateReset clears the whole hash table, which costs more than
+// compressing a small body with the default one
+const size_t SMALL_INPUT = 8192;
+
+/* deflate streams of one thread, one for each format and size class 
+ * since window bits and memory level can only be chosen at deflateInit */
+class StreamCache
 {
-    z_stream zs;                        // z_stream is zlib's control structure
-    memset(&zs, 0, sizeof(zs));
+    z_stream zs_[3][2];
+    bool inited_[3][2];
+    int level_[3][2];
 
-    if (deflateInit(&zs, compressionlevel) != Z_OK)
-        throw(std::runtime_error("deflateInit failed while compressing."));
+public:
+    StreamCache()
+    {
+        for(int i = 0; i < 3; i++)
+            inited_[i][0] = inited_[i][1] = false;
+    }
 
-    zs.next_in = (Bytef*)str.data();
-    zs.avail_in = str.size();           // set the z_stream's input
+    ~StreamCache()
+    {
+        for(int i = 0; i < 3; i++) {
+            for(int j = 0; j < 2; j++) {
+                if (inited_[i][j])
+                    deflateEnd(&zs_[i][j]);
+            }
+        }
+    }
 
-    int ret;
-    char outbuffer[32768];
-    std::string outstring;
+    z_stream *get(int level, tws::CompressionFormat format, size_t input_size)
+    {
+        int small = input_size < SMALL_INPUT ? 1 : 0;
+        z_stream *zs = &zs_[format][small];
+        if (!inited_[format][small]) {
+            memset(zs, 0, sizeof(*zs));
+            // window bits for zlib format, +16 for gzip header
+            int bits = small ? 13 : 15;
+            if (format == tws::COMPRESS_GZIP)
+                bits += 16;
+            if (deflateInit2(zs, level, Z_DEFLATED, bits, small ? 5 : 8, 
+                        Z_DEFAULT_STRATEGY) != Z_OK)
+                return NULL;
+            inited_[format][small] = true;
+            level_[format][small] = level;
+            return zs;
+        }
+        deflateReset(zs);
+        if (level_[format][small] != level) {
+            // nothing is pending after reset, change level in place
+            if (deflateParams(zs, level, Z_DEFAULT_STRATEGY) != Z_OK)
+                return NULL;
+            level_[format][small] = level;
+        }
+        return zs;
+    }
+};
 
-    // retrieve the compressed bytes blockwise
-    do {
-        zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
-        zs.avail_out = sizeof(outbuffer);
+thread_local StreamCache stream_cache;
 
-        ret = deflate(&zs, Z_FINISH);
+bool prefix_nocase(const char *s, const char *end, const char *prefix)
+{
+    size_t n = strlen(prefix);
+    return (size_t)(end - s) >= n && strncasecmp(s, prefix, n) == 0;
+}
 
-        if (outstring.size() < zs.total_out) {
-            // append the block to the output string
-            outstring.append(outbuffer,
-                             zs.total_out - outstring.size());
+}
+
+namespace tws{
+
+bool compress_to(const char *data, size_t len, int level, 
+        CompressionFormat format, std::string &out)
+{
+    if (format == COMPRESS_NONE)
+        return false;
+    z_stream *zs = stream_cache.get(level, format, len);
+    if (zs == NULL)
+        return false;
+
+    // deflateBound is enough to finish in one call
+    out.resize(deflateBound(zs, len));
+    zs->next_in = (Bytef*)data;
+    zs->avail_in = len;
+    zs->next_out = (Bytef*)&out[0];
+    zs->avail_out = out.size();
+    int ret = deflate(zs, Z_FINISH);
+    if (ret != Z_STREAM_END) {
+        out.clear();
+        return false;
+    }
+    out.resize(zs->total_out);
+    return true;
+}
+
+CompressionFormat choose_compression(const char *accept_encoding, size_t len)
+{
+    const char *p = accept_encoding;
+    const char *end = accept_encoding + len;
+    double q_gzip = -1, q_deflate = -1, q_any = -1;
+
+    while (p < end) {
+        const char *item_end = (const char *)memchr(p, ',', end - p);
+        if (item_end == NULL)
+            item_end = end;
+        while (p < item_end && (*p == ' ' || *p == '\t'))
+            p++;
+        const char *name = p;
+        while (p < item_end && *p != ';' && *p != ' ' && *p != '\t')
+            p++;
+        size_t name_len = p - name;
+
+        double q = 1;
+        const char *param = (const char *)memchr(p, ';', item_end - p);
+        while (param) {
+            param++;
+            while (param < item_end && (*param == ' ' || *param == '\t'))
+                param++;
+            if (prefix_nocase(param, item_end, "q="))
+                q = atof(std::string(param + 2, item_end).c_str());
+            param = (const char *)memchr(param, ';', item_end - param);
         }
-    } while (ret == Z_OK);
 
-    deflateEnd(&zs);
+        if (name_len == 4 && strncasecmp(name, "gzip", 4) == 0)
+            q_gzip = q;
+        else if (name_len == 6 && strncasecmp(name, "x-gzip", 6) == 0)
+            q_gzip = q;
+        else if (name_len == 7 && strncasecmp(name, "deflate", 7) == 0)
+            q_deflate = q;
+        else if (name_len == 1 && *name == '*')
+            q_any = q;
+        p = item_end + 1;
+    }
 
-    if (ret != Z_STREAM_END) {          // an error occurred that was not EOF
-        std::ostringstream oss;
-        return "";
+    // "*" stands for the ones not listed
+    if (q_gzip < 0)
+        q_gzip = q_any;
+    if (q_deflate < 0)
+        q_deflate = q_any;
+    if (q_gzip <= 0 && q_deflate <= 0)
+        return COMPRESS_NONE;
+    return q_gzip >= q_deflate ? COMPRESS_GZIP : COMPRESS_DEFLATE;
+}
+
+bool compressible_type(const char *content_type, size_t len)
+{
+    static const char *skip[] = {
+        "image/", "video/", "audio/", "font/woff",
+        "application/zip", "application/gzip", "application/x-gzip",
+        "application/x-bzip2", "application/x-xz", "application/zstd",
+        "application/x-7z-compressed", "application/octet-stream",
+    };
+    const char *end = content_type + len;
+    for(size_t i = 0; i < sizeof(skip) / sizeof(skip[0]); i++) {
+        if (prefix_nocase(content_type, end, skip[i]))
+            // svg is text
+            return prefix_nocase(content_type, end, "image/svg");
     }
+    return true;
+}
 
-    return std::move(outstring);
+StreamCompressor::StreamCompressor()
+    : zs_(NULL),
+      format_(COMPRESS_NONE),
+      level_(0)
+{
+}
+
+StreamCompressor::~StreamCompressor()
+{
+    if (zs_) {
+        deflateEnd((z_stream *)zs_);
+        delete (z_stream *)zs_;
+    }
+}
+
+bool StreamCompressor::begin(int level, CompressionFormat format)
+{
+    if (format == COMPRESS_NONE)
+        return false;
+    z_stream *zs = (z_stream *)zs_;
+    if (zs && format == format_) {
+        deflateReset(zs);
+        if (level != level_ && deflateParams(zs, level, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        level_ = level;
+        return true;
+    }
+
+    if (zs) {
+        deflateEnd(zs);
+    } else {
+        zs = new z_stream;
+        zs_ = zs;
+    }
+    memset(zs, 0, sizeof(*zs));
+    int bits = (format == COMPRESS_GZIP) ? 15 + 16 : 15;
+    if (deflateInit2(zs, level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        delete zs;
+        zs_ = NULL;
+        return false;
+    }
+    format_ = format;
+    level_ = level;
+    return true;
+}
+
+bool StreamCompressor::compress(const char *data, size_t len, bool finish,
+        std::string &out)
+{
+    z_stream *zs = (z_stream *)zs_;
+    out.clear();
+    if (zs == NULL)
+        return false;
+
+    zs->next_in = (Bytef*)data;
+    zs->avail_in = len;
+    int flush = finish ? Z_FINISH : Z_SYNC_FLUSH;
+    int ret;
+    // room for flush marker and gzip trailer
+    size_t step = deflateBound(zs, len) + 32;
+    do {
+        size_t used = out.size();
+        out.resize(used + step);
+        zs->next_out = (Bytef*)&out[used];
+        zs->avail_out = step;
+        ret = deflate(zs, flush);
+        out.resize(out.size() - zs->avail_out);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+            return false;
+    } while (zs->avail_out == 0);
+    return !finish || ret == Z_STREAM_END;
+}
+
+/** Compress a STL string using zlib with given compression level and return
+  * the binary data. */
+std::string zlib_compress(const std::string& str, int compressionlevel)
+{
+    std::string outstring;
+    compress_to(str.data(), str.size(), compressionlevel, 
+            COMPRESS_DEFLATE, outstring);
+    return outstring;
 }
 
 /** Decompress an STL string using zlib and return the original data. */
@@ -93,7 +297,7 @@ std::string zlib_decompress(const std::string& str)
         return "";
     }
 
-    return std::move(outstring);
+    return outstring;
 }
 
 }
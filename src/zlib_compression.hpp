@@ -5,11 +5,48 @@
 
 namespace tws{
 
+enum CompressionFormat {
+    COMPRESS_NONE,
+    COMPRESS_DEFLATE, // zlib stream, "Content-Encoding: deflate"
+    COMPRESS_GZIP,
+};
+
 std::string zlib_compress(const std::string& str,
                             int compressionlevel = 5);
 
 std::string zlib_decompress(const std::string& str);
 
+/** Compress data into out, which is resized to the compressed size.
+  * z_streams are kept per thread and reused with deflateReset, only
+  * the first call of each thread pays deflateInit. */
+bool compress_to(const char *data, size_t len, int level, 
+        CompressionFormat format, std::string &out);
+
+/** Pick the encoding from an Accept-Encoding value by its q-values,
+  * gzip is preferred on tie. */
+CompressionFormat choose_compression(const char *accept_encoding, size_t len);
+
+/** false for types which are compressed already, like images and archives */
+bool compressible_type(const char *content_type, size_t len);
+
+/** Incremental compression of a body sent in pieces, every piece is
+  * flushed so client can decode it on arrival. Owned by one response
+  * at a time, but may be called from different threads one after another */
+class StreamCompressor
+{
+    void *zs_;
+    CompressionFormat format_;
+    int level_;
+
+public:
+    StreamCompressor();
+    ~StreamCompressor();
+
+    bool begin(int level, CompressionFormat format);
+    // compressed bytes are put in out (replacing its content)
+    bool compress(const char *data, size_t len, bool finish, std::string &out);
+};
+
 }
 
 #endif